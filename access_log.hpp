@@ -0,0 +1,335 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "asio.hpp"
+
+namespace bb {
+	// Writes a line per response, and errors, to a file, e.g.
+	//   AccessLog::Options o;
+	//   o.path = "access.log";
+	//   server.access_log(o);
+	// The threads serving requests never format or write anything. Each one copies fixed size
+	// records into a ring of its own, which only it writes, and a thread of the log's own
+	// drains the rings and writes what it finds in batches. A ring that is full drops the
+	// record rather than wait, and the drops are counted in the log.
+	class AccessLog
+	{
+	public:
+		typedef std::chrono::system_clock clock;
+
+		enum class Format {
+			Json,   // one object per line
+			Common, // the Common Log Format of httpd, with errors on lines of their own
+		};
+
+		struct Options {
+			std::string path = "access.log"; // "-" for standard output
+			Format format = Format::Json;
+			// Keeps one in this many responses. Those with a status of 400 or more are all kept,
+			// as are errors.
+			unsigned int sample = 1;
+			// Records per thread, rounded up to a power of two
+			std::size_t ring_size = 4096;
+			// How often the rings are drained
+			std::chrono::milliseconds flush_interval{ 100 };
+		};
+
+		AccessLog() : AccessLog(Options()) { }
+		explicit AccessLog(Options options) : options(std::move(options)), serial(next_serial()) {
+			if (this->options.sample == 0)
+				this->options.sample = 1;
+			mask = 1;
+			while (mask < this->options.ring_size)
+				mask <<= 1;
+			--mask;
+			file = this->options.path == "-" ? stdout : std::fopen(this->options.path.c_str(), "a");
+			writer = std::thread([this]() { run(); });
+		}
+
+		AccessLog(AccessLog const&) = delete;
+		AccessLog& operator=(AccessLog const&) = delete;
+
+		// Writes out whatever is still in the rings
+		~AccessLog() {
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				stopping = true;
+			}
+			wake.notify_one();
+			writer.join();
+			if (file && file != stdout)
+				std::fclose(file);
+		}
+
+		// Whether the file could be opened. Without it records are drained and thrown away.
+		bool is_open() const { return file != nullptr; }
+
+		// took is the time from the request being handed to its route to its response
+		void access(asio::ip::address const& remote, std::string_view method, std::string_view path, unsigned int minor_version, int status, std::uint64_t bytes, std::chrono::steady_clock::duration took) {
+			auto& r = local();
+			if (status < 400 && options.sample > 1 && ++r.seen % options.sample != 0)
+				return;
+			auto rec = r.claim();
+			if (!rec)
+				return;
+			rec->time = clock::now().time_since_epoch().count();
+			rec->duration = std::chrono::duration_cast<std::chrono::microseconds>(took).count();
+			rec->remote = remote;
+			rec->bytes = bytes;
+			rec->status = static_cast<std::uint16_t>(status);
+			rec->minor = static_cast<std::uint8_t>(minor_version);
+			rec->method_len = static_cast<std::uint8_t>(copy(rec->method, sizeof(rec->method), method));
+			rec->text_len = static_cast<std::uint16_t>(copy(rec->text, sizeof(rec->text), path));
+			rec->truncated = path.size() > sizeof(rec->text);
+			r.publish();
+		}
+
+		void error(std::string_view message, asio::ip::address const& remote = asio::ip::address()) {
+			auto& r = local();
+			auto rec = r.claim();
+			if (!rec)
+				return;
+			rec->time = clock::now().time_since_epoch().count();
+			rec->remote = remote;
+			rec->status = 0;
+			rec->text_len = static_cast<std::uint16_t>(copy(rec->text, sizeof(rec->text), message));
+			rec->truncated = message.size() > sizeof(rec->text);
+			r.publish();
+		}
+
+		// Records lost to full rings so far
+		std::uint64_t dropped() const {
+			std::lock_guard<std::mutex> lock(mutex);
+			std::uint64_t n = 0;
+			for (auto& r : rings) {
+				n += r->dropped.load(std::memory_order_relaxed);
+			}
+			return n;
+		}
+
+	private:
+		struct Record {
+			std::int64_t time;     // clock ticks since the epoch
+			std::int64_t duration; // microseconds
+			asio::ip::address remote;
+			std::uint64_t bytes;
+			std::uint16_t status;  // 0 for an error
+			std::uint8_t minor;
+			std::uint8_t method_len;
+			std::uint16_t text_len;
+			bool truncated;
+			char method[15];
+			char text[160];        // the path, or the message of an error
+		};
+
+		// Written by one thread and read by the log's own, so it needs no lock
+		struct alignas(64) Ring {
+			explicit Ring(std::size_t size) : records(size) { }
+
+			Record* claim() {
+				auto h = head.load(std::memory_order_relaxed);
+				if (h - tail.load(std::memory_order_acquire) > mask()) {
+					dropped.store(dropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+					return nullptr;
+				}
+				return &records[h & mask()];
+			}
+
+			void publish() { head.store(head.load(std::memory_order_relaxed) + 1, std::memory_order_release); }
+
+			std::size_t mask() const { return records.size() - 1; }
+
+			std::vector<Record> records;
+			std::thread::id thread;
+			std::uint64_t seen = 0; // for sampling
+			alignas(64) std::atomic<std::uint64_t> head{ 0 };
+			std::atomic<std::uint64_t> dropped{ 0 };
+			alignas(64) std::atomic<std::uint64_t> tail{ 0 };
+		};
+
+		// The calling thread's ring, found the way Metrics finds its blocks
+		Ring& local() {
+			struct Cache {
+				std::uint64_t serial = 0;
+				Ring* ring = nullptr;
+			};
+			static thread_local Cache cache;
+			if (cache.serial != serial) {
+				auto id = std::this_thread::get_id();
+				std::lock_guard<std::mutex> lock(mutex);
+				auto it = std::find_if(rings.begin(), rings.end(), [id](auto& r) { return r->thread == id; });
+				if (it == rings.end()) {
+					rings.push_back(std::make_unique<Ring>(mask + 1));
+					rings.back()->thread = id;
+					it = rings.end() - 1;
+				}
+				cache.ring = it->get();
+				cache.serial = serial;
+			}
+			return *cache.ring;
+		}
+
+		static std::uint64_t next_serial() {
+			static std::atomic<std::uint64_t> n{ 0 };
+			return ++n;
+		}
+
+		static std::size_t copy(char* to, std::size_t cap, std::string_view from) {
+			auto n = std::min(cap, from.size());
+			std::memcpy(to, from.data(), n);
+			return n;
+		}
+
+		void run() {
+			std::string batch;
+			std::uint64_t reported = 0;
+			std::unique_lock<std::mutex> lock(mutex);
+			for (;;) {
+				auto last = stopping;
+				// Rings are only ever added, so the ones seen now stay valid without the lock
+				std::vector<Ring*> now;
+				for (auto& r : rings) {
+					now.push_back(r.get());
+				}
+				lock.unlock();
+
+				batch.clear();
+				std::uint64_t lost = 0;
+				for (auto r : now) {
+					auto t = r->tail.load(std::memory_order_relaxed);
+					auto h = r->head.load(std::memory_order_acquire);
+					for (; t != h; ++t) {
+						format(batch, r->records[t & r->mask()]);
+					}
+					r->tail.store(t, std::memory_order_release);
+					lost += r->dropped.load(std::memory_order_relaxed);
+				}
+				if (lost != reported) {
+					format_dropped(batch, lost - reported);
+					reported = lost;
+				}
+				if (file && !batch.empty()) {
+					std::fwrite(batch.data(), 1, batch.size(), file);
+					std::fflush(file);
+				}
+
+				lock.lock();
+				if (last)
+					return;
+				wake.wait_for(lock, options.flush_interval, [this]() { return stopping; });
+			}
+		}
+
+		void format(std::string& out, Record const& r) const {
+			char buf[64];
+			if (options.format == Format::Json) {
+				out += "{\"time\":\"";
+				out.append(buf, timestamp(buf, r.time, "%Y-%m-%dT%H:%M:%S", true));
+				out += '"';
+				if (!r.remote.is_unspecified()) {
+					out += ",\"remote\":\"" + r.remote.to_string() + '"';
+				}
+				if (r.status == 0) {
+					out += ",\"error\":\"";
+					json_escape(out, std::string_view(r.text, r.text_len), r.truncated);
+					out += "\"}\n";
+					return;
+				}
+				out += ",\"method\":\"";
+				json_escape(out, std::string_view(r.method, r.method_len), false);
+				out += "\",\"path\":\"";
+				json_escape(out, std::string_view(r.text, r.text_len), r.truncated);
+				out += "\",\"status\":" + std::to_string(r.status) + ",\"bytes\":" + std::to_string(r.bytes) + ",\"duration_us\":" + std::to_string(r.duration) + "}\n";
+			}
+			else {
+				// host ident authuser [date] "request" status bytes
+				out += r.remote.is_unspecified() ? "-" : r.remote.to_string();
+				out += " - - [";
+				out.append(buf, timestamp(buf, r.time, "%d/%b/%Y:%H:%M:%S +0000", false));
+				out += "] ";
+				if (r.status == 0) {
+					out += "error: ";
+					out.append(r.text, r.text_len);
+					out += r.truncated ? "...\n" : "\n";
+					return;
+				}
+				out += '"';
+				out.append(r.method, r.method_len) += ' ';
+				out.append(r.text, r.text_len);
+				out += r.truncated ? "..." : "";
+				out += " HTTP/1." + std::to_string(r.minor) + "\" " + std::to_string(r.status) + ' ';
+				out += r.bytes ? std::to_string(r.bytes) : "-";
+				out += '\n';
+			}
+		}
+
+		void format_dropped(std::string& out, std::uint64_t n) const {
+			Record r{};
+			auto msg = std::to_string(n) + " log records dropped, the rings were full";
+			r.time = clock::now().time_since_epoch().count();
+			r.text_len = static_cast<std::uint16_t>(copy(r.text, sizeof(r.text), msg));
+			format(out, r);
+		}
+
+		// UTC, with milliseconds if asked for
+		static std::size_t timestamp(char (&buf)[64], std::int64_t time, char const* layout, bool millis) {
+			auto tp = clock::time_point(clock::duration(time));
+			auto t = clock::to_time_t(tp);
+			std::tm tm;
+#if defined(_WIN32)
+			gmtime_s(&tm, &t);
+#else
+			gmtime_r(&t, &tm);
+#endif // defined(_WIN32)
+			auto n = std::strftime(buf, sizeof(buf), layout, &tm);
+			if (millis) {
+				auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(tp.time_since_epoch()).count() % 1000;
+				n += std::snprintf(buf + n, sizeof(buf) - n, ".%03dZ", static_cast<int>(ms));
+			}
+			return n;
+		}
+
+		static void json_escape(std::string& out, std::string_view s, bool truncated) {
+			for (unsigned char c : s) {
+				if (c == '"' || c == '\\') {
+					out += '\\';
+					out += static_cast<char>(c);
+				}
+				else if (c < 0x20) {
+					char esc[8];
+					std::snprintf(esc, sizeof(esc), "\\u%04x", c);
+					out += esc;
+				}
+				else {
+					out += static_cast<char>(c);
+				}
+			}
+			if (truncated)
+				out += "...";
+		}
+
+		Options options;
+		std::uint64_t serial;
+		std::size_t mask;
+		std::FILE* file;
+		mutable std::mutex mutex;
+		std::condition_variable wake;
+		bool stopping = false;
+		std::vector<std::unique_ptr<Ring>> rings;
+		std::thread writer;
+	}; // class AccessLog
+} // namespace bb
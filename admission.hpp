@@ -0,0 +1,131 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+namespace bb {
+	// The most requests a route handles at once, e.g.
+	//   server.add_route("/fwd/{host}", Methods::GET, forward, ConcurrencyLimit{ 64 });
+	// Requests past it are answered with 503 and never reach the handler. A request counts
+	// until its response is given.
+	// With a target latency the limit adapts between min_in_flight and max_in_flight: it
+	// grows by one for every limit's worth of requests answered within the target, and
+	// shrinks by a tenth when one takes longer, at most once per target.
+	struct ConcurrencyLimit {
+		std::size_t max_in_flight;
+		std::chrono::steady_clock::duration target_latency = std::chrono::steady_clock::duration::zero();
+		std::size_t min_in_flight = 1;
+	};
+
+	// Requests a second a route accepts, in bursts of up to burst, e.g.
+	//   server.add_route("/login", Methods::POST, login, RateLimit{ 20, 5 });
+	// Requests past it are answered with 429.
+	struct RateLimit {
+		double per_second;
+		double burst = 1;
+	};
+
+	// The admission state of a route, shared by every connection that requests it.
+	// Deciding costs a couple of atomic operations, and no locks.
+	class RouteGate
+	{
+	public:
+		typedef std::chrono::steady_clock clock;
+
+		enum class Verdict { Admit, Busy, Limited };
+
+		void set(ConcurrencyLimit const& l) {
+			max_in_flight = std::max<std::size_t>(l.max_in_flight, 1);
+			min_in_flight = std::min(std::max<std::size_t>(l.min_in_flight, 1), max_in_flight);
+			target = l.target_latency;
+			limit.store(max_in_flight, std::memory_order_relaxed);
+		}
+
+		void set(RateLimit const& l) {
+			if (l.per_second <= 0)
+				return;
+			interval = std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(1 / l.per_second)).count();
+			tolerance = static_cast<std::int64_t>(interval * (std::max(l.burst, 1.0) - 1));
+		}
+
+		// Admit is to be followed by leave() or abandon() once the request is done with
+		Verdict enter(clock::time_point now) {
+			if (interval && !take_token(now.time_since_epoch().count()))
+				return Verdict::Limited;
+			if (max_in_flight) {
+				if (in_flight.fetch_add(1, std::memory_order_relaxed) >= limit.load(std::memory_order_relaxed)) {
+					in_flight.fetch_sub(1, std::memory_order_relaxed);
+					return Verdict::Busy;
+				}
+			}
+			return Verdict::Admit;
+		}
+
+		// The request was answered, took after it was admitted
+		void leave(clock::duration took) {
+			if (!max_in_flight)
+				return;
+			in_flight.fetch_sub(1, std::memory_order_relaxed);
+			if (target != clock::duration::zero())
+				adapt(took);
+		}
+
+		// The request went away unanswered, which says nothing about how long answers take
+		void abandon() {
+			if (max_in_flight)
+				in_flight.fetch_sub(1, std::memory_order_relaxed);
+		}
+
+		std::size_t current_limit() const { return limit.load(std::memory_order_relaxed); }
+		std::size_t current_in_flight() const { return in_flight.load(std::memory_order_relaxed); }
+
+	private:
+		// The generic cell rate algorithm: a token bucket kept as the time at which it will be
+		// full again, so taking a token is a single compare and swap
+		bool take_token(std::int64_t now) {
+			auto tat = full_at.load(std::memory_order_relaxed);
+			for (;;) {
+				auto from = std::max(tat, now);
+				if (from - now > tolerance)
+					return false;
+				if (full_at.compare_exchange_weak(tat, from + interval, std::memory_order_relaxed))
+					return true;
+			}
+		}
+
+		// Additive increase, multiplicative decrease. Updates racing each other may lose one,
+		// which only slows the adapting down a little.
+		void adapt(clock::duration took) {
+			auto l = limit.load(std::memory_order_relaxed);
+			if (took <= target) {
+				if (answered.fetch_add(1, std::memory_order_relaxed) + 1 >= l) {
+					answered.store(0, std::memory_order_relaxed);
+					if (l < max_in_flight)
+						limit.store(l + 1, std::memory_order_relaxed);
+				}
+				return;
+			}
+			auto now = clock::now().time_since_epoch().count();
+			auto last = last_decrease.load(std::memory_order_relaxed);
+			if (now - last < target.count() || !last_decrease.compare_exchange_strong(last, now, std::memory_order_relaxed))
+				return;
+			limit.store(std::max(min_in_flight, l - std::max<std::size_t>(l / 10, 1)), std::memory_order_relaxed);
+			answered.store(0, std::memory_order_relaxed);
+		}
+
+		// Set up when the route is added, read only afterwards
+		std::size_t max_in_flight = 0; // 0 for no concurrency limit
+		std::size_t min_in_flight = 1;
+		clock::duration target = clock::duration::zero();
+		std::int64_t interval = 0;     // clock ticks per token, 0 for no rate limit
+		std::int64_t tolerance = 0;    // ticks the bucket may be drawn ahead
+
+		std::atomic<std::size_t> limit{ 0 };
+		std::atomic<std::size_t> in_flight{ 0 };
+		std::atomic<std::size_t> answered{ 0 };
+		std::atomic<std::int64_t> last_decrease{ 0 };
+		std::atomic<std::int64_t> full_at{ 0 };
+	}; // class RouteGate
+} // namespace bb
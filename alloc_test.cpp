@@ -0,0 +1,88 @@
+// Checks that a keep-alive connection stops allocating once it has warmed up: global
+// operator new is counted over 10000 requests after the first hundred, and has to stay at zero.
+//   g++ -std=c++17 -O2 alloc_test.cpp -o alloc_test -lpthread
+//   alloc_test
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <new>
+#include <string_view>
+#include <thread>
+
+#define ASIO_STANDALONE 1
+#define ASIO_NO_DEPRECATED 1
+
+#include "server.hpp"
+
+static std::atomic<unsigned long> allocations{ 0 };
+
+void* operator new(std::size_t n) {
+	allocations.fetch_add(1, std::memory_order_relaxed);
+	if (void* p = std::malloc(n ? n : 1))
+		return p;
+	throw std::bad_alloc();
+}
+
+// Not inlined, or GCC takes the free() for one of a pointer from new
+__attribute__((noinline)) void operator delete(void* p) noexcept { std::free(p); }
+__attribute__((noinline)) void operator delete(void* p, std::size_t) noexcept { std::free(p); }
+
+using namespace bb;
+
+static char const hello[] = "hello";
+
+int main() {
+	Server s(0);
+	s.add_route("/", Methods::GET, [](Captures const&, Methods, Connection::ptr con) {
+		Response r(200);
+		r.header("Content-Type", "text/plain").body_ref(asio::buffer(hello, 5));
+		con->send_response(std::move(r));
+	});
+	s.add_route("/u/{id:int}", Methods::GET, [](Captures const& caps, Methods, Connection::ptr con) {
+		Response r(200);
+		r.body(caps[1]);
+		con->send_response(std::move(r));
+	});
+	std::thread server_thread([&s]() { s.run(1); });
+	std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+	// Blocking reads and writes into fixed buffers, so the client does not allocate either
+	asio::io_context io;
+	asio::ip::tcp::socket sock(io);
+	sock.connect({ asio::ip::address_v4::loopback(), s.port() });
+	static char const* const reqs[] = {
+		"GET / HTTP/1.1\r\nHost: x\r\nUser-Agent: test-agent-with-a-long-name/1.0\r\nAccept: */*\r\n\r\n",
+		"GET /u/12345 HTTP/1.1\r\nHost: x\r\n\r\n",
+	};
+	static char const* const bodies[] = { "hello", "12345" };
+	char buf[4096];
+	auto requests = [&](unsigned int n) {
+		for (unsigned int i = 0; i < n; ++i) {
+			asio::write(sock, asio::buffer(reqs[i % 2], std::strlen(reqs[i % 2])));
+			std::size_t got = 0;
+			do {
+				got += sock.read_some(asio::buffer(buf + got, sizeof(buf) - got));
+			} while (std::string_view(buf, got).find(std::string_view("\r\n\r\n")) == std::string_view::npos
+				|| std::string_view(buf, got).substr(got - 5) != bodies[i % 2]);
+		}
+	};
+
+	requests(100);
+	auto before = allocations.load();
+	requests(10000);
+	auto during = allocations.load() - before;
+
+	std::cout << "allocations during 10000 requests: " << during
+		<< " (arena blocks " << AllocCounters::arena_blocks
+		<< ", handler fallbacks " << AllocCounters::handler_fallbacks
+		<< ", buffer pool misses " << AllocCounters::buffer_pool_misses << ")\n";
+
+	sock.close();
+	s.stop();
+	server_thread.join();
+	std::cout << (during == 0 ? "passed\n" : "failed\n");
+	return during == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
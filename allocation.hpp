@@ -0,0 +1,183 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <memory_resource>
+#include <new>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace bb {
+	// Counts the times the pools below had to go to the heap. Once a server has warmed up
+	// these should stop moving.
+	struct AllocCounters {
+		static inline std::atomic<std::uint64_t> arena_blocks{ 0 };
+		static inline std::atomic<std::uint64_t> handler_fallbacks{ 0 };
+		static inline std::atomic<std::uint64_t> buffer_pool_misses{ 0 };
+
+		static void count(std::atomic<std::uint64_t>& c) { c.fetch_add(1, std::memory_order_relaxed); }
+	};
+
+	// Monotonic memory for the lifetime of a single request.
+	// Nothing is freed until reset(), which makes all of it available again while keeping
+	// any blocks that had to be taken from the heap, so a keep-alive connection stops
+	// allocating once it has seen its largest request.
+	class Arena : public std::pmr::memory_resource
+	{
+	public:
+		Arena() = default;
+		Arena(Arena const&) = delete;
+		Arena& operator=(Arena const&) = delete;
+
+		void reset() {
+			cur = first;
+			left = sizeof(first);
+			next_block = 0;
+		}
+
+		// Copies s into the arena
+		std::string_view copy(std::string_view s) {
+			auto p = static_cast<char*>(allocate(s.size() ? s.size() : 1, 1));
+			std::memcpy(p, s.data(), s.size());
+			return std::string_view(p, s.size());
+		}
+
+	private:
+		struct Block {
+			std::unique_ptr<char[]> mem;
+			std::size_t size;
+		};
+
+		void* do_allocate(std::size_t bytes, std::size_t alignment) override {
+			for (;;) {
+				void* p = cur;
+				if (std::align(alignment, bytes, p, left)) {
+					cur = static_cast<char*>(p) + bytes;
+					left -= bytes;
+					return p;
+				}
+				next(bytes + alignment);
+			}
+		}
+
+		void do_deallocate(void*, std::size_t, std::size_t) override { }
+
+		bool do_is_equal(std::pmr::memory_resource const& other) const noexcept override { return this == &other; }
+
+		// Moves on to the next block that is big enough, taking a new one from the heap if there is none
+		void next(std::size_t need) {
+			while (next_block < blocks.size()) {
+				auto& b = blocks[next_block++];
+				if (b.size >= need) {
+					cur = b.mem.get();
+					left = b.size;
+					return;
+				}
+			}
+			auto size = need > block_size ? need : block_size;
+			blocks.push_back({ std::make_unique<char[]>(size), size });
+			AllocCounters::count(AllocCounters::arena_blocks);
+			next_block = blocks.size();
+			cur = blocks.back().mem.get();
+			left = size;
+		}
+
+		static constexpr std::size_t block_size = 4096;
+
+		alignas(std::max_align_t) char first[2048];
+		char* cur = first;
+		std::size_t left = sizeof(first);
+		std::vector<Block> blocks;
+		std::size_t next_block = 0;
+	}; // class Arena
+
+	// Memory for the completion handler of one outstanding asio operation.
+	// asio frees an operation's memory before calling its handler, so a chain of operations
+	// where each one starts the next keeps reusing the same slot.
+	class HandlerMemory
+	{
+	public:
+		HandlerMemory() = default;
+		HandlerMemory(HandlerMemory const&) = delete;
+		HandlerMemory& operator=(HandlerMemory const&) = delete;
+
+		void* allocate(std::size_t size) {
+			if (!in_use && size <= sizeof(storage)) {
+				in_use = true;
+				return &storage;
+			}
+			AllocCounters::count(AllocCounters::handler_fallbacks);
+			return ::operator new(size);
+		}
+
+		void deallocate(void* p) {
+			if (p == &storage) {
+				in_use = false;
+			}
+			else {
+				::operator delete(p);
+			}
+		}
+
+	private:
+		std::aligned_storage_t<512> storage;
+		bool in_use = false;
+	}; // class HandlerMemory
+
+	template<typename T>
+	class HandlerAllocator
+	{
+	public:
+		typedef T value_type;
+
+		explicit HandlerAllocator(HandlerMemory& mem) : mem(&mem) { }
+
+		template<typename U>
+		HandlerAllocator(HandlerAllocator<U> const& other) noexcept : mem(other.mem) { }
+
+		T* allocate(std::size_t n) const { return static_cast<T*>(mem->allocate(sizeof(T) * n)); }
+		void deallocate(T* p, std::size_t) const { mem->deallocate(p); }
+
+		template<typename U>
+		bool operator==(HandlerAllocator<U> const& other) const noexcept { return mem == other.mem; }
+
+		template<typename U>
+		bool operator!=(HandlerAllocator<U> const& other) const noexcept { return mem != other.mem; }
+
+	private:
+		template<typename> friend class HandlerAllocator;
+
+		HandlerMemory* mem;
+	}; // class HandlerAllocator
+
+	// Wraps a completion handler so asio allocates its operation from the given slot
+	template<typename Handler>
+	class AllocHandler
+	{
+	public:
+		typedef HandlerAllocator<Handler> allocator_type;
+
+		AllocHandler(HandlerMemory& mem, Handler h) : mem(mem), handler(std::move(h)) { }
+
+		allocator_type get_allocator() const noexcept { return allocator_type(mem); }
+
+		template<typename ... Args>
+		void operator()(Args&& ... args) {
+			handler(std::forward<Args>(args)...);
+		}
+
+	private:
+		HandlerMemory& mem;
+		Handler handler;
+	}; // class AllocHandler
+
+	template<typename Handler>
+	AllocHandler<std::decay_t<Handler>> alloc_handler(HandlerMemory& mem, Handler&& h) {
+		return AllocHandler<std::decay_t<Handler>>(mem, std::forward<Handler>(h));
+	}
+} // namespace bb
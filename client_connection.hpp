@@ -1,9 +1,8 @@
 #pragma once
 
+#include <functional>
 #include <string>
-#include <iostream>
 #include <memory>
-#include <regex>
 
 #include "asio.hpp"
 
@@ -11,21 +10,27 @@
 #include "methods.hpp"
 
 namespace bb {
+	class ClientPool;
+
 	class ClientConnection : public http_connection_base<ClientConnection>
 	{
 	public:
 		typedef std::function<void(ptr)> HandlerFunc;
+		typedef std::function<void(asio::error_code, ptr)> ResultFunc;
 
 		template<typename ... T>
 		static ptr new_connection(T&& ... all) {
 			return std::shared_ptr<ClientConnection>(new ClientConnection(std::forward<T>(all)...));
 		}
 
-		void send_request(asio::streambuf resp, HandlerFunc func) {
-			handler = std::move(func);
-			send_buf = std::move(resp);
-			retries = 1;
-			send_req_impl();
+		// req is a complete request, head and body.
+		// func is only called once the response has arrived, and not at all on errors.
+		void send_request(std::string req, HandlerFunc func) {
+			send_request_impl(std::move(req), [func{ std::move(func) }](asio::error_code ec, ptr con) {
+				if (!ec) {
+					func(std::move(con));
+				}
+			});
 		}
 
 		void send_request(std::string const& uri, std::string const& headers, HandlerFunc func) {
@@ -33,33 +38,124 @@ namespace bb {
 		}
 
 		void send_request(Methods method, std::string const& uri, std::string const& headers, std::string const& body, HandlerFunc func) {
-			asio::streambuf resp_buf;
-			std::ostream os(&resp_buf);
-			os << name_from_method(method) << ' ' << uri << " HTTP/1.1\r\nHost: " << host << "\r\nContent-Length: " << body.length() << "\r\n" << headers << "\r\n" << body;
-			send_request(std::move(resp_buf), std::move(func));
+			send_request(make_request(method, uri, headers, body), std::move(func));
+		}
+
+		// send_request() for any completion token, e.g. asio::use_awaitable. Completes with
+		// (asio::error_code, ptr), and with an error if the response could not be had.
+		template<typename CompletionToken>
+		auto async_send_request(std::string req, CompletionToken&& token) {
+			return asio::async_initiate<CompletionToken, void(asio::error_code, ptr)>([this, self{ shared_from_this() }](auto handler, std::string req) {
+				send_request_impl(std::move(req), shared_handler(std::move(handler), get_executor()));
+			}, token, std::move(req));
+		}
+
+		template<typename CompletionToken>
+		auto async_send_request(std::string const& uri, std::string const& headers, CompletionToken&& token) {
+			return async_send_request(make_request(Methods::GET, uri, headers, ""), std::forward<CompletionToken>(token));
+		}
+
+		template<typename CompletionToken>
+		auto async_send_request(Methods method, std::string const& uri, std::string const& headers, std::string const& body, CompletionToken&& token) {
+			return async_send_request(make_request(method, uri, headers, body), std::forward<CompletionToken>(token));
+		}
+
+		// async_send_request() that completes as soon as the head of the response is in. The
+		// body is then read a piece at a time with read_body(), which holds the upstream back
+		// for as long as the pieces are not asked for, e.g. to pass a body of any size on
+		// without keeping it. It is not held to Limits::max_body_size. The connection is busy
+		// until the body has been read to its end, and is not reused if it is given up before.
+		template<typename CompletionToken>
+		auto async_stream_request(std::string req, CompletionToken&& token) {
+			return asio::async_initiate<CompletionToken, void(asio::error_code, ptr)>([this, self{ shared_from_this() }](auto handler, std::string req) {
+				send_request_impl(std::move(req), shared_handler(std::move(handler), get_executor()), true);
+			}, token, std::move(req));
+		}
+
+		template<typename CompletionToken>
+		auto async_stream_request(Methods method, std::string const& uri, std::string const& headers, std::string const& body, CompletionToken&& token) {
+			return async_stream_request(make_request(method, uri, headers, body), std::forward<CompletionToken>(token));
 		}
 
 		unsigned int status() { return stat; }
 
+		// Gives up on the request under way, whose handler is called with operation_aborted.
+		// The connection is closed, since the response may still be on its way. Has to be
+		// called on the connection's executor.
+		void cancel() {
+			if (handler) {
+				fail(asio::error::operation_aborted);
+			}
+		}
+
+		// Whether another request can follow the last response on this connection
+		bool reusable() const {
+			if (!socket.is_open() || !body_decoder.done())
+				return false;
+			if (rcv_headers.has_token(KnownHeader::Connection, "close"))
+				return false;
+			return parser.minor_version() >= 1 || rcv_headers.has_token(KnownHeader::Connection, "keep-alive");
+		}
+
 	private:
 		friend http_connection_base<ClientConnection>;
+		friend ClientPool;
+
+		std::string make_request(Methods method, std::string const& uri, std::string const& headers, std::string const& body) const {
+			return name_from_method(method) + ' ' + uri + " HTTP/1.1\r\nHost: " + host + "\r\nContent-Length: " + std::to_string(body.length()) + "\r\n" + headers + "\r\n" + body;
+		}
+
+		void send_request_impl(std::string req, ResultFunc func, bool head_only = false) {
+			handler = std::move(func);
+			stream_body = head_only;
+			send_buf = std::move(req);
+			retries = 1;
+			send_req_impl();
+		}
 
-		ClientConnection(asio::io_context& context, std::string host_url, std::string const& port)
-		  : http_connection_base(asio::ip::tcp::socket(context)),
+		// Hands the error to the waiting handler, after which the connection is of no more use
+		void fail(asio::error_code ec) {
+			asio::error_code ignored;
+			socket.close(ignored);
+			if (handler) {
+				auto h = std::move(handler);
+				handler = nullptr;
+				h(ec, shared_from_this());
+			}
+		}
+
+		// A pooled connection goes back to the pool once nobody holds it and no request is under way
+		void release_if_idle() {
+			if (!handler && !leased && release && reusable()) {
+				release(shared_from_this());
+			}
+		}
+
+		// context can be an io_context or an executor, e.g. that of the server connection this one serves
+		template<typename Context>
+		ClientConnection(Context&& context, std::string host_url, std::string const& port)
+		  : http_connection_base(socket_type(context), HttpParser::Kind::Response),
 			endpoints(asio::ip::tcp::resolver(context).resolve(host_url, port)),
 			host(std::move(host_url))
 		{ }
 
+		// endpoints were resolved already, e.g. by a ClientPool
+		ClientConnection(executor_type const& ex, asio::ip::tcp::resolver::results_type endpoints, std::string host_name)
+		  : http_connection_base(socket_type(ex), HttpParser::Kind::Response),
+			endpoints(std::move(endpoints)),
+			host(std::move(host_name))
+		{ }
+
 		void connect_send() {
 			if (retries--) {
-				asio::async_connect(socket, endpoints, [this, self{ shared_from_this() }](auto ec, auto) mutable {
+				asio::async_connect(socket, endpoints, alloc_handler(handler_mem, [this, self{ shared_from_this() }](auto ec, auto) mutable {
 					if (handle_error(ec)) {
 						send_req_impl();
 					}
-				});
+				}));
 			}
 			else {
-				std::cerr << "Could not connect\n";
+				fail(asio::error::not_connected);
 			}
 		}
 
@@ -68,70 +164,96 @@ namespace bb {
 				connect_send();
 			}
 			else {
-				asio::async_write(socket, send_buf.data(), [this, self{ shared_from_this() }](auto ec, auto) {
+				asio::async_write(socket, asio::buffer(send_buf), alloc_handler(handler_mem, [this, self{ shared_from_this() }](auto ec, auto) {
 					if (handle_error(ec)) {
 						get_resp();
 					}
-				});
+				}));
 			}
 		}
 
 		void get_resp() {
-			asio::async_read_until(socket, buf_in, "\r\n", [this, self{ shared_from_this() }](auto ec, auto) {
+			next_message();
+			socket.async_read_some(buf_in.prepare(read_size), alloc_handler(handler_mem, [this, self{ shared_from_this() }](auto ec, auto n) {
 #if defined(ASIO_WINDOWS) || defined(__CYGWIN__)
 				static const auto closed_error = asio::error::connection_aborted;
 #else
 				static const auto closed_error = asio::error::eof;
 #endif
+				buf_in.commit(n);
 				if (ec == closed_error) {
 					connect_send();
 				}
 				else if (handle_error(ec)) {
-					send_buf.consume(send_buf.size());
-					std::istream is(&buf_in);
-					std::string line;
-					std::getline(is, line);
-
-					std::smatch parts;
-					if (std::regex_match(line, parts, re_resp)) {
-						stat = std::stoul(parts[1]);
-						get_headers();
-					}
-					else {
-						// not HTTP, just close connection
-					}
+					send_buf.clear();
+					parse_head();
 				}
-			});
+			}));
+		}
+
+		void handle_head() {
+			stat = parser.status();
+			if (!start_body(!stream_body))
+				return;
+			if (!stream_body) {
+				get_body();
+				return;
+			}
+			// The body is the caller's to read
+			auto h = std::move(handler);
+			handler = nullptr;
+			h(asio::error_code(), shared_from_this());
 		}
 
+		// A response cut short by the server closing the connection is an error too.
+		// Its closing it before the response started is dealt with by get_resp().
+		// Errors go to the handler, for the caller to report or work around.
 		bool handle_error(asio::error_code err) {
 			if (!err)
 				return true;
-			if (err == asio::error::eof)
-				return true;
-			std::cerr << err.message() << '\n';
+			fail(err);
 			return false;
 		}
 
-		void handle_parse_error() {
-			// just close connection
+		void handle_parse_error(int = 400) {
+			fail(asio::error::invalid_argument);
+		}
+
+		void handle_timeout(Wait) {
+			fail(asio::error::timed_out);
+		}
+
+		void handle_body_error(BodyDecoder::Result res) {
+			fail(res == BodyDecoder::Result::TooLarge ? asio::error::message_size : asio::error::invalid_argument);
 		}
 
 		void handle_body() {
-			handler(shared_from_this());
+			// Moved out first, since the handler may well send the next request
+			auto h = std::move(handler);
+			handler = nullptr;
+			h(asio::error_code(), shared_from_this());
+			release_if_idle();
+		}
+
+		// The end of a streamed body, which is where handle_body() would have been called
+		void handle_body_end() {
+			release_if_idle();
 		}
 
 		asio::ip::tcp::resolver::results_type endpoints;
 		std::string host;
-		asio::streambuf send_buf;
+		std::string send_buf;
 		unsigned int retries;
 
 		unsigned int stat;
-		HandlerFunc handler;
+		ResultFunc handler; // set while a request is under way
+		bool stream_body = false; // the handler gets the head only
 
-		const static std::regex re_resp;
+		// Set for connections that belong to a ClientPool. release hands the connection back
+		// once it is idle, and pool_slot frees its place in the pool when it is destroyed.
+		// leased is set while the pointer handed out by the pool is held.
+		std::function<void(ptr)> release;
+		std::shared_ptr<void> pool_slot;
+		bool leased = false;
 	}; //class ClientConnection
-
-	// The '\r' at the end is needed since getline only strips the '\n'
-	const std::regex ClientConnection::re_resp(R"(HTTP/1.[10] (\d{3}) .+\r)", std::regex::optimize);
 } // namespace bb
@@ -0,0 +1,359 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "asio.hpp"
+
+#include "client_connection.hpp"
+
+namespace bb {
+	// Keeps connections to upstream servers open between requests, per host and port.
+	// A connection taken with get() comes back to the pool by itself once the pointer to it
+	// that get() handed out is gone and its last request is over, unless the upstream wants
+	// it closed. So hold on to that pointer for as long as the connection is used.
+	// Host names are resolved asynchronously and the result is reused for resolve_ttl, or for
+	// longer while the name fails to resolve again.
+	// The pool is safe to use from any thread. With ServerOptions::PerThreadContext give each
+	// shard a pool of its own, so upstream connections stay on the thread that uses them.
+	class ClientPool
+	{
+	public:
+		typedef std::chrono::steady_clock clock;
+		typedef ClientConnection::executor_type executor_type;
+		typedef std::function<void(asio::error_code, ClientConnection::ptr)> GetHandler;
+
+		struct Options {
+			// Connections to one host, in use or idle. Beyond that get() waits for one to be released.
+			std::size_t max_per_host = 32;
+			std::chrono::steady_clock::duration idle_timeout = std::chrono::seconds(30);
+			std::chrono::steady_clock::duration resolve_ttl = std::chrono::seconds(60);
+			// Longest get() waits for a connection to be released before failing with timed_out
+			std::chrono::steady_clock::duration wait_timeout = std::chrono::seconds(10);
+		};
+
+		ClientPool() : ClientPool(Options()) { }
+		explicit ClientPool(Options options) : state(std::make_shared<State>(options)) { }
+
+		ClientPool(ClientPool const&) = delete;
+		ClientPool& operator=(ClientPool const&) = delete;
+
+		~ClientPool() { close(); }
+
+		// Closes the idle connections, and those in use once they are released, and gets rid of
+		// the timer that would otherwise keep the context from running out of work for up to
+		// idle_timeout, e.g. from Server::on_stop(). That also leaves nothing of the pool on
+		// the context, so it may go before the pool does. Those waiting for a connection to be
+		// released fail with operation_aborted. get() still makes new connections.
+		void close() {
+			std::vector<ClientConnection::ptr> idle;
+			std::vector<Waiter> waiting;
+			{
+				std::lock_guard<std::mutex> lock(state->mutex);
+				state->closed = true;
+				for (auto& h : state->hosts) {
+					for (auto& c : h.second.idle) {
+						idle.push_back(std::move(c.con));
+					}
+					h.second.idle.clear();
+					for (auto& w : h.second.waiting) {
+						waiting.push_back(std::move(w));
+					}
+					h.second.waiting.clear();
+				}
+				state->timer.reset();
+			}
+			for (auto& w : waiting) {
+				State::serve(w, asio::error::operation_aborted, nullptr);
+			}
+		}
+
+		// Calls h(error_code, connection) on ex with a connection to host:port, which is only
+		// connected when the first request is sent on it
+		void get(executor_type const& ex, std::string const& host, std::string const& port, GetHandler h) {
+			State::get(state, ex, host, port, std::move(h));
+		}
+
+		// get() for any completion token, e.g. asio::use_awaitable
+		template<typename CompletionToken>
+		auto async_get(executor_type const& ex, std::string const& host, std::string const& port, CompletionToken&& token) {
+			return asio::async_initiate<CompletionToken, void(asio::error_code, ClientConnection::ptr)>([this](auto handler, executor_type const& ex, std::string const& host, std::string const& port) {
+				get(ex, host, port, shared_handler(std::move(handler), ex));
+			}, token, ex, host, port);
+		}
+
+	private:
+		struct Idle {
+			ClientConnection::ptr con;
+			clock::time_point since;
+		};
+
+		struct Waiter {
+			executor_type ex;
+			GetHandler handler;
+			std::uint64_t id = 0;
+			std::shared_ptr<asio::steady_timer> timer; // on ex, while waiting for a release
+		};
+
+		struct Host {
+			std::string name;
+			std::string port;
+			std::vector<Idle> idle;          // most recently used last
+			std::deque<Waiter> waiting;      // for a connection to be released
+			std::vector<Waiter> resolving;   // for the name to be resolved
+			std::size_t open = 0;            // including the ones being resolved for
+			asio::ip::tcp::resolver::results_type endpoints;
+			clock::time_point resolved_at;
+		};
+
+		struct State {
+			explicit State(Options options) : options(options) { }
+
+			static void get(std::shared_ptr<State> const& self, executor_type const& ex, std::string const& host, std::string const& port, GetHandler h) {
+				ClientConnection::ptr con;
+				std::vector<ClientConnection::ptr> expired;
+				bool resolve = false;
+				{
+					std::lock_guard<std::mutex> lock(self->mutex);
+					auto& hst = self->hosts[host + ':' + port];
+					if (hst.name.empty()) {
+						hst.name = host;
+						hst.port = port;
+					}
+					self->sweep(hst, clock::now(), expired);
+					if (!hst.idle.empty()) {
+						con = std::move(hst.idle.back().con);
+						hst.idle.pop_back();
+					}
+					else if (hst.open >= self->options.max_per_host) {
+						// Only while the host is busy, so the allocation does not matter
+						auto timer = std::make_shared<asio::steady_timer>(ex, self->options.wait_timeout);
+						auto id = ++self->waiter_ids;
+						timer->async_wait([weak{ std::weak_ptr<State>(self) }, key{ host + ':' + port }, id](asio::error_code ec) {
+							auto s = weak.lock();
+							if (!ec && s)
+								s->give_up(key, id);
+						});
+						hst.waiting.push_back({ ex, std::move(h), id, std::move(timer) });
+						return;
+					}
+					else {
+						++hst.open;
+						if (!hst.resolving.empty() || hst.endpoints.empty() || clock::now() - hst.resolved_at > self->options.resolve_ttl) {
+							resolve = hst.resolving.empty();
+							hst.resolving.push_back({ ex, std::move(h), 0, nullptr }); // no id or timer, resolving has no wait_timeout
+						}
+						else {
+							con = self->make_connection(self, hst, ex);
+						}
+					}
+				}
+
+				if (resolve) {
+					start_resolve(self, ex, host, port);
+				}
+				else if (con) {
+					asio::dispatch(ex, [h{ std::move(h) }, con{ lease(std::move(con)) }]() { h(asio::error_code(), con); });
+				}
+			}
+
+			static void start_resolve(std::shared_ptr<State> const& self, executor_type const& ex, std::string const& host, std::string const& port) {
+				auto resolver = std::make_shared<asio::ip::tcp::resolver>(ex);
+				resolver->async_resolve(host, port, [self, resolver, key{ host + ':' + port }](asio::error_code ec, asio::ip::tcp::resolver::results_type results) {
+					std::vector<std::pair<Waiter, ClientConnection::ptr>> ready;
+					{
+						std::lock_guard<std::mutex> lock(self->mutex);
+						auto& hst = self->hosts[key];
+						if (!ec) {
+							hst.endpoints = std::move(results);
+							hst.resolved_at = clock::now();
+						}
+						else if (!hst.endpoints.empty()) {
+							// The last answer is still worth a try, and the name is asked for again
+							// once resolve_ttl has passed
+							hst.resolved_at = clock::now();
+							ec = asio::error_code();
+						}
+						for (auto& w : hst.resolving) {
+							if (ec) {
+								--hst.open;
+								ready.push_back({ std::move(w), nullptr });
+							}
+							else {
+								auto con = self->make_connection(self, hst, w.ex);
+								ready.push_back({ std::move(w), std::move(con) });
+							}
+						}
+						hst.resolving.clear();
+						// The slots given back would go to those waiting, but they could not be
+						// connected either, and with none left open nothing would be released to them
+						while (ec && !hst.waiting.empty() && hst.open < self->options.max_per_host) {
+							ready.push_back({ std::move(hst.waiting.front()), nullptr });
+							hst.waiting.pop_front();
+						}
+					}
+					for (auto& r : ready) {
+						serve(r.first, ec, std::move(r.second));
+					}
+				});
+			}
+
+			// The pointer handed out shares ownership of the connection, and once it is gone
+			// marks the connection as no longer held. Posted rather than dispatched, since it may
+			// be dropped by a response handler the connection is still in the middle of calling,
+			// which would then release the connection a second time.
+			static ClientConnection::ptr lease(ClientConnection::ptr con) {
+				if (!con)
+					return con;
+				con->leased = true;
+				auto p = con.get();
+				return ClientConnection::ptr(p, [con{ std::move(con) }](ClientConnection*) mutable {
+					auto c = std::move(con);
+					auto ex = c->get_executor();
+					asio::post(ex, [c{ std::move(c) }]() {
+						c->leased = false;
+						c->release_if_idle();
+					});
+				});
+			}
+
+			// Hands w a connection, or the error it gets instead, on its executor
+			static void serve(Waiter& w, asio::error_code ec, ClientConnection::ptr con) {
+				asio::dispatch(w.ex, [h{ std::move(w.handler) }, timer{ std::move(w.timer) }, con{ lease(std::move(con)) }, ec]() {
+					if (timer)
+						timer->cancel();
+					h(ec, con);
+				});
+			}
+
+			// Called with the lock held. The connection's slot gives its place back when it is destroyed.
+			ClientConnection::ptr make_connection(std::shared_ptr<State> const& self, Host& hst, executor_type const& ex) {
+				auto con = ClientConnection::new_connection(ex, hst.endpoints, hst.name);
+				std::weak_ptr<State> weak = self;
+				auto key = hst.name + ':' + hst.port;
+				con->release = [weak, key](ClientConnection::ptr c) {
+					if (auto s = weak.lock()) {
+						s->release(s, key, std::move(c));
+					}
+				};
+				con->pool_slot = std::shared_ptr<void>(nullptr, [weak, key](void*) {
+					if (auto s = weak.lock()) {
+						s->slot_freed(s, key);
+					}
+				});
+				return con;
+			}
+
+			void release(std::shared_ptr<State> const& self, std::string const& key, ClientConnection::ptr con) {
+				std::optional<Waiter> w;
+				{
+					std::lock_guard<std::mutex> lock(mutex);
+					if (closed)
+						return;
+					auto& hst = hosts[key];
+					if (hst.waiting.empty()) {
+						hst.idle.push_back({ std::move(con), clock::now() });
+						if (!timer) {
+							timer = std::make_unique<asio::steady_timer>(hst.idle.back().con->get_executor());
+							arm_timer(self);
+						}
+						return;
+					}
+					w = std::move(hst.waiting.front());
+					hst.waiting.pop_front();
+				}
+				serve(*w, asio::error_code(), std::move(con));
+			}
+
+			// A connection is gone, which leaves room for one that is waiting
+			void slot_freed(std::shared_ptr<State> const& self, std::string const& key) {
+				std::optional<Waiter> w;
+				ClientConnection::ptr con;
+				{
+					std::lock_guard<std::mutex> lock(mutex);
+					auto& hst = hosts[key];
+					--hst.open;
+					if (closed || hst.waiting.empty())
+						return;
+					w = std::move(hst.waiting.front());
+					hst.waiting.pop_front();
+					++hst.open;
+					con = make_connection(self, hst, w->ex);
+				}
+				serve(*w, asio::error_code(), std::move(con));
+			}
+
+			// A wait has run out of time, unless it has just been served
+			void give_up(std::string const& key, std::uint64_t id) {
+				std::optional<Waiter> w;
+				{
+					std::lock_guard<std::mutex> lock(mutex);
+					auto& waiting = hosts[key].waiting;
+					for (auto it = waiting.begin(); it != waiting.end(); ++it) {
+						if (it->id == id) {
+							w = std::move(*it);
+							waiting.erase(it);
+							break;
+						}
+					}
+				}
+				if (w) {
+					serve(*w, asio::error::timed_out, nullptr);
+				}
+			}
+
+			// Runs only while there are idle connections, so it does not keep an io_context from stopping
+			void arm_timer(std::shared_ptr<State> const& self) {
+				timer->expires_after(options.idle_timeout / 2);
+				timer->async_wait([weak{ std::weak_ptr<State>(self) }](asio::error_code ec) {
+					auto s = weak.lock();
+					if (ec || !s)
+						return;
+					// Destroyed after the lock is released, since that frees their slots
+					std::vector<ClientConnection::ptr> expired;
+					std::lock_guard<std::mutex> lock(s->mutex);
+					bool any = false;
+					for (auto& h : s->hosts) {
+						s->sweep(h.second, clock::now(), expired);
+						any = any || !h.second.idle.empty();
+					}
+					if (any && !s->closed) {
+						s->arm_timer(s);
+					}
+					else {
+						s->timer.reset();
+					}
+				});
+			}
+
+			// Called with the lock held. The connections are destroyed by the caller, once it has
+			// released the lock.
+			void sweep(Host& hst, clock::time_point now, std::vector<ClientConnection::ptr>& expired) {
+				auto it = hst.idle.begin();
+				while (it != hst.idle.end() && now - it->since > options.idle_timeout) {
+					expired.push_back(std::move(it->con));
+					++it;
+				}
+				hst.idle.erase(hst.idle.begin(), it);
+			}
+
+			Options options;
+			std::mutex mutex;
+			std::unordered_map<std::string, Host> hosts;
+			std::unique_ptr<asio::steady_timer> timer;
+			std::uint64_t waiter_ids = 0;
+			bool closed = false;
+		};
+
+		std::shared_ptr<State> state;
+	}; // class ClientPool
+} // namespace bb
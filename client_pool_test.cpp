@@ -0,0 +1,216 @@
+// Checks ClientPool against a loopback stand-in upstream: connections are reused, and not
+// when the upstream closes them, no more than max_per_host are open, waiters are served by
+// releases and time out otherwise, idle ones expire, and a name that does not resolve or a
+// close() leaves nobody waiting.
+//   g++ -std=c++17 -O2 client_pool_test.cpp -o client_pool_test -lpthread
+//   client_pool_test
+
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define ASIO_STANDALONE 1
+#define ASIO_NO_DEPRECATED 1
+
+#include "client_pool.hpp"
+#include "test_support.hpp"
+#include "test_upstream.hpp"
+
+using namespace bb;
+using namespace std::chrono_literals;
+
+// The pool and a thread for its connections to run on
+struct Client {
+	explicit Client(ClientPool::Options options) : work(asio::make_work_guard(io)), ex(asio::make_strand(io)), pool(options) {
+		thread = std::thread([this]() { io.run(); });
+	}
+
+	~Client() {
+		pool.close();
+		work.reset();
+		thread.join();
+	}
+
+	// Gets a connection and sends a GET for path on it, and calls done on ex
+	template<typename F>
+	void start(std::string const& host, std::string const& port, std::string const& path, F done) {
+		pool.get(ex, host, port, [path, done](asio::error_code ec, ClientConnection::ptr con) mutable {
+			if (ec) {
+				done(Result{ ec, nullptr, 0, {} });
+				return;
+			}
+			con->async_send_request(path, "", [con, done](asio::error_code ec, ClientConnection::ptr) mutable {
+				auto status = ec ? 0 : con->status();
+				auto& b = con->body();
+				std::string body = ec ? std::string() : std::string(b.begin(), b.end());
+				// Moved on, so that letting go of it is not held up by this handler
+				done(Result{ ec, std::move(con), status, std::move(body) });
+			});
+		});
+	}
+
+	Result fetch(std::string const& port, std::string const& path) {
+		std::promise<Result> p;
+		start("127.0.0.1", port, path, [&p](Result r) { p.set_value(std::move(r)); });
+		return p.get_future().get();
+	}
+
+	// Waits for what was posted to ex so far, e.g. the release of a connection let go of
+	void settle() {
+		std::promise<void> p;
+		asio::post(ex, [&p]() { p.set_value(); });
+		p.get_future().get();
+	}
+
+	asio::io_context io;
+	asio::executor_work_guard<asio::io_context::executor_type> work;
+	ClientPool::executor_type ex;
+	ClientPool pool;
+	std::thread thread;
+};
+
+static void reuse(TestUpstream& up) {
+	Client c({});
+	auto before = up.accepted.load();
+	ClientConnection* first = nullptr;
+	bool same = true, ok = true;
+	for (int i = 0; i < 5; ++i) {
+		auto r = c.fetch(up.port(), "/n" + std::to_string(i));
+		ok = ok && !r.ec && r.body == "/n" + std::to_string(i);
+		if (!first)
+			first = r.con.get();
+		same = same && r.con.get() == first;
+		r.con.reset();
+		c.settle();
+	}
+	check(ok, "requests one after another are answered");
+	check(same && up.accepted - before == 1, "one after another they take the same connection");
+
+	auto r = c.fetch(up.port(), "/close");
+	r.con.reset();
+	c.settle();
+	r = c.fetch(up.port(), "/after-close");
+	check(!r.ec && r.body == "/after-close" && up.accepted - before == 2, "a connection the upstream closes is not reused");
+	r.con.reset();
+	c.settle();
+
+	// Idle in the pool while the upstream hangs up
+	r = c.fetch(up.port(), "/bye");
+	r.con.reset();
+	c.settle();
+	std::this_thread::sleep_for(150ms);
+	r = c.fetch(up.port(), "/after-bye");
+	check(!r.ec && r.body == "/after-bye", "a request on a connection the upstream hung up on meanwhile is sent again");
+}
+
+static void held_out_of_the_pool(TestUpstream& up) {
+	Client c({});
+	auto a = c.fetch(up.port(), "/a");
+	auto b = c.fetch(up.port(), "/b");
+	check(a.con && b.con && a.con.get() != b.con.get(), "a connection that is held is not handed out again");
+	check(a.body == "/a" && b.body == "/b", "each keeps its own response while it is held");
+}
+
+static void limit_per_host(TestUpstream& up) {
+	ClientPool::Options o;
+	o.max_per_host = 2;
+	Client c(o);
+	up.most_open = up.open.load();
+	auto before = up.open.load();
+	std::atomic<int> ok{ 0 };
+	std::promise<void> all;
+	std::atomic<int> left{ 8 };
+	for (int i = 0; i < 8; ++i) {
+		c.start("127.0.0.1", up.port(), "/delay/30", [&](Result r) {
+			ok += !r.ec && r.body == "/delay/30";
+			r.con.reset();
+			if (--left == 0)
+				all.set_value();
+		});
+	}
+	all.get_future().get();
+	check(ok == 8, "requests past max_per_host wait their turn and are answered");
+	check(up.most_open - before <= 2, "no more than max_per_host connections are open to a host");
+}
+
+static void waiting(TestUpstream& up) {
+	ClientPool::Options o;
+	o.max_per_host = 1;
+	o.wait_timeout = 100ms;
+	Client c(o);
+
+	auto held = c.fetch(up.port(), "/held");
+	auto start = std::chrono::steady_clock::now();
+	auto r = c.fetch(up.port(), "/waits");
+	auto waited = std::chrono::steady_clock::now() - start;
+	check(r.ec == asio::error::timed_out && waited >= 100ms && waited < 2s, "a wait for a connection runs out after wait_timeout");
+
+	std::promise<Result> p;
+	c.start("127.0.0.1", up.port(), "/served", [&p](Result r) { p.set_value(std::move(r)); });
+	std::this_thread::sleep_for(30ms);
+	auto raw = held.con.get();
+	held.con.reset();
+	r = p.get_future().get();
+	check(!r.ec && r.body == "/served" && r.con.get() == raw, "a connection released goes to the one waiting");
+	r.con.reset();
+
+	// close() with someone waiting
+	held = c.fetch(up.port(), "/held");
+	std::promise<Result> q;
+	c.start("127.0.0.1", up.port(), "/closed", [&q](Result r) { q.set_value(std::move(r)); });
+	std::this_thread::sleep_for(20ms);
+	c.pool.close();
+	check(q.get_future().get().ec == asio::error::operation_aborted, "close() fails those waiting with operation_aborted");
+}
+
+static void idle_timeout(TestUpstream& up) {
+	ClientPool::Options o;
+	o.idle_timeout = 100ms;
+	Client c(o);
+	// For the connections of the tests before to be gone
+	std::this_thread::sleep_for(100ms);
+	auto before = up.accepted.load();
+	auto r = c.fetch(up.port(), "/idle");
+	r.con.reset();
+	c.settle();
+	auto open = up.open.load();
+	std::this_thread::sleep_for(300ms);
+	check(open >= 1 && up.open < open, "an idle connection is closed after idle_timeout");
+	r = c.fetch(up.port(), "/fresh");
+	check(!r.ec && up.accepted - before == 2, "a request after the idle one expired gets a new connection");
+}
+
+static void unresolved() {
+	ClientPool::Options o;
+	o.max_per_host = 1;
+	o.wait_timeout = 30s;
+	// Before the client, which serves whoever is still waiting when it goes
+	std::promise<void> all;
+	std::atomic<int> left{ 3 }, failed{ 0 };
+	Client c(o);
+	for (int i = 0; i < 3; ++i) {
+		c.start("no-such-host.invalid", "80", "/", [&](Result r) {
+			failed += !!r.ec;
+			if (--left == 0)
+				all.set_value();
+		});
+	}
+	// Not as long as the wait_timeout, which is what those waiting would otherwise take
+	auto f = all.get_future();
+	check(f.wait_for(10s) == std::future_status::ready && failed == 3, "a name that does not resolve fails those waiting as well");
+	f.wait();
+}
+
+int main() {
+	TestUpstream up;
+	reuse(up);
+	held_out_of_the_pool(up);
+	limit_per_host(up);
+	waiting(up);
+	idle_timeout(up);
+	unresolved();
+	return finish();
+}
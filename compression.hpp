@@ -0,0 +1,114 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+
+#include <zlib.h>
+
+#include "headers.hpp"
+#include "response.hpp"
+
+namespace bb {
+	// gzip and deflate for the responses of the routes it is given to, e.g.
+	//   auto gzip = std::make_shared<Compression>();
+	//   server.add_route("/api/{name}", Methods::GET, handler, gzip);
+	// Bodies shorter than min_size, already encoded, or of a type that is compressed
+	// already, such as images, are sent as they are. Each thread keeps its zlib streams and
+	// only resets them between responses. Needs linking with zlib.
+	class Compression : public ContentEncoder
+	{
+	public:
+		struct Options {
+			std::size_t min_size = 1024;
+			int level = Z_DEFAULT_COMPRESSION;
+		};
+
+		Compression() : Compression(Options()) { }
+		explicit Compression(Options options) : options(options) { }
+
+		std::string_view coding(Headers const& request) const override {
+			auto ae = request.get(KnownHeader::AcceptEncoding);
+			if (ae.empty())
+				return {};
+			auto gz = accept_weight(ae, "gzip");
+			auto df = accept_weight(ae, "deflate");
+			if (gz > 0 && gz >= df)
+				return "gzip";
+			if (df > 0)
+				return "deflate";
+			return {};
+		}
+
+		bool encode(Headers const& request, Response& resp) const override {
+			auto body = resp.body_data();
+			if (body.size() < options.min_size || !resp.header_value("Content-Encoding").empty() || !compressible(resp.header_value("Content-Type")))
+				return false;
+			auto name = coding(request);
+			if (name.empty())
+				return true;
+
+			auto zp = stream(name == "gzip" ? 16 + MAX_WBITS : MAX_WBITS);
+			if (!zp)
+				return true;
+			auto& z = *zp;
+			auto out = BufferPool::get();
+			out.resize(deflateBound(&z, static_cast<uLong>(body.size())));
+			z.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(body.data()));
+			z.avail_in = static_cast<uInt>(body.size());
+			z.next_out = reinterpret_cast<Bytef*>(&out[0]);
+			z.avail_out = static_cast<uInt>(out.size());
+			auto res = deflate(&z, Z_FINISH);
+			auto produced = out.size() - z.avail_out;
+			deflateReset(&z);
+			// Not worth it, e.g. random data
+			if (res != Z_STREAM_END || produced >= body.size()) {
+				BufferPool::put(std::move(out));
+				return true;
+			}
+			out.resize(produced);
+			resp.header("Content-Encoding", name);
+			resp.body(std::move(out));
+			return true;
+		}
+
+	private:
+		// One stream per thread and format, reset after each use rather than set up again
+		z_stream* stream(int window_bits) const {
+			struct Stream {
+				Stream(int level, int window_bits) : level(level) {
+					z = z_stream();
+					ok = deflateInit2(&z, level, Z_DEFLATED, window_bits, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+				}
+				~Stream() {
+					if (ok)
+						deflateEnd(&z);
+				}
+				z_stream z;
+				bool ok;
+				int level;
+			};
+			static thread_local Stream gzip(options.level, 16 + MAX_WBITS);
+			static thread_local Stream zlib(options.level, MAX_WBITS);
+			auto& s = window_bits == MAX_WBITS ? zlib : gzip;
+			if (!s.ok)
+				return nullptr;
+			// Another Compression on this thread may want a different level
+			if (s.level != options.level) {
+				deflateParams(&s.z, options.level, Z_DEFAULT_STRATEGY);
+				s.level = options.level;
+			}
+			return &s.z;
+		}
+
+		static bool compressible(std::string_view type) {
+			auto starts = [&](std::string_view prefix) { return type.size() >= prefix.size() && iequals(type.substr(0, prefix.size()), prefix); };
+			if (starts("image/svg"))
+				return true;
+			return !(starts("image/") || starts("audio/") || starts("video/") || starts("font/woff")
+				|| starts("application/zip") || starts("application/gzip") || starts("application/octet-stream"));
+		}
+
+		Options options;
+	}; // class Compression
+} // namespace bb
@@ -1,103 +1,447 @@
 #pragma once
 
-#include <map>
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <limits>
 #include <memory>
-#include <regex>
+#include <string>
+#include <string_view>
 
 #include "asio.hpp"
 
+#include "allocation.hpp"
+#include "headers.hpp"
+#include "http_parser.hpp"
+#include "metrics.hpp"
+#include "timer_wheel.hpp"
+
 namespace bb {
-	// source: http://stackoverflow.com/a/1801913/331785
-	struct IgnoreCaseLT {
-		// case-independent (ci) compare_less binary function
-		struct nocase_compare
-		{
-			bool operator() (const unsigned char& c1, const unsigned char& c2) const {
-				return tolower(c1) < tolower(c2);
-			}
+	// Makes a completion handler, which asio allows to be move-only, into something that
+	// std::function can hold. It is invoked through its associated executor, as asio would.
+	template<typename Handler, typename Executor>
+	auto shared_handler(Handler handler, Executor const& fallback) {
+		auto ex = asio::get_associated_executor(handler, fallback);
+		auto h = std::make_shared<Handler>(std::move(handler));
+		return [h, ex](auto ... args) {
+			asio::dispatch(ex, [h, args...]() { std::move(*h)(args...); });
 		};
-		bool operator() (const std::string & s1, const std::string & s2) const {
-			return std::lexicographical_compare(s1.begin(), s1.end(),   // source range
-				s2.begin(), s2.end(),   // dest range
-				nocase_compare());      // comparison
+	}
+
+	struct Limits {
+		// Larger bodies are refused, whether they are buffered or streamed
+		std::uint64_t max_body_size = 8 * 1024 * 1024;
+		// Largest piece of a body read from the socket at once, and so the largest piece a
+		// streaming handler is given
+		std::size_t body_chunk_size = 16 * 1024;
+		// Start line and headers of a message, in bytes and in number of headers. A request
+		// beyond either is refused with 431.
+		std::size_t max_head_size = 16 * 1024;
+		std::size_t max_header_count = 100;
+
+		// The timeouts apply to connections that have a TimerWheel, which those of a Server do.
+		// A request head has to arrive in full within header_timeout of its first byte. Sending
+		// it a byte at a time does not buy more.
+		std::chrono::steady_clock::duration header_timeout = std::chrono::seconds(10);
+		// Longest wait for more of a body
+		std::chrono::steady_clock::duration body_timeout = std::chrono::seconds(30);
+		// Longest a keep-alive connection waits for its next request
+		std::chrono::steady_clock::duration idle_timeout = std::chrono::seconds(60);
+		// Longest a write may go without the peer taking any of it
+		std::chrono::steady_clock::duration write_timeout = std::chrono::seconds(30);
+
+		// Open connections per Server. At the limit the server stops accepting, so new ones wait
+		// in the listen backlog, and looks again every accept_retry. The few that may still get
+		// in while accepting stops are closed right away.
+		std::size_t max_connections = 10000;
+		std::chrono::steady_clock::duration accept_retry = std::chrono::milliseconds(10);
+
+		// Longest Server::stop() waits for the requests in progress to be answered before
+		// closing their connections regardless
+		std::chrono::steady_clock::duration drain_timeout = std::chrono::seconds(30);
+
+		static Limits const& defaults() {
+			static const Limits l;
+			return l;
 		}
 	};
 
 	template<typename T>
 	class http_connection_base : public std::enable_shared_from_this<T> {
 	public:
-		typedef std::map<std::string, std::string, IgnoreCaseLT> HeaderMap;
+		typedef Headers HeaderMap;
 		typedef std::vector<char> DATA;
 		typedef std::shared_ptr<T> ptr;
+		// Each connection runs on its own strand. Naming the type, rather than letting the
+		// socket hold an any_io_executor, keeps asio from allocating to type-erase it.
+		typedef asio::strand<asio::io_context::executor_type> executor_type;
+		typedef asio::basic_stream_socket<asio::ip::tcp, executor_type> socket_type;
 
 		HeaderMap const& headers() { return rcv_headers; }
 		DATA const& body() { return rcv_body; }
+		// Moves the body out, e.g. to keep it past the next message
+		DATA take_body() { return std::move(rcv_body); }
+
+		// The executor of the thread (or shard) this connection runs on
+		executor_type get_executor() { return socket.get_executor(); }
+
+		// Calls h(asio::error_code, std::string_view) with the next piece of the body, at most
+		// Limits::body_chunk_size long and valid until the next piece is asked for. An empty
+		// piece without an error means the body has ended. Nothing more is read from the socket
+		// until h asks for the next piece, so a slow consumer holds the sender back rather than
+		// letting the body pile up in memory.
+		// Only for messages whose body is not read up front, e.g. on RouteOptions::StreamBody
+		// routes. A body that is too large or malformed yields asio::error::message_size or
+		// asio::error::invalid_argument, and has been answered by the connection already.
+		template<typename Handler>
+		void read_body(Handler h) {
+			asio::dispatch(socket.get_executor(), [this, self{ this->shared_from_this() }, h{ std::move(h) }]() mutable {
+				read_body_piece(std::move(h));
+			});
+		}
+
+		// read_body() for any completion token, e.g. asio::use_awaitable
+		template<typename CompletionToken>
+		auto async_read_body(CompletionToken&& token) {
+			return asio::async_initiate<CompletionToken, void(asio::error_code, std::string_view)>([this](auto handler) {
+				auto ex = asio::get_associated_executor(handler, get_executor());
+				read_body([ex, handler{ std::move(handler) }](asio::error_code ec, std::string_view piece) mutable {
+					asio::dispatch(ex, [handler{ std::move(handler) }, ec, piece]() mutable { handler(ec, piece); });
+				});
+			}, token);
+		}
 
 	protected:
+		Arena arena;
 		HeaderMap rcv_headers;
 		DATA rcv_body;
+		HandlerMemory handler_mem;
 
 		asio::streambuf buf_in;
-		asio::ip::tcp::socket socket;
+		socket_type socket;
+		HttpParser parser;
+		std::size_t msg_len = 0; // bytes of the current message still held in buf_in
+
+		// Bytes of the body that came in with the head are decoded in place in buf_in. The rest
+		// is read into body_buf instead, since growing buf_in would move the head the header
+		// views point into. Whatever is read past the end of a body is handed back to buf_in
+		// by next_message().
+		BodyDecoder body_decoder;
+		DATA body_buf;
+		std::size_t body_pos = 0, body_end = 0; // bytes of body_buf not decoded yet
+		Limits const& limits;
+
+		// What the connection is waiting for, as far as timeouts go
+		enum class Wait { None, Idle, Head, Body, Write };
+
+		TimerWheel* wheel;
+		TimerWheel::Timer timer;
+		TimerWheel::clock::time_point read_deadline = TimerWheel::clock::time_point::max();
+		TimerWheel::clock::time_point write_deadline = TimerWheel::clock::time_point::max();
+		Wait read_wait = Wait::None;
+
+		// Set by connections that are counted, e.g. by those of a Server
+		Metrics* metrics = nullptr;
+		Metrics::clock::time_point head_start; // first byte of the head being parsed, if any
 
-		http_connection_base(asio::ip::tcp::socket socket) : socket(std::move(socket)) { }
+		http_connection_base(socket_type socket, HttpParser::Kind kind, Limits const& limits = Limits::defaults(), TimerWheel* wheel = nullptr)
+		  : socket(std::move(socket)), parser(kind), limits(limits), wheel(wheel) { }
+
+		// Once the connection is owned by a shared_ptr
+		void start_timer() {
+			if (!wheel)
+				return;
+			timer.init(wheel, this->weak_from_this(), [](std::shared_ptr<void> const& owner) {
+				auto self = std::static_pointer_cast<T>(owner);
+				asio::post(self->get_executor(), [self]() { self->check_timeouts(); });
+			});
+		}
+
+		// A head's timeout runs from its first byte and is not pushed back by later ones.
+		// Other reads get the whole timeout every time.
+		void time_read(Wait what) {
+			if (!wheel || (what == Wait::Head && read_wait == Wait::Head))
+				return;
+			read_wait = what;
+			auto d = what == Wait::Idle ? limits.idle_timeout : what == Wait::Head ? limits.header_timeout : limits.body_timeout;
+			read_deadline = TimerWheel::clock::now() + d;
+			update_timer();
+		}
 
-		void get_headers() {
-			asio::async_read_until(socket, buf_in, "\r\n", [this, self{ this->shared_from_this() }](auto ec, auto) {
+		void untime_read() {
+			if (!wheel || read_wait == Wait::None)
+				return;
+			read_wait = Wait::None;
+			read_deadline = TimerWheel::clock::time_point::max();
+			update_timer();
+		}
+
+		void time_write(bool on) {
+			if (!wheel)
+				return;
+			write_deadline = on ? TimerWheel::clock::now() + limits.write_timeout : TimerWheel::clock::time_point::max();
+			update_timer();
+		}
+
+		void update_timer() {
+			auto d = std::min(read_deadline, write_deadline);
+			if (d == TimerWheel::clock::time_point::max()) {
+				timer.cancel();
+			}
+			else {
+				timer.schedule(d);
+			}
+		}
+
+		// The wheel may fire for a deadline that has moved since
+		void check_timeouts() {
+			auto now = TimerWheel::clock::now();
+			if (write_deadline <= now) {
+				static_cast<T*>(this)->handle_timeout(Wait::Write);
+			}
+			else if (read_deadline <= now) {
+				static_cast<T*>(this)->handle_timeout(read_wait);
+			}
+			else {
+				update_timer();
+			}
+		}
+
+		// Drops the previous message from the input buffer and gets ready to parse the next one
+		void next_message() {
+			buf_in.consume(msg_len);
+			msg_len = 0;
+			if (body_pos < body_end) {
+				// read along with the end of the last body, so it starts the next message
+				auto n = asio::buffer_copy(buf_in.prepare(body_end - body_pos), asio::buffer(body_buf.data() + body_pos, body_end - body_pos));
+				buf_in.commit(n);
+			}
+			body_pos = body_end = 0;
+			parser.reset();
+			rcv_headers.clear();
+			arena.reset();
+		}
+
+		void read_head() {
+			time_read(buf_in.size() ? Wait::Head : Wait::Idle);
+			socket.async_read_some(buf_in.prepare(read_size), alloc_handler(handler_mem, [this, self{ this->shared_from_this() }](auto ec, auto n) {
+				buf_in.commit(n);
+				if (metrics)
+					metrics->received(n);
 				if (self->handle_error(ec)) {
-					std::istream is(&buf_in);
-					std::string line;
-					std::getline(is, line);
-
-					std::smatch parts;
-					if (std::regex_match(line, parts, re_head)) {
-						rcv_headers[parts[1]] = parts[2];
-						get_headers();
-					}
-					else if (line == "\r") {
-						get_body();
-					}
-					else {
-						self->handle_parse_error();
+					parse_head(!ec);
+				}
+			}));
+		}
+
+		// Parses whatever is already buffered, reading more only if the head is not complete yet
+		void parse_head(bool more = true) {
+			auto data = buf_in.data();
+			if (metrics && data.size() && head_start == Metrics::clock::time_point())
+				head_start = Metrics::clock::now();
+			switch (parser.parse(static_cast<const char*>(data.data()), data.size())) {
+			case HttpParser::Result::Done:
+				untime_read();
+				if (metrics) {
+					metrics->latency(Metrics::Latency::Parse, Metrics::clock::now() - head_start);
+					head_start = Metrics::clock::time_point();
+				}
+				msg_len = parser.head_length();
+				if (msg_len > limits.max_head_size || parser.headers().size() > limits.max_header_count) {
+					static_cast<T*>(this)->handle_parse_error(431);
+					return;
+				}
+				for (auto& h : parser.headers()) {
+					if (!rcv_headers.add(h.name, h.value)) {
+						static_cast<T*>(this)->handle_parse_error();
+						return;
 					}
 				}
-			});
+				static_cast<T*>(this)->handle_head();
+				break;
+			case HttpParser::Result::Incomplete:
+				if (data.size() > limits.max_head_size) {
+					untime_read();
+					static_cast<T*>(this)->handle_parse_error(431);
+				}
+				else if (more) {
+					read_head();
+				}
+				break;
+			case HttpParser::Result::Error:
+				static_cast<T*>(this)->handle_parse_error();
+				break;
+			}
 		}
 
-		void get_body() {
-			std::size_t len = 0;
-			auto it = rcv_headers.find("content-length");
-			if (it != rcv_headers.end()) {
-				try {
-					len = std::stoul(it->second.c_str());
+		// Works out how the body is framed. Returns false, after the derived class has dealt
+		// with it, if the message has to be refused. A body that is passed on as it arrives,
+		// rather than kept, need not be held to Limits::max_body_size.
+		bool start_body(bool bounded = true) {
+			auto chunked = false;
+			if (rcv_headers.has(KnownHeader::TransferEncoding)) {
+				// Anything else cannot be framed, and together with Content-Length it is the
+				// stuff request smuggling is made of
+				if (!rcv_headers.has_token(KnownHeader::TransferEncoding, "chunked") || rcv_headers.has(KnownHeader::ContentLength)) {
+					static_cast<T*>(this)->handle_parse_error();
+					return false;
 				}
-				catch (const std::exception&) {}
+				chunked = true;
+			}
+			auto max_size = bounded ? limits.max_body_size : std::numeric_limits<std::uint64_t>::max();
+			if (body_decoder.start(chunked, rcv_headers.content_length(), max_size) == BodyDecoder::Result::TooLarge) {
+				static_cast<T*>(this)->handle_body_error(BodyDecoder::Result::TooLarge);
+				return false;
 			}
-			rcv_body.resize(len);
-			auto have_len = buf_in.size();
-			asio::buffer_copy(asio::buffer(rcv_body), buf_in.data());
-			buf_in.consume(have_len);
-			auto body_buf = asio::buffer(rcv_body.data() + have_len, len - have_len);
+			return true;
+		}
 
-			asio::async_read(socket, body_buf, [this, self{ this->shared_from_this() }](auto ec, auto) {
-				if (self->handle_error(ec)) {
+		// Reads the whole body into rcv_body, then calls handle_body()
+		void get_body() {
+			rcv_body.clear();
+			if (body_decoder.is_chunked()) {
+				read_whole_body();
+				return;
+			}
+
+			// The length is known, so the body is read straight into rcv_body
+			auto len = static_cast<std::size_t>(body_decoder.remaining());
+			auto have_len = std::min(buf_in.size() - msg_len, len);
+			rcv_body.resize(have_len);
+			asio::buffer_copy(asio::buffer(rcv_body), buf_in.data() + msg_len, have_len);
+			msg_len += have_len;
+			body_decoder.skip(have_len);
+			if (have_len == len) {
+				static_cast<T*>(this)->handle_body();
+				return;
+			}
+			read_rest_of_body(have_len, len);
+		}
+
+		// rcv_body grows as the body arrives, rather than to whatever length was claimed
+		void read_rest_of_body(std::size_t filled, std::size_t len) {
+			if (filled == rcv_body.size()) {
+				rcv_body.resize(std::min(len, std::max(2 * filled, limits.body_chunk_size)));
+			}
+			time_read(Wait::Body);
+			auto body = asio::buffer(rcv_body.data() + filled, rcv_body.size() - filled);
+			socket.async_read_some(body, alloc_handler(handler_mem, [this, self{ this->shared_from_this() }, filled, len](auto ec, auto n) {
+				body_decoder.skip(n);
+				if (metrics)
+					metrics->received(n);
+				if (ec) {
+					untime_read();
+					self->handle_error(ec);
+				}
+				else if (filled + n < len) {
+					read_rest_of_body(filled + n, len);
+				}
+				else {
+					untime_read();
 					self->handle_body();
 				}
+			}));
+		}
+
+		void read_whole_body() {
+			for (;;) {
+				std::string_view piece;
+				auto res = decode_body(piece);
+				rcv_body.insert(rcv_body.end(), piece.begin(), piece.end());
+				if (res == BodyDecoder::Result::Done) {
+					static_cast<T*>(this)->handle_body();
+					return;
+				}
+				if (res != BodyDecoder::Result::More) {
+					static_cast<T*>(this)->handle_body_error(res);
+					return;
+				}
+				if (piece.empty())
+					break;
+			}
+			read_body_buf([this](asio::error_code ec) {
+				if (!ec) {
+					read_whole_body();
+				}
+				else {
+					static_cast<T*>(this)->handle_error(ec);
+				}
 			});
 		}
 
-		static std::string headers_string(HeaderMap const& headers) {
-			std::string ret;
-			for (auto header : headers) {
-				ret += header.first + ": " + header.second + "\r\n";
+		template<typename Handler>
+		void read_body_piece(Handler h) {
+			std::string_view piece;
+			auto res = decode_body(piece);
+			if (res == BodyDecoder::Result::More && piece.empty()) {
+				read_body_buf([this, h{ std::move(h) }](asio::error_code ec) mutable {
+					if (!ec) {
+						read_body_piece(std::move(h));
+					}
+					else {
+						h(ec, std::string_view());
+					}
+				});
+			}
+			else if (res == BodyDecoder::Result::Error || res == BodyDecoder::Result::TooLarge) {
+				static_cast<T*>(this)->handle_body_error(res);
+				h(res == BodyDecoder::Result::TooLarge ? asio::error::message_size : asio::error::invalid_argument, std::string_view());
+			}
+			else {
+				h(asio::error_code(), piece);
+				if (piece.empty()) {
+					static_cast<T*>(this)->handle_body_end();
+				}
 			}
-			return ret;
 		}
 
-		const static std::regex re_head;
-	};
+		// After read_body() has handed out the end of the body
+		void handle_body_end() { }
 
-	// The '\r' at the end is needed since getline only strips the '\n'
-	template<typename T>
-	const std::regex http_connection_base<T>::re_head(R"(([-\w]+): (.*)\r)", std::regex::optimize);
+		// Decodes the next piece of body out of what has been received. A piece that is
+		// empty while the result is More means there is nothing left to decode.
+		BodyDecoder::Result decode_body(std::string_view& piece) {
+			std::size_t used = 0, n = 0;
+			char* p = nullptr;
+			auto res = BodyDecoder::Result::More;
+			if (msg_len < buf_in.size()) {
+				// Only the bytes after the head are rewritten, which nothing else points into
+				p = static_cast<char*>(const_cast<void*>(buf_in.data().data())) + msg_len;
+				res = body_decoder.decode(p, buf_in.size() - msg_len, used, n);
+				msg_len += used;
+			}
+			else if (body_pos < body_end) {
+				p = body_buf.data() + body_pos;
+				res = body_decoder.decode(p, body_end - body_pos, used, n);
+				body_pos += used;
+			}
+			else if (body_decoder.done()) {
+				res = BodyDecoder::Result::Done;
+			}
+			piece = std::string_view(p, n);
+			return res;
+		}
+
+		// Reads more of the body into body_buf, then calls h(asio::error_code).
+		// The connection closing in the middle of a body is an error too.
+		template<typename Handler>
+		void read_body_buf(Handler h) {
+			if (body_buf.size() < limits.body_chunk_size)
+				body_buf.resize(limits.body_chunk_size);
+			body_pos = body_end = 0;
+			auto buf = asio::buffer(body_buf.data(), body_decoder.read_limit(body_buf.size()));
+			time_read(Wait::Body);
+			socket.async_read_some(buf, alloc_handler(handler_mem, [this, self{ this->shared_from_this() }, h{ std::move(h) }](auto ec, auto n) mutable {
+				untime_read();
+				if (metrics)
+					metrics->received(n);
+				body_end = n;
+				if (n)
+					ec = {};
+				h(ec);
+			}));
+		}
+
+		static constexpr std::size_t read_size = 4096;
+	};
 }
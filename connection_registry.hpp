@@ -0,0 +1,100 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace bb {
+	// The open connections of a Server, so it can reach all of them at once, e.g. to drain
+	// them on shutdown. Each connection holds an Entry, which adds it when initialized and
+	// removes it when destroyed. That takes a lock once per connection, not per request.
+	class ConnectionRegistry
+	{
+	public:
+		class Entry
+		{
+		public:
+			Entry() = default;
+			Entry(Entry const&) = delete;
+			Entry& operator=(Entry const&) = delete;
+
+			~Entry() {
+				if (registry)
+					registry->remove(*this);
+			}
+
+			void init(ConnectionRegistry* r, std::weak_ptr<void> o) {
+				registry = r;
+				owner = std::move(o);
+				r->add(*this);
+			}
+
+		private:
+			friend class ConnectionRegistry;
+
+			ConnectionRegistry* registry = nullptr;
+			std::weak_ptr<void> owner;
+			Entry* prev = nullptr;
+			Entry* next = nullptr;
+		}; // class Entry
+
+		ConnectionRegistry() = default;
+		ConnectionRegistry(ConnectionRegistry const&) = delete;
+		ConnectionRegistry& operator=(ConnectionRegistry const&) = delete;
+
+		// Calls f(std::shared_ptr<void> const&) with every connection still alive. f is called
+		// outside the lock, so it may cause connections to go away.
+		template<typename F>
+		void for_each(F f) {
+			std::vector<std::shared_ptr<void>> all;
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				all.reserve(count);
+				for (auto e = head; e; e = e->next) {
+					if (auto o = e->owner.lock())
+						all.push_back(std::move(o));
+				}
+			}
+			for (auto& o : all) {
+				f(o);
+			}
+		}
+
+		std::size_t size() const {
+			std::lock_guard<std::mutex> lock(mutex);
+			return count;
+		}
+
+		// Once set, connections that start are to drain right away
+		void start_draining() { draining_.store(true, std::memory_order_relaxed); }
+		bool draining() const { return draining_.load(std::memory_order_relaxed); }
+
+	private:
+		void add(Entry& e) {
+			std::lock_guard<std::mutex> lock(mutex);
+			e.prev = nullptr;
+			e.next = head;
+			if (head)
+				head->prev = &e;
+			head = &e;
+			++count;
+		}
+
+		void remove(Entry& e) {
+			std::lock_guard<std::mutex> lock(mutex);
+			if (e.prev)
+				e.prev->next = e.next;
+			else
+				head = e.next;
+			if (e.next)
+				e.next->prev = e.prev;
+			--count;
+		}
+
+		mutable std::mutex mutex;
+		Entry* head = nullptr;
+		std::size_t count = 0;
+		std::atomic<bool> draining_{ false };
+	}; // class ConnectionRegistry
+} // namespace bb
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <cerrno>
+#include <cstring>
+#include <string>
+
+#include "asio.hpp"
+
+#if defined(ASIO_HAS_LOCAL_SOCKETS)
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+namespace bb {
+	// Passes a listening socket from a running server to the process replacing it, over a
+	// UNIX socket. The socket stays open throughout, so connections wait in its backlog
+	// rather than being refused while the new process starts.
+
+	// Sends fd, along with a byte to carry it, over the connected UNIX socket sock
+	inline bool send_fd(int sock, int fd) {
+		char byte = 0;
+		iovec iov{ &byte, 1 };
+		alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))] = {};
+		msghdr msg{};
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		auto c = CMSG_FIRSTHDR(&msg);
+		c->cmsg_level = SOL_SOCKET;
+		c->cmsg_type = SCM_RIGHTS;
+		c->cmsg_len = CMSG_LEN(sizeof(int));
+		std::memcpy(CMSG_DATA(c), &fd, sizeof(int));
+#if defined(MSG_NOSIGNAL)
+		int flags = MSG_NOSIGNAL;
+#else
+		int flags = 0;
+#endif // defined(MSG_NOSIGNAL)
+		ssize_t n;
+		do {
+			n = ::sendmsg(sock, &msg, flags);
+		} while (n < 0 && errno == EINTR);
+		return n == 1;
+	}
+
+	// The descriptor sent with send_fd(), or -1
+	inline int receive_fd(int sock) {
+		char byte;
+		iovec iov{ &byte, 1 };
+		alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))] = {};
+		msghdr msg{};
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		ssize_t n;
+		do {
+			n = ::recvmsg(sock, &msg, 0);
+		} while (n < 0 && errno == EINTR);
+		auto c = n == 1 ? CMSG_FIRSTHDR(&msg) : nullptr;
+		if (!c || c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS)
+			return -1;
+		int fd;
+		std::memcpy(&fd, CMSG_DATA(c), sizeof(int));
+		return fd;
+	}
+
+	// The listening socket of the Server that hands it over at path with Server::hand_off(),
+	// or -1 when none is running, e.g.
+	//   Server s(8080, ServerOptions::None, take_listener("/run/app.sock"));
+	inline int take_listener(std::string const& path) {
+		asio::io_context io;
+		asio::local::stream_protocol::socket s(io);
+		asio::error_code ec;
+		s.connect(asio::local::stream_protocol::endpoint(path), ec);
+		if (ec)
+			return -1;
+		return receive_fd(s.native_handle());
+	}
+} // namespace bb
+#endif // defined(ASIO_HAS_LOCAL_SOCKETS)
@@ -0,0 +1,269 @@
+#pragma once
+
+#include <charconv>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+#include <vector>
+
+namespace bb {
+	// ASCII case-insensitive equality, eight bytes at a time
+	inline bool iequals(std::string_view a, std::string_view b) {
+		if (a.size() != b.size())
+			return false;
+
+		// Lowercases the eight bytes packed in x. Bytes with the high bit set are left alone.
+		auto lower = [](std::uint64_t x) {
+			const std::uint64_t ones = 0x0101010101010101ull;
+			const std::uint64_t high = ones * 0x80;
+			auto h = x & ~high;
+			auto ge_a = h + ones * (0x80 - 'A');
+			auto gt_z = h + ones * (0x80 - 'Z' - 1);
+			auto upper = ge_a & ~gt_z & ~x & high;
+			return x | (upper >> 2);
+		};
+
+		std::size_t i = 0;
+		for (; i + 8 <= a.size(); i += 8) {
+			std::uint64_t x, y;
+			std::memcpy(&x, a.data() + i, 8);
+			std::memcpy(&y, b.data() + i, 8);
+			if (x != y && lower(x) != lower(y))
+				return false;
+		}
+		if (i < a.size()) {
+			std::uint64_t x = 0, y = 0;
+			std::memcpy(&x, a.data() + i, a.size() - i);
+			std::memcpy(&y, b.data() + i, b.size() - i);
+			if (x != y && lower(x) != lower(y))
+				return false;
+		}
+		return true;
+	}
+
+	// Headers the server itself needs. They are recognized once when added, after which
+	// looking them up costs nothing.
+	enum class KnownHeader : std::uint8_t {
+		ContentLength,
+		Connection,
+		Host,
+		TransferEncoding,
+		AcceptEncoding,
+		IfNoneMatch,
+		IfModifiedSince,
+		Range,
+		IfRange,
+		Count
+	};
+
+	// The headers of one message, in the order they were received.
+	// Names and values are views into the receive buffer, so they are valid only until the
+	// connection moves on to its next message. Up to inline_count of them are stored without
+	// allocating.
+	class Headers
+	{
+	public:
+		struct Field {
+			std::string_view name;
+			std::string_view value;
+		};
+
+		typedef Field const* const_iterator;
+
+		static constexpr std::size_t inline_count = 32;
+
+		Headers() { clear(); }
+		Headers(Headers const&) = delete;
+		Headers& operator=(Headers const&) = delete;
+
+		void clear() {
+			count = 0;
+			for (auto& k : known)
+				k = none;
+			length = 0;
+		}
+
+		// Returns false for a second Content-Length that disagrees with the first, which
+		// must be rejected rather than guessed at
+		bool add(std::string_view name, std::string_view value) {
+			if (count == cap)
+				grow();
+			fields[count] = { name, value };
+
+			auto k = classify(name);
+			if (k != KnownHeader::Count) {
+				auto& slot = known[static_cast<std::size_t>(k)];
+				if (k == KnownHeader::ContentLength) {
+					std::uint64_t len = 0;
+					auto res = std::from_chars(value.data(), value.data() + value.size(), len);
+					if (res.ec != std::errc() || res.ptr != value.data() + value.size())
+						return false;
+					if (slot != none && len != length)
+						return false;
+					length = len;
+				}
+				if (slot == none)
+					slot = static_cast<std::uint32_t>(count);
+			}
+			++count;
+			return true;
+		}
+
+		// First value of the named header, or an empty view
+		std::string_view get(std::string_view name) const {
+			auto it = find(name);
+			return it != end() ? it->value : std::string_view();
+		}
+
+		std::string_view get(KnownHeader h) const {
+			auto i = known[static_cast<std::size_t>(h)];
+			return i != none ? fields[i].value : std::string_view();
+		}
+
+		bool has(KnownHeader h) const { return known[static_cast<std::size_t>(h)] != none; }
+
+		const_iterator find(std::string_view name) const {
+			auto k = classify(name);
+			if (k != KnownHeader::Count) {
+				auto i = known[static_cast<std::size_t>(k)];
+				return i != none ? fields + i : end();
+			}
+			for (auto it = begin(); it != end(); ++it) {
+				if (iequals(it->name, name))
+					return it;
+			}
+			return end();
+		}
+
+		// Value of Content-Length, already validated by add(). 0 when there is none.
+		std::uint64_t content_length() const { return length; }
+
+		// Whether a comma separated header, e.g. Connection, lists the given token
+		bool has_token(KnownHeader h, std::string_view token) const {
+			auto v = get(h);
+			while (!v.empty()) {
+				auto comma = v.find(',');
+				auto item = v.substr(0, comma);
+				while (!item.empty() && (item.front() == ' ' || item.front() == '\t'))
+					item.remove_prefix(1);
+				while (!item.empty() && (item.back() == ' ' || item.back() == '\t'))
+					item.remove_suffix(1);
+				if (iequals(item, token))
+					return true;
+				if (comma == std::string_view::npos)
+					break;
+				v.remove_prefix(comma + 1);
+			}
+			return false;
+		}
+
+		const_iterator begin() const { return fields; }
+		const_iterator end() const { return fields + count; }
+		std::size_t size() const { return count; }
+		bool empty() const { return count == 0; }
+
+	private:
+		static constexpr std::uint32_t none = 0xFFFFFFFF;
+
+		static KnownHeader classify(std::string_view name) {
+			switch (name.size())
+			{
+			case 4:
+				if (iequals(name, "host")) return KnownHeader::Host;
+				break;
+			case 5:
+				if (iequals(name, "range")) return KnownHeader::Range;
+				break;
+			case 8:
+				if (iequals(name, "if-range")) return KnownHeader::IfRange;
+				break;
+			case 10:
+				if (iequals(name, "connection")) return KnownHeader::Connection;
+				break;
+			case 13:
+				if (iequals(name, "if-none-match")) return KnownHeader::IfNoneMatch;
+				break;
+			case 14:
+				if (iequals(name, "content-length")) return KnownHeader::ContentLength;
+				break;
+			case 15:
+				if (iequals(name, "accept-encoding")) return KnownHeader::AcceptEncoding;
+				break;
+			case 17:
+				if (iequals(name, "transfer-encoding")) return KnownHeader::TransferEncoding;
+				if (iequals(name, "if-modified-since")) return KnownHeader::IfModifiedSince;
+				break;
+			}
+			return KnownHeader::Count;
+		}
+
+		void grow() {
+			overflow.resize(cap * 2);
+			if (fields == inline_fields)
+				std::memcpy(overflow.data(), inline_fields, sizeof(inline_fields));
+			fields = overflow.data();
+			cap = overflow.size();
+		}
+
+		Field inline_fields[inline_count];
+		std::vector<Field> overflow;
+		Field* fields = inline_fields;
+		std::size_t cap = inline_count;
+		std::size_t count = 0;
+		std::uint32_t known[static_cast<std::size_t>(KnownHeader::Count)];
+		std::uint64_t length = 0;
+	}; // class Headers
+
+	// The weight Accept-Encoding gives a content coding, from 0 to 1000. Unlisted codings
+	// get the weight of "*", if any, and identity is acceptable unless refused.
+	inline int accept_weight(std::string_view accept_encoding, std::string_view coding) {
+		int star = -1;
+		int identity = 1000;
+		while (!accept_encoding.empty()) {
+			auto comma = accept_encoding.find(',');
+			auto item = accept_encoding.substr(0, comma);
+			accept_encoding = comma == std::string_view::npos ? std::string_view() : accept_encoding.substr(comma + 1);
+
+			auto semi = item.find(';');
+			auto name = item.substr(0, semi);
+			while (!name.empty() && (name.front() == ' ' || name.front() == '\t'))
+				name.remove_prefix(1);
+			while (!name.empty() && (name.back() == ' ' || name.back() == '\t'))
+				name.remove_suffix(1);
+			// q=0, q=0.5, q=1.000 and so on, as thousandths
+			int q = 1000;
+			if (semi != std::string_view::npos) {
+				auto param = item.substr(semi + 1);
+				auto eq = param.find('=');
+				if (eq != std::string_view::npos) {
+					auto v = param.substr(eq + 1);
+					while (!v.empty() && v.front() == ' ')
+						v.remove_prefix(1);
+					q = (!v.empty() && v[0] == '1') ? 1000 : 0;
+					int scale = 100;
+					for (std::size_t i = 2; i < v.size() && i < 5 && v[i] >= '0' && v[i] <= '9'; ++i, scale /= 10)
+						q += (v[i] - '0') * scale;
+				}
+			}
+			if (iequals(name, coding))
+				return q;
+			if (name == "*")
+				star = q;
+			else if (iequals(name, "identity"))
+				identity = q;
+		}
+		if (star >= 0)
+			return star;
+		return iequals(coding, "identity") ? identity : 0;
+	}
+
+	// Headers that only apply to the connection they came over, so a proxy leaves them out.
+	// Content-Length too, which the response that passes the body on sets itself.
+	inline bool hop_by_hop(std::string_view name) {
+		for (auto h : { "connection", "keep-alive", "proxy-authenticate", "proxy-authorization", "te", "trailer", "transfer-encoding", "upgrade", "content-length" }) {
+			if (iequals(name, h))
+				return true;
+		}
+		return false;
+	}
+} // namespace bb
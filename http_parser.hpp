@@ -0,0 +1,363 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+#include <vector>
+
+namespace bb {
+	// Incremental HTTP/1.x message head parser.
+	// The caller keeps all unconsumed input in one contiguous buffer and hands the whole
+	// of it to parse() every time more data arrives. Lines that were already parsed are not
+	// scanned again, so the total work is a single pass over the head. Line ends are found
+	// with memchr, which is vectorized by every libc we care about.
+	// All views returned point into the last buffer passed to parse(), so they are only
+	// valid while that buffer is neither consumed nor reallocated.
+	class HttpParser
+	{
+	public:
+		enum class Kind { Request, Response };
+		enum class Result { Incomplete, Done, Error };
+
+		struct Header {
+			std::string_view name;
+			std::string_view value;
+		};
+
+		explicit HttpParser(Kind kind) : kind(kind) { }
+
+		void reset() {
+			state = State::StartLine;
+			pos = 0;
+			head_len = 0;
+			buf = nullptr;
+			spans.clear();
+			hdrs.clear();
+		}
+
+		Result parse(const char* base, std::size_t len) {
+			if (state == State::Done) {
+				if (base != buf)
+					materialize(base);
+				return Result::Done;
+			}
+			if (state == State::Error)
+				return Result::Error;
+
+			in = base;
+			while (pos < len) {
+				auto line = base + pos;
+				auto nl = static_cast<const char*>(std::memchr(line, '\n', len - pos));
+				if (!nl)
+					return Result::Incomplete;
+
+				std::size_t line_len = nl - line;
+				if (line_len && line[line_len - 1] == '\r')
+					--line_len;
+
+				if (state == State::StartLine) {
+					if (!(kind == Kind::Request ? parse_request_line(line, line_len) : parse_status_line(line, line_len)))
+						return fail();
+					state = State::Headers;
+				}
+				else if (line_len == 0) {
+					pos = nl + 1 - base;
+					head_len = pos;
+					state = State::Done;
+					materialize(base);
+					return Result::Done;
+				}
+				else if (!parse_header_line(line, line_len)) {
+					return fail();
+				}
+				pos = nl + 1 - base;
+			}
+			return Result::Incomplete;
+		}
+
+		// Number of bytes taken by the start line, the headers and the blank line that ends them
+		std::size_t head_length() const { return head_len; }
+
+		std::string_view method() const { return view(start[0]); }
+		std::string_view target() const { return view(start[1]); }
+		std::string_view reason() const { return view(start[1]); }
+		unsigned int status() const { return stat; }
+		unsigned int minor_version() const { return minor; }
+
+		std::vector<Header> const& headers() const { return hdrs; }
+
+	private:
+		enum class State { StartLine, Headers, Done, Error };
+
+		// Offsets are kept instead of pointers while parsing, since the caller's buffer may
+		// move between calls.
+		struct Span {
+			std::uint32_t off;
+			std::uint32_t len;
+		};
+
+		static bool is_tchar(unsigned char c) {
+			static const char extra[] = "!#$%&'*+-.^_`|~";
+			return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || (c && std::memchr(extra, c, sizeof(extra) - 1));
+		}
+
+		Result fail() {
+			state = State::Error;
+			return Result::Error;
+		}
+
+		Span span(const char* p, std::size_t len) const {
+			return { static_cast<std::uint32_t>(p - in), static_cast<std::uint32_t>(len) };
+		}
+
+		bool parse_version(const char* p, std::size_t len) {
+			if (len != 8 || std::memcmp(p, "HTTP/1.", 7) != 0 || (p[7] != '0' && p[7] != '1'))
+				return false;
+			minor = p[7] - '0';
+			return true;
+		}
+
+		// METHOD SP request-target SP HTTP/1.x
+		bool parse_request_line(const char* line, std::size_t len) {
+			auto end = line + len;
+			auto p = line;
+			while (p != end && is_tchar(*p))
+				++p;
+			if (p == line || p == end || *p != ' ')
+				return false;
+			start[0] = span(line, p - line);
+
+			auto t = ++p;
+			while (p != end && static_cast<unsigned char>(*p) > ' ')
+				++p;
+			if (p == t || p == end || *p != ' ')
+				return false;
+			start[1] = span(t, p - t);
+
+			++p;
+			return parse_version(p, end - p);
+		}
+
+		// HTTP/1.x SP 3DIGIT SP reason-phrase
+		bool parse_status_line(const char* line, std::size_t len) {
+			if (len < 12 || !parse_version(line, 8) || line[8] != ' ' || (len > 12 && line[12] != ' '))
+				return false;
+			stat = 0;
+			for (int i = 9; i < 12; ++i) {
+				if (line[i] < '0' || line[i] > '9')
+					return false;
+				stat = stat * 10 + (line[i] - '0');
+			}
+			auto r = len > 13 ? line + 13 : line + len;
+			start[0] = span(line, 8);
+			start[1] = span(r, line + len - r);
+			return true;
+		}
+
+		// field-name ":" OWS field-value OWS
+		bool parse_header_line(const char* line, std::size_t len) {
+			auto end = line + len;
+			auto colon = static_cast<const char*>(std::memchr(line, ':', len));
+			if (!colon || colon == line)
+				return false;
+			for (auto p = line; p != colon; ++p) {
+				if (!is_tchar(*p))
+					return false;
+			}
+
+			auto v = colon + 1;
+			while (v != end && (*v == ' ' || *v == '\t'))
+				++v;
+			auto ve = end;
+			while (ve != v && (ve[-1] == ' ' || ve[-1] == '\t'))
+				--ve;
+
+			spans.push_back(span(line, colon - line));
+			spans.push_back(span(v, ve - v));
+			return true;
+		}
+
+		void materialize(const char* base) {
+			buf = base;
+			hdrs.clear();
+			hdrs.reserve(spans.size() / 2);
+			for (std::size_t i = 0; i < spans.size(); i += 2) {
+				hdrs.push_back({ view(spans[i]), view(spans[i + 1]) });
+			}
+		}
+
+		std::string_view view(Span s) const {
+			return buf ? std::string_view(buf + s.off, s.len) : std::string_view();
+		}
+
+		Kind kind;
+		State state = State::StartLine;
+		std::size_t pos = 0;
+		std::size_t head_len = 0;
+		const char* in = nullptr;
+		const char* buf = nullptr;
+
+		Span start[2] = {};
+		unsigned int stat = 0;
+		unsigned int minor = 1;
+		std::vector<Span> spans;
+		std::vector<Header> hdrs;
+	}; // class HttpParser
+
+	// Decodes a message body framed either by Content-Length or by the chunked transfer coding.
+	// Input is handed over in whatever pieces it arrives in. The data of all the chunks in a
+	// piece is moved to its front, so it comes out in one run and the framing never has to
+	// be buffered, even when it is split between pieces.
+	class BodyDecoder
+	{
+	public:
+		enum class Result { More, Done, Error, TooLarge };
+
+		Result start(bool is_chunked, std::uint64_t length, std::uint64_t max_size) {
+			chunked = is_chunked;
+			max = max_size;
+			total = 0;
+			left = chunked ? 0 : length;
+			digits = 0;
+			too_large = false;
+			if (!chunked && length > max) {
+				state = State::Error;
+				return Result::TooLarge;
+			}
+			state = chunked ? State::Size : (length ? State::Data : State::Done);
+			return state == State::Done ? Result::Done : Result::More;
+		}
+
+		// Decodes what it can of [p, p + len). used is set to the number of input bytes taken,
+		// which is all of them unless the body ends or is malformed, and out to the number of
+		// body bytes now at p.
+		Result decode(char* p, std::size_t len, std::size_t& used, std::size_t& out) {
+			out = 0;
+			std::size_t i = 0;
+			while (i < len && state != State::Done && state != State::Error) {
+				if (state == State::Data) {
+					auto n = static_cast<std::size_t>(std::min<std::uint64_t>(left, len - i));
+					if (out != i)
+						std::memmove(p + out, p + i, n);
+					out += n;
+					i += n;
+					left -= n;
+					total += n;
+					if (left == 0)
+						state = chunked ? State::DataEnd : State::Done;
+					continue;
+				}
+
+				auto c = p[i++];
+				switch (state)
+				{
+				case State::Size:
+					if (auto d = hex(c); d >= 0 && digits < 15) {
+						left = left * 16 + d;
+						++digits;
+					}
+					else if (digits == 0)
+						state = State::Error;
+					else if (c == ';' || c == ' ' || c == '\t')
+						state = State::Extension;
+					else if (c == '\r')
+						state = State::SizeEnd;
+					else if (c == '\n')
+						chunk_start();
+					else
+						state = State::Error;
+					break;
+				case State::Extension:
+					if (c == '\n')
+						chunk_start();
+					break;
+				case State::SizeEnd:
+					if (c == '\n')
+						chunk_start();
+					else
+						state = State::Error;
+					break;
+				case State::DataEnd:
+					if (c == '\r')
+						state = State::DataEndLF;
+					else if (c == '\n')
+						state = State::Size;
+					else
+						state = State::Error;
+					break;
+				case State::DataEndLF:
+					state = c == '\n' ? State::Size : State::Error;
+					break;
+				case State::Trailer:
+					if (c == '\r')
+						state = State::TrailerEnd;
+					else if (c == '\n')
+						state = State::Done;
+					else
+						state = State::TrailerLine;
+					break;
+				case State::TrailerLine:
+					if (c == '\n')
+						state = State::Trailer;
+					break;
+				case State::TrailerEnd:
+					state = c == '\n' ? State::Done : State::Error;
+					break;
+				default:
+					break;
+				}
+			}
+			used = i;
+			if (state == State::Error)
+				return too_large ? Result::TooLarge : Result::Error;
+			return state == State::Done ? Result::Done : Result::More;
+		}
+
+		// Accounts for n bytes of a Content-Length body that the caller read by itself
+		void skip(std::uint64_t n) {
+			left -= n;
+			total += n;
+			if (left == 0 && state == State::Data)
+				state = State::Done;
+		}
+
+		// How much can be read without going past the end of the body, when that is known
+		std::size_t read_limit(std::size_t cap) const {
+			return chunked ? cap : static_cast<std::size_t>(std::min<std::uint64_t>(left, cap));
+		}
+
+		bool is_chunked() const { return chunked; }
+		bool done() const { return state == State::Done; }
+		std::uint64_t remaining() const { return chunked ? 0 : left; }
+
+	private:
+		enum class State { Size, Extension, SizeEnd, Data, DataEnd, DataEndLF, Trailer, TrailerLine, TrailerEnd, Done, Error };
+
+		static int hex(char c) {
+			if (c >= '0' && c <= '9') return c - '0';
+			if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+			if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+			return -1;
+		}
+
+		// Called at the end of a chunk size line. The chunk is refused before any of it is
+		// read if it would take the body over the limit.
+		void chunk_start() {
+			digits = 0;
+			too_large = total + left > max;
+			if (too_large)
+				state = State::Error;
+			else
+				state = left ? State::Data : State::Trailer;
+		}
+
+		bool chunked = false;
+		bool too_large = false;
+		State state = State::Done;
+		std::uint64_t left = 0;
+		std::uint64_t total = 0;
+		std::uint64_t max = 0;
+		unsigned int digits = 0;
+	}; // class BodyDecoder
+} // namespace bb
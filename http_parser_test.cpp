@@ -0,0 +1,221 @@
+// Checks HttpParser on heads that arrive whole, a byte at a time and in a buffer that moves
+// between calls, and BodyDecoder on bodies split at every point, and that malformed heads
+// and bodies are refused.
+//   g++ -std=c++17 -O2 http_parser_test.cpp -o http_parser_test -lpthread
+//   http_parser_test
+
+#include <algorithm>
+#include <iostream>
+#include <string>
+#include <string_view>
+
+#define ASIO_STANDALONE 1
+#define ASIO_NO_DEPRECATED 1
+
+#include "http_parser.hpp"
+#include "test_support.hpp"
+
+using namespace bb;
+
+static bool inside(std::string_view v, std::string const& buf) {
+	return v.data() >= buf.data() && v.data() + v.size() <= buf.data() + buf.size();
+}
+
+static HttpParser::Result parse_all(HttpParser& p, std::string const& s) {
+	return p.parse(s.data(), s.size());
+}
+
+static void request_whole() {
+	std::string head = "GET /a/b?c=d HTTP/1.1\r\nHost: example.com\r\nX-Padded:  some value \t\r\nEmpty:\r\n\r\n";
+	std::string in = head + "body";
+	HttpParser p(HttpParser::Kind::Request);
+	check(parse_all(p, in) == HttpParser::Result::Done, "a whole request head parses");
+	check(p.method() == "GET" && p.target() == "/a/b?c=d" && p.minor_version() == 1, "method, target and version");
+	check(p.head_length() == head.size(), "the head ends after the blank line");
+	auto& h = p.headers();
+	check(h.size() == 3, "every header line is a header");
+	if (h.size() == 3) {
+		check(h[0].name == "Host" && h[0].value == "example.com", "name and value");
+		check(h[1].value == "some value", "whitespace around a value is not part of it");
+		check(h[2].name == "Empty" && h[2].value.empty(), "an empty value");
+		check(inside(h[0].name, in) && inside(h[1].value, in), "views point into the buffer");
+	}
+}
+
+static void request_bytewise() {
+	std::string in = "POST /upload HTTP/1.0\r\nContent-Length: 5\r\n\r\n";
+	HttpParser p(HttpParser::Kind::Request);
+	bool early = false;
+	for (std::size_t n = 1; n < in.size(); ++n) {
+		early |= p.parse(in.data(), n) != HttpParser::Result::Incomplete;
+	}
+	check(!early, "a head is incomplete until its blank line");
+	check(parse_all(p, in) == HttpParser::Result::Done, "a head given a byte at a time parses");
+	check(p.method() == "POST" && p.target() == "/upload" && p.minor_version() == 0, "HTTP/1.0");
+	check(p.headers().size() == 1 && p.headers()[0].value == "5", "the header of a bytewise head");
+}
+
+static void request_moved() {
+	std::string first = "GET /moved HTTP/1.1\r\nHost: a\r\n";
+	HttpParser p(HttpParser::Kind::Request);
+	check(parse_all(p, first) == HttpParser::Result::Incomplete, "half a head");
+	// The caller's buffer grows elsewhere with the rest of it
+	std::string second = first + "Accept: */*\r\n\r\n";
+	check(parse_all(p, second) == HttpParser::Result::Done, "the rest of a head in a moved buffer");
+	check(p.target() == "/moved" && inside(p.target(), second), "the start line is found in the moved buffer");
+	check(p.headers().size() == 2 && inside(p.headers()[0].value, second), "the headers are found in the moved buffer");
+	// And once more after it is done
+	std::string third = second;
+	check(parse_all(p, third) == HttpParser::Result::Done && inside(p.method(), third) && inside(p.headers()[1].name, third), "views follow a buffer moved after the head is done");
+}
+
+static void request_bare_lf() {
+	std::string in = "GET / HTTP/1.1\nHost: x\n\n";
+	HttpParser p(HttpParser::Kind::Request);
+	check(parse_all(p, in) == HttpParser::Result::Done && p.head_length() == in.size(), "lines may end in a bare LF");
+	check(p.headers().size() == 1 && p.headers()[0].value == "x", "the header of a bare LF head");
+}
+
+static void response() {
+	HttpParser p(HttpParser::Kind::Response);
+	std::string in = "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n";
+	check(parse_all(p, in) == HttpParser::Result::Done, "a response head parses");
+	check(p.status() == 404 && p.reason() == "Not Found", "status and reason");
+	p.reset();
+	in = "HTTP/1.0 204\r\n\r\n";
+	check(parse_all(p, in) == HttpParser::Result::Done && p.status() == 204 && p.reason().empty() && p.minor_version() == 0, "a status line without a reason");
+}
+
+static void malformed() {
+	static char const* const requests[] = {
+		"GET  / HTTP/1.1\r\n\r\n",          // no target
+		"GET / HTTP/2.0\r\n\r\n",           // not HTTP/1.x
+		"GET /\r\n\r\n",                    // no version
+		"G(T / HTTP/1.1\r\n\r\n",           // not a token
+		"GET / HTTP/1.1\r\nNoColon\r\n\r\n",
+		"GET / HTTP/1.1\r\n: empty name\r\n\r\n",
+		"GET / HTTP/1.1\r\nBad Name: x\r\n\r\n",
+	};
+	for (auto r : requests) {
+		HttpParser p(HttpParser::Kind::Request);
+		std::string in = r;
+		if (parse_all(p, in) != HttpParser::Result::Error) {
+			std::cout << "not refused: " << in.substr(0, in.find('\n')) << "\n";
+			check(false, "a malformed request head is refused");
+		}
+		check(parse_all(p, in) == HttpParser::Result::Error, "a refused head stays refused");
+	}
+	static char const* const responses[] = {
+		"HTTP/1.1 2x0 OK\r\n\r\n",
+		"HTTP/1.1 200OK\r\n\r\n",
+		"HTTP/1.1 20\r\n\r\n",
+	};
+	for (auto r : responses) {
+		HttpParser p(HttpParser::Kind::Response);
+		check(parse_all(p, r) == HttpParser::Result::Error, "a malformed status line is refused");
+	}
+	// reset() makes a refusing parser good for the next message
+	HttpParser p(HttpParser::Kind::Request);
+	parse_all(p, "GET / HTTP/3\r\n\r\n");
+	p.reset();
+	check(parse_all(p, "GET /again HTTP/1.1\r\n\r\n") == HttpParser::Result::Done && p.target() == "/again", "reset() after an error");
+}
+
+// Runs input through a decoder in pieces of at most step bytes, as a connection would,
+// and returns what came out. used is the input taken in all.
+static BodyDecoder::Result decode_all(BodyDecoder& d, std::string in, std::size_t step, std::string& body, std::size_t& used) {
+	body.clear();
+	used = 0;
+	auto r = BodyDecoder::Result::More;
+	while (r == BodyDecoder::Result::More && used < in.size()) {
+		auto len = std::min(step, in.size() - used);
+		std::size_t took = 0, out = 0;
+		r = d.decode(&in[used], len, took, out);
+		body.append(&in[used], out);
+		used += took;
+	}
+	return r;
+}
+
+static void body_length() {
+	BodyDecoder d;
+	std::string body;
+	std::size_t used = 0;
+	check(d.start(false, 10, 100) == BodyDecoder::Result::More, "a Content-Length body is expected");
+	check(decode_all(d, "0123456789GET / HTTP/1.1\r\n", 4, body, used) == BodyDecoder::Result::Done, "a Content-Length body ends");
+	check(body == "0123456789" && used == 10, "a Content-Length body stops at its length, before the next request");
+	check(d.start(false, 0, 100) == BodyDecoder::Result::Done && d.done(), "an empty body is done at once");
+	check(d.start(false, 101, 100) == BodyDecoder::Result::TooLarge, "a Content-Length over the limit is refused up front");
+
+	// What the caller reads by itself straight into its own buffer is only counted
+	d.start(false, 10, 100);
+	check(d.read_limit(64) == 10, "no more is read than the body has left");
+	d.skip(6);
+	check(d.remaining() == 4 && !d.done(), "skip() counts what the caller read");
+	d.skip(4);
+	check(d.done(), "skip() ends the body");
+}
+
+static void body_chunked() {
+	std::string in = "5\r\nhello\r\n6;name=value\r\n world\r\nA\r\n, chunked!\r\n0\r\nTrailer: x\r\n\r\nNEXT";
+	std::string expected = "hello world, chunked!";
+	auto end = in.size() - 4;
+	for (std::size_t step = 1; step <= in.size(); ++step) {
+		BodyDecoder d;
+		std::string body;
+		std::size_t used = 0;
+		d.start(true, 0, 100);
+		auto r = decode_all(d, in, step, body, used);
+		if (r != BodyDecoder::Result::Done || body != expected || used != end) {
+			std::cout << "pieces of " << step << ": got \"" << body << "\" and took " << used << "\n";
+			check(false, "a chunked body decodes whatever pieces it comes in");
+			break;
+		}
+	}
+
+	BodyDecoder d;
+	std::string body;
+	std::size_t used = 0;
+	d.start(true, 0, 100);
+	check(decode_all(d, "3\nabc\n0\n\nX", 64, body, used) == BodyDecoder::Result::Done && body == "abc" && used == 9, "chunk lines may end in a bare LF");
+}
+
+static void body_chunked_refused() {
+	static char const* const bodies[] = {
+		"\r\nhello\r\n0\r\n\r\n",           // no size
+		"zz\r\n",                           // not hex
+		"5\r\nhelloX\r\n0\r\n\r\n",          // no line end after the data
+		"5\rX",                             // CR without LF
+		"1000000000000000\r\n",             // more digits than fit
+	};
+	for (auto b : bodies) {
+		BodyDecoder d;
+		std::string body;
+		std::size_t used = 0;
+		d.start(true, 0, 100);
+		check(decode_all(d, b, 64, body, used) == BodyDecoder::Result::Error, "a malformed chunked body is refused");
+	}
+
+	// The limit holds for the body as a whole, in one piece or many
+	std::string in = "8\r\n12345678\r\n8\r\n12345678\r\n0\r\n\r\n";
+	for (std::size_t step : { in.size(), std::size_t(5) }) {
+		BodyDecoder d;
+		std::string body;
+		std::size_t used = 0;
+		d.start(true, 0, 10);
+		check(decode_all(d, in, step, body, used) == BodyDecoder::Result::TooLarge && body.size() <= 10, "chunks over the limit are refused");
+	}
+}
+
+int main() {
+	request_whole();
+	request_bytewise();
+	request_moved();
+	request_bare_lf();
+	response();
+	malformed();
+	body_length();
+	body_chunked();
+	body_chunked_refused();
+	return finish();
+}
@@ -0,0 +1,351 @@
+// Load generator for a local Server. Replays a list of requests over keep-alive connections,
+// each from a blocking client of its own, and reports throughput and latency percentiles.
+//   load_bench [threads] [connections] [seconds] [rate] [file]
+// With rate 0, the default, the load is closed loop: each connection sends its next
+// request as soon as the last one is answered. Otherwise requests are sent open loop, rate
+// a second spread evenly over the connections, and latency is counted from when a request
+// was due rather than from when it went out. A server that stalls is then charged for the
+// requests that piled up behind the stall, which a closed loop would not have sent
+// (coordinated omission). Time spent on the wire alone is reported as service time.
+// Requests that never got their turn before the end are counted as answered then.
+// The file has a request per line, as a JSON object with string members:
+//   {"method": "POST", "path": "/echo", "body": "hello", "Content-Type": "text/plain"}
+// Members other than method, path and body are sent as headers. Without a file the routes
+// of the local server are requested in turn.
+
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define ASIO_STANDALONE 1
+#define ASIO_NO_DEPRECATED 1
+
+#include "compression.hpp"
+#include "metrics.hpp"
+#include "response_cache.hpp"
+#include "server.hpp"
+
+using namespace bb;
+
+typedef std::chrono::steady_clock clock_type;
+
+struct Request {
+	std::string data; // serialized
+	bool head_only;
+};
+
+static Request make_request(std::string const& method, std::string const& path, std::string const& headers, std::string const& body) {
+	Request r;
+	r.data = method + ' ' + path + " HTTP/1.1\r\nHost: localhost\r\n" + headers;
+	if (!body.empty() || method == "POST")
+		r.data += "Content-Length: " + std::to_string(body.size()) + "\r\n";
+	r.data += "\r\n" + body;
+	r.head_only = method == "HEAD";
+	return r;
+}
+
+// Reads a JSON string starting at the opening quote at p, or returns false
+static bool json_string(std::string const& line, std::size_t& p, std::string& out) {
+	if (p >= line.size() || line[p] != '"')
+		return false;
+	out.clear();
+	for (++p; p < line.size(); ++p) {
+		auto c = line[p];
+		if (c == '"') {
+			++p;
+			return true;
+		}
+		if (c != '\\') {
+			out += c;
+			continue;
+		}
+		if (++p == line.size())
+			return false;
+		switch (line[p]) {
+		case 'n': out += '\n'; break;
+		case 'r': out += '\r'; break;
+		case 't': out += '\t'; break;
+		case 'u': {
+			// Only ASCII is of any use in a request
+			unsigned int cp = 0;
+			if (p + 4 >= line.size() || std::from_chars(line.data() + p + 1, line.data() + p + 5, cp, 16).ptr != line.data() + p + 5)
+				return false;
+			out += cp < 0x80 ? static_cast<char>(cp) : '?';
+			p += 4;
+			break;
+		}
+		default: out += line[p]; break;
+		}
+	}
+	return false;
+}
+
+// One flat object of string members per line
+static bool parse_line(std::string const& line, Request& r) {
+	std::string method = "GET", path = "/", headers, body, name, value;
+	auto skip = [&](std::size_t& p) {
+		while (p < line.size() && (line[p] == ' ' || line[p] == '\t'))
+			++p;
+	};
+	std::size_t p = 0;
+	skip(p);
+	if (p == line.size() || line[p++] != '{')
+		return false;
+	for (;;) {
+		skip(p);
+		if (p < line.size() && line[p] == '}')
+			break;
+		if (!json_string(line, p, name))
+			return false;
+		skip(p);
+		if (p == line.size() || line[p++] != ':')
+			return false;
+		skip(p);
+		if (!json_string(line, p, value))
+			return false;
+		if (name == "method")
+			method = value;
+		else if (name == "path")
+			path = value;
+		else if (name == "body")
+			body = value;
+		else
+			headers += name + ": " + value + "\r\n";
+		skip(p);
+		if (p < line.size() && line[p] == ',')
+			++p;
+	}
+	r = make_request(method, path, headers, body);
+	return true;
+}
+
+static std::vector<Request> load_requests(char const* file) {
+	std::vector<Request> reqs;
+	std::ifstream in(file);
+	if (!in) {
+		std::cerr << "cannot open " << file << '\n';
+		return reqs;
+	}
+	std::string line;
+	for (unsigned int n = 1; std::getline(in, line); ++n) {
+		if (line.empty() || line.find_first_not_of(" \t\r") == std::string::npos)
+			continue;
+		Request r;
+		if (parse_line(line, r))
+			reqs.push_back(std::move(r));
+		else
+			std::cerr << file << ':' << n << ": not a request\n";
+	}
+	return reqs;
+}
+
+// Reads one response, leaving whatever follows it in buf, and returns its status
+static unsigned int read_response(asio::ip::tcp::socket& sock, std::string& buf, bool head_only) {
+	auto read_more = [&]() {
+		auto old = buf.size();
+		buf.resize(old + 16 * 1024);
+		buf.resize(old + sock.read_some(asio::buffer(&buf[old], buf.size() - old)));
+	};
+
+	HttpParser parser(HttpParser::Kind::Response);
+	HttpParser::Result res;
+	while ((res = parser.parse(buf.data(), buf.size())) == HttpParser::Result::Incomplete) {
+		read_more();
+	}
+	if (res == HttpParser::Result::Error)
+		throw std::runtime_error("malformed response");
+
+	Headers headers;
+	for (auto& h : parser.headers()) {
+		headers.add(h.name, h.value);
+	}
+	auto status = parser.status();
+	auto chunked = headers.has_token(KnownHeader::TransferEncoding, "chunked");
+	auto length = headers.content_length();
+	buf.erase(0, parser.head_length());
+	if (head_only || status < 200 || status == 204 || status == 304)
+		return status;
+
+	BodyDecoder body;
+	if (body.start(chunked, length, std::numeric_limits<std::uint64_t>::max()) == BodyDecoder::Result::Done)
+		return status;
+	for (;;) {
+		std::size_t used = 0, n = 0;
+		auto r = body.decode(&buf[0], buf.size(), used, n);
+		buf.erase(0, used);
+		if (r == BodyDecoder::Result::Done)
+			return status;
+		if (r != BodyDecoder::Result::More)
+			throw std::runtime_error("malformed body");
+		read_more();
+	}
+}
+
+struct Results {
+	Histogram::Snapshot latency;
+	Histogram::Snapshot service;
+	unsigned long long requests = 0;
+	unsigned long long failed = 0;   // answered with 4xx or 5xx
+	unsigned long long dropped = 0;  // connections lost
+	unsigned long long unsent = 0;   // due but not sent by the end, for lack of answers
+	clock_type::duration elapsed{};
+};
+
+static Results run_load(unsigned short port, std::vector<Request> const& reqs, unsigned int connections, unsigned int seconds, double rate) {
+	std::vector<Histogram> latency(connections), service(connections);
+	std::vector<unsigned long long> counts(connections), failures(connections), unsent(connections);
+	std::atomic<unsigned long long> dropped{ 0 };
+	// The period between the requests of one connection
+	auto period = rate > 0 ? std::chrono::duration_cast<clock_type::duration>(std::chrono::duration<double>(connections / rate)) : clock_type::duration();
+	auto start = clock_type::now() + std::chrono::milliseconds(100);
+	auto end = start + std::chrono::seconds(seconds);
+
+	std::vector<std::thread> clients;
+	for (unsigned int c = 0; c < connections; ++c) {
+		clients.emplace_back([&, c]() {
+			asio::io_context io;
+			asio::ip::tcp::socket sock(io);
+			std::string buf;
+			try {
+				sock.connect({ asio::ip::address_v4::loopback(), port });
+				sock.set_option(asio::ip::tcp::no_delay(true));
+				// Connections start a fraction of a period apart, so the schedule is even
+				auto due = start + period * c / connections;
+				std::this_thread::sleep_until(start);
+				for (std::size_t k = c; ; k += connections) {
+					auto now = clock_type::now();
+					if (rate > 0) {
+						if (due >= end)
+							break;
+						if (now >= end) {
+							// Still waiting for their turn, which is at least this late
+							for (; due < end; due += period) {
+								latency[c].record(now - due);
+								++unsent[c];
+							}
+							break;
+						}
+						if (now < due) {
+							std::this_thread::sleep_until(due);
+							now = clock_type::now();
+						}
+					}
+					else if (now >= end) {
+						break;
+					}
+					auto& req = reqs[k % reqs.size()];
+					asio::write(sock, asio::buffer(req.data));
+					auto status = read_response(sock, buf, req.head_only);
+					auto done = clock_type::now();
+					service[c].record(done - now);
+					latency[c].record(done - (rate > 0 ? due : now));
+					++counts[c];
+					if (status >= 400)
+						++failures[c];
+					due += period;
+				}
+			}
+			catch (std::exception const& e) {
+				std::cerr << "connection " << c << ": " << e.what() << '\n';
+				++dropped;
+			}
+		});
+	}
+	for (auto& t : clients) {
+		t.join();
+	}
+
+	Results r;
+	r.elapsed = clock_type::now() - start;
+	for (unsigned int c = 0; c < connections; ++c) {
+		r.latency.add(latency[c]);
+		r.service.add(service[c]);
+		r.requests += counts[c];
+		r.failed += failures[c];
+		r.unsent += unsent[c];
+	}
+	r.dropped = dropped;
+	return r;
+}
+
+static void print_percentiles(char const* name, Histogram::Snapshot const& h) {
+	std::cout << name << "p50 " << h.quantile(0.5) << " us, p99 " << h.quantile(0.99) << " us, p999 " << h.quantile(0.999)
+		<< " us, max " << h.quantile(1) << " us\n";
+}
+
+int main(int argc, char* argv[])
+{
+	unsigned int threads = argc > 1 ? std::stoul(argv[1]) : std::max(1u, std::thread::hardware_concurrency() / 2);
+	unsigned int connections = argc > 2 ? std::stoul(argv[2]) : 4 * threads;
+	unsigned int seconds = argc > 3 ? std::stoul(argv[3]) : 5;
+	double rate = argc > 4 ? std::stod(argv[4]) : 0;
+	if (connections == 0)
+		connections = 1;
+
+	// Something of everything the server does on the way to a response
+	Server s(0);
+	s.add_route("/", Methods::GET | Methods::HEAD, [](Captures const&, Methods, Connection::ptr con) {
+		con->make_response(200, "", "ok\n");
+	});
+	s.add_route("/users/{id:int}", Methods::GET, [](Captures const& caps, Methods, Connection::ptr con) {
+		con->make_response(200, "Content-Type: application/json\r\n", "{\"id\":" + std::string(caps[1]) + "}");
+	});
+	s.add_route("/report/{lines:int}", Methods::GET, [](Captures const& caps, Methods, Connection::ptr con) {
+		std::string body;
+		for (std::int64_t i = 0; i < caps.integer(1); ++i) {
+			body += "Line " + std::to_string(i) + " of the report\n";
+		}
+		con->make_response(200, "Content-Type: text/plain\r\n", std::move(body));
+	}, std::make_shared<Compression>());
+	s.add_route("/cached/{name}", Methods::GET, [](Captures const& caps, Methods, Connection::ptr con) {
+		con->make_response(200, "", "Hi " + std::string(caps[1]) + '\n');
+	}, CachePolicy{ std::make_shared<ResponseCache>(), std::chrono::seconds(10), {} });
+	s.add_route("/echo", Methods::POST, [](Captures const&, Methods, Connection::ptr con) {
+		con->make_response(200, "", con->body());
+	});
+
+	std::vector<Request> reqs;
+	if (argc > 5) {
+		reqs = load_requests(argv[5]);
+	}
+	else {
+		reqs.push_back(make_request("GET", "/", "", ""));
+		reqs.push_back(make_request("GET", "/users/12345", "Accept: application/json\r\n", ""));
+		reqs.push_back(make_request("GET", "/report/100", "Accept-Encoding: gzip\r\n", ""));
+		reqs.push_back(make_request("GET", "/cached/some%20body", "", ""));
+		reqs.push_back(make_request("POST", "/echo", "Content-Type: text/plain\r\n", std::string(1000, 'x')));
+	}
+	if (reqs.empty()) {
+		std::cerr << "no requests\n";
+		return 1;
+	}
+
+	std::thread server_thread([&s, threads]() { s.run(threads); });
+	std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+	auto r = run_load(s.port(), reqs, connections, seconds, rate);
+
+	s.stop();
+	server_thread.join();
+
+	std::cout << threads << " threads, " << connections << " connections, " << seconds << " s, "
+		<< (rate > 0 ? "open loop at " + std::to_string(static_cast<unsigned long long>(rate)) + " req/s" : std::string("closed loop")) << '\n'
+		<< r.requests << " requests, " << std::fixed << std::setprecision(0) << r.requests / std::chrono::duration<double>(r.elapsed).count() << " req/s, "
+		<< r.failed << " 4xx/5xx, " << r.dropped << " connections lost\n";
+	print_percentiles("latency:      ", r.latency);
+	if (rate > 0) {
+		print_percentiles("service time: ", r.service);
+		if (r.unsent)
+			std::cout << "the server could not keep up: " << r.unsent << " requests were still due at the end and count as late as they were\n";
+	}
+
+	return r.dropped ? 1 : 0;
+}
@@ -5,36 +5,194 @@
 
 #include "server.hpp"
 #include "client_connection.hpp"
+#include "client_pool.hpp"
+#include "compression.hpp"
+#include "response_cache.hpp"
+#include "single_flight.hpp"
+#include "upstream_group.hpp"
+#include "static_files.hpp"
 
 using namespace bb;
 
-void home(std::smatch const& path, Methods method, Connection::ptr con) {
-	con->make_response(200, "", "Hi from home() on " + path[0].str() + '\n');
+void home(Captures const& path, Methods method, Connection::ptr con) {
+	con->make_response(200, "", "Hi from home() on " + std::string(path[0]) + '\n');
 }
 
-struct Response
+struct Responder
 {
-	void operator()(std::smatch const& path, Methods method, Connection::ptr con) {
-		con->make_response(200, "", "Hi from Response on " + path[0].str() + '\n');
+	void operator()(Captures const& path, Methods method, Connection::ptr con) {
+		con->make_response(200, "", "Hi from Response on " + std::string(path[0]) + '\n');
 	}
 };
 
 int main()
 {
+	// Upstream connections for /fwd, kept open between requests
+	ClientPool upstreams;
+#if defined(ASIO_HAS_LOCAL_SOCKETS)
+	// Started again while running, the new instance takes the listening socket over from the
+	// old one, which then drains and exits, so restarting refuses no one
+	const std::string handoff_path = "/tmp/bb-8080.sock";
+	Server s(8080, ServerOptions::None, take_listener(handoff_path));
+	s.hand_off(handoff_path);
+#else
 	Server s(8080);
-	Response responder;
+#endif // defined(ASIO_HAS_LOCAL_SOCKETS)
+	Responder responder;
 	s.add_route("/", Methods::GET, responder);
 	s.add_route("/home", Methods::GET | Methods::POST, home);
 	s.add_route("/home2", Methods::POST, responder);
-	s.add_route("/fwd/([^/:]+)(:([0-9]+))?(/.*)", Methods::GET, [&s](std::smatch const& path, Methods method, Connection::ptr con) {
-		std::string port = path[3];
-		ClientConnection::new_connection(s.context(), path[1], (!port.empty() ? port : "http"))->send_request(path[4], "", [con{ std::move(con) }, path, &s](ClientConnection::ptr ptr) {
-			asio::steady_timer tmr(s.context());
-			tmr.expires_after(std::chrono::seconds(7));
-			tmr.wait();
-			ptr->send_request(path[4], "", [con{ std::move(con) }](ClientConnection::ptr ptr) {
-				con->make_response(ptr->status(), ptr->headers(), ptr->body());
+	// Request counts, bytes and latencies for Prometheus to scrape
+	s.add_metrics_route();
+	// A line per response in access.log, written by a thread of its own
+	s.access_log(AccessLog::Options());
+	// Answered from the cache for 5 seconds at a time, separately per Accept-Language
+	auto cache = std::make_shared<ResponseCache>();
+	s.add_route("/cached/{name}", Methods::GET | Methods::HEAD, [](Captures const& path, Methods method, Connection::ptr con) {
+		auto now = std::chrono::system_clock::now().time_since_epoch();
+		con->make_response(200, "", "Hi " + std::string(path[1]) + ", made at " + std::to_string(std::chrono::duration_cast<std::chrono::seconds>(now).count()) + '\n');
+	}, CachePolicy{ cache, std::chrono::seconds(5), { "Accept-Language" } });
+	StaticFiles::Options static_options;
+	static_options.precompressed = true;
+	s.add_route("/static/{path:*}", Methods::GET | Methods::HEAD, StaticFiles(".", static_options));
+	// Compressed for clients that take it, once longer than 1 KB
+	auto gzip = std::make_shared<Compression>();
+	s.add_route("/report/{lines:int}", Methods::GET, [](Captures const& path, Methods method, Connection::ptr con) {
+		std::string body;
+		for (std::int64_t i = 0; i < path.integer(1); ++i) {
+			body += "Line " + std::to_string(i) + " of the report\n";
+		}
+		con->make_response(200, "Content-Type: text/plain\r\n", std::move(body));
+	}, gzip);
+	// Keeps a thread busy for a while, so it runs on a pool of its own rather than holding up
+	// the other connections of an I/O thread
+	auto cpu = std::make_shared<OffloadPool>(2);
+	s.add_route("/primes/{below:int}", Methods::GET, [](Captures const& path, Methods method, Connection::ptr con) {
+		auto below = std::min<std::int64_t>(path.integer(1), 10000000);
+		std::int64_t count = 0;
+		for (std::int64_t i = 2; i < below; ++i) {
+			bool prime = true;
+			for (std::int64_t d = 2; d * d <= i && prime; ++d) {
+				prime = i % d != 0;
+			}
+			count += prime;
+		}
+		con->make_response(200, "", std::to_string(count) + " primes below " + std::to_string(below) + '\n');
+	}, cpu);
+	s.add_route("/upload", Methods::POST, [](Captures const& path, Methods method, Connection::ptr con) {
+		// The body is counted as it arrives instead of being held in memory
+		struct Counter {
+			Connection::ptr con;
+			std::uint64_t total = 0;
+
+			void operator()(asio::error_code ec, std::string_view piece) {
+				if (ec)
+					return;
+				if (piece.empty()) {
+					con->make_response(200, "", "Received " + std::to_string(total) + " bytes\n");
+					return;
+				}
+				total += piece.size();
+				con->read_body(std::move(*this));
+			}
+		};
+		con->read_body(Counter{ con });
+	}, RouteOptions::StreamBody);
+	s.add_route("/events", Methods::GET, [](Captures const& path, Methods method, Connection::ptr con) {
+		// Server-sent events, one a second. Each is only sent once the one before it has drained.
+		auto timer = std::make_shared<asio::steady_timer>(con->get_executor());
+		Response resp(200);
+		resp.header("Content-Type", "text/event-stream").header("Cache-Control", "no-cache");
+		con->start_stream(std::move(resp), [con = con.get(), timer, n = 0](asio::error_code ec) mutable {
+			if (ec)
+				return;
+			if (n == 5) {
+				con->end_stream();
+				return;
+			}
+			timer->expires_after(std::chrono::seconds(1));
+			timer->async_wait([con = con->shared_from_this(), id = ++n](asio::error_code ec) {
+				if (!ec) {
+					con->send_chunk("data: " + std::to_string(id) + "\n\n");
+				}
+			});
+		});
+	});
+	// Asks the upstream twice, seven seconds apart, and passes the second response on as it
+	// arrives, so it takes no more memory however large it is. Only so many at once, so a
+	// burst of them does not use up the upstream connections, and not too many a second.
+	// Requests for a path that is being fetched already wait for that fetch and are sent the
+	// same response.
+	ConcurrencyLimit fwd_limit{ 64 };
+	RateLimit fwd_rate{ 50, 10 };
+	SingleFlight flights;
+	s.add_route("/fwd/([^/:]+)(:([0-9]+))?(/.*)", Methods::GET, [&upstreams, &flights](Captures const& path, Methods method, Connection::ptr con) {
+		std::string host(path[1]);
+		std::string port(!path[3].empty() ? path[3] : "http");
+		std::string fwd_path(path[4]);
+#if defined(ASIO_HAS_CO_AWAIT)
+		auto fetch = [&upstreams, ex{ con->get_executor() }, host, port, fwd_path](SingleFlight::StreamHandler done) {
+			asio::co_spawn(ex, [&upstreams, ex, host, port, fwd_path, done]() -> asio::awaitable<void> {
+				asio::error_code ec;
+				ClientConnection::ptr upstream;
+				try {
+					upstream = co_await upstreams.async_get(ex, host, port, asio::use_awaitable);
+					co_await upstream->async_send_request(fwd_path, "", asio::use_awaitable);
+					asio::steady_timer tmr(ex, std::chrono::seconds(7));
+					co_await tmr.async_wait(asio::use_awaitable);
+					co_await upstream->async_stream_request(Methods::GET, fwd_path, "", "", asio::use_awaitable);
+				}
+				catch (asio::system_error const& e) {
+					ec = e.code();
+				}
+				done(ec, upstream);
+			}, asio::detached);
+		};
+#else
+		auto fetch = [&upstreams, ex{ con->get_executor() }, host, port, fwd_path](SingleFlight::StreamHandler done) {
+			upstreams.get(ex, host, port, [ex, fwd_path, done](asio::error_code ec, ClientConnection::ptr upstream) {
+				if (ec) {
+					done(ec, nullptr);
+					return;
+				}
+				upstream->async_send_request(fwd_path, "", [ex, fwd_path, done, upstream](asio::error_code ec, ClientConnection::ptr) {
+					if (ec) {
+						done(ec, nullptr);
+						return;
+					}
+					auto tmr = std::make_shared<asio::steady_timer>(ex, std::chrono::seconds(7));
+					tmr->async_wait([fwd_path, done, upstream, tmr](asio::error_code) {
+						// The relay holds on to the pointer get() handed out until the body is through
+						upstream->async_stream_request(Methods::GET, fwd_path, "", "", [done, upstream](asio::error_code ec, ClientConnection::ptr) {
+							done(ec, upstream);
+						});
+					});
+				});
 			});
+		};
+#endif // defined(ASIO_HAS_CO_AWAIT)
+		flights.relay(host + ':' + port + fwd_path, std::move(con), std::move(fetch));
+	}, fwd_limit, fwd_rate);
+
+	// Spread over three servers, leaving out those that fail their health checks or their
+	// requests. A GET still unanswered after 50 ms goes to a second server as well.
+	UpstreamGroup::Options api_options;
+	api_options.health_path = "/health";
+	api_options.hedge_after = std::chrono::milliseconds(50);
+	UpstreamGroup api({ { "127.0.0.1", "9001" }, { "127.0.0.1", "9002" }, { "127.0.0.1", "9003" } }, upstreams, api_options);
+	api.start_health_checks(asio::make_strand(s.context()));
+	s.on_stop([&api, &upstreams]() {
+		api.stop_health_checks();
+		upstreams.close();
+	});
+	s.add_route("/api/{path:*}", Methods::GET | Methods::POST, [&api](Captures const& path, Methods method, Connection::ptr con) {
+		auto& body = con->body();
+		api.send(con->get_executor(), method, "/" + std::string(path[1]), "", std::string(body.begin(), body.end()), [con](asio::error_code ec, ClientConnection::ptr upstream) {
+			if (ec) {
+				con->make_response(502, "", ec.message() + '\n');
+				return;
+			}
+			con->make_response(upstream->status(), upstream->headers(), upstream->body());
 		});
 	});
 
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <string>
+#include <string_view>
 
 #include "bitmask.hpp"
 
@@ -16,7 +17,7 @@ namespace bb {
 
 	ENABLE_BITMASK_OPERATORS(Methods);
 
-	static Methods method_from_name(std::string const& name) {
+	static Methods method_from_name(std::string_view name) {
 		if (name == "GET") return Methods::GET;
 		if (name == "POST") return Methods::POST;
 		if (name == "HEAD") return Methods::HEAD;
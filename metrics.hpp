@@ -0,0 +1,305 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif // defined(_MSC_VER)
+
+namespace bb {
+	// A count written by one thread only, which any thread may read. Without a second writer
+	// it needs no atomic read-modify-write, just a plain load and store.
+	class Counter
+	{
+	public:
+		void add(std::uint64_t n = 1) { v.store(v.load(std::memory_order_relaxed) + n, std::memory_order_relaxed); }
+		std::uint64_t get() const { return v.load(std::memory_order_relaxed); }
+
+	private:
+		std::atomic<std::uint64_t> v{ 0 };
+	}; // class Counter
+
+	// Durations in microseconds, in buckets an eighth of a power of two wide, as in
+	// HdrHistogram. Any value is known to within 12.5%, from a microsecond to days.
+	// A bucket takes the values above its lower bound up to and including its upper one, so
+	// every power of two is the top of a bucket, as Prometheus' le= bounds have it.
+	class Histogram
+	{
+	public:
+		static constexpr unsigned sub_bits = 3;
+		static constexpr std::size_t sub_count = 1 << sub_bits;
+		static constexpr unsigned max_bits = 40; // about 12 days
+		// Bucket 0 is for 0 alone
+		static constexpr std::size_t bucket_count = (max_bits - sub_bits + 1) * sub_count + 1;
+
+		static std::size_t bucket_of(std::uint64_t us) {
+			if (us <= sub_count)
+				return static_cast<std::size_t>(us);
+			auto v = us - 1;
+			auto e = log2(v);
+			auto i = (e - sub_bits + 1) * sub_count + ((v >> (e - sub_bits)) & (sub_count - 1)) + 1;
+			return i < bucket_count ? i : bucket_count - 1;
+		}
+
+		// Largest value that falls in bucket i
+		static std::uint64_t upper_bound(std::size_t i) {
+			if (i <= sub_count)
+				return i;
+			--i;
+			auto e = static_cast<unsigned>(i / sub_count) + sub_bits - 1;
+			auto lower = (sub_count + i % sub_count) << (e - sub_bits);
+			return lower + (std::uint64_t(1) << (e - sub_bits));
+		}
+
+		void record(std::chrono::steady_clock::duration d) {
+			auto us = std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+			if (us < 0)
+				us = 0;
+			buckets[bucket_of(static_cast<std::uint64_t>(us))].add();
+			sum.add(static_cast<std::uint64_t>(us));
+		}
+
+		// Totals over many histograms, e.g. one per thread
+		struct Snapshot {
+			std::array<std::uint64_t, bucket_count> buckets{};
+			std::uint64_t sum = 0;
+			std::uint64_t count = 0;
+
+			void add(Histogram const& h) {
+				for (std::size_t i = 0; i < bucket_count; ++i) {
+					auto n = h.buckets[i].get();
+					buckets[i] += n;
+					count += n;
+				}
+				sum += h.sum.get();
+			}
+
+			// In microseconds, the upper bound of the bucket the quantile falls in. q is from 0 to 1.
+			std::uint64_t quantile(double q) const {
+				auto rank = std::min(static_cast<std::uint64_t>(q * count), count ? count - 1 : 0);
+				std::uint64_t seen = 0;
+				for (std::size_t i = 0; i < bucket_count; ++i) {
+					seen += buckets[i];
+					if (seen > rank)
+						return upper_bound(i);
+				}
+				return count ? upper_bound(bucket_count - 1) : 0;
+			}
+		};
+
+	private:
+		static unsigned log2(std::uint64_t v) {
+#if defined(_MSC_VER)
+			unsigned long i;
+			_BitScanReverse64(&i, v);
+			return i;
+#else
+			return 63 - __builtin_clzll(v);
+#endif // defined(_MSC_VER)
+		}
+
+		std::array<Counter, bucket_count> buckets;
+		Counter sum;
+	}; // class Histogram
+
+	// What a Server counts. Every thread records into a block of its own, which the others
+	// never write, so recording is a few plain adds. Reading sums up all the blocks.
+	class Metrics
+	{
+	public:
+		typedef std::chrono::steady_clock clock;
+
+		enum class Latency {
+			Parse,   // from the first byte of a request head until it has been parsed
+			Handler, // from handing the request to its route until the response is given
+			Write,   // from starting to write responses until the socket has taken them
+			Offload, // from handing a request to an OffloadPool until a thread of it takes it
+			Count
+		};
+
+		// Routes with an id past this are counted together as "(other)"
+		static constexpr std::size_t max_routes = 256;
+		// For requests that matched no route
+		static constexpr std::size_t no_route = std::size_t(-1);
+
+		Metrics() : serial(next_serial()) { }
+		Metrics(Metrics const&) = delete;
+		Metrics& operator=(Metrics const&) = delete;
+
+		void request(std::size_t route, int status) {
+			auto& b = local();
+			b.routes[route < max_routes ? route : route == no_route ? none_slot : other_slot].add();
+			b.statuses[status >= 100 && status < 600 ? status - 100 : 0].add();
+		}
+
+		void received(std::size_t n) { local().received.add(n); }
+		void sent(std::size_t n) { local().sent.add(n); }
+		void latency(Latency l, clock::duration d) { local().latencies[static_cast<std::size_t>(l)].record(d); }
+
+		Histogram::Snapshot latencies(Latency l) const {
+			Histogram::Snapshot s;
+			std::lock_guard<std::mutex> lock(mutex);
+			for (auto& b : blocks) {
+				s.add(b->latencies[static_cast<std::size_t>(l)]);
+			}
+			return s;
+		}
+
+		// Prometheus text format. routes names the route of each id, as Router::routes() does.
+		std::string render(std::vector<std::string> const& routes) const {
+			std::array<std::uint64_t, route_slots> route_counts{};
+			std::array<std::uint64_t, 500> status_counts{};
+			std::uint64_t in = 0, out = 0;
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				for (auto& b : blocks) {
+					for (std::size_t i = 0; i < route_slots; ++i)
+						route_counts[i] += b->routes[i].get();
+					for (std::size_t i = 0; i < status_counts.size(); ++i)
+						status_counts[i] += b->statuses[i].get();
+					in += b->received.get();
+					out += b->sent.get();
+				}
+			}
+
+			std::string s;
+			s += "# HELP http_requests_total Requests by route.\n# TYPE http_requests_total counter\n";
+			// Several ids share a pattern when it was added once per set of methods
+			auto count = std::min(routes.size(), max_routes);
+			std::vector<bool> done(count);
+			for (std::size_t i = 0; i < count; ++i) {
+				if (done[i])
+					continue;
+				std::uint64_t n = 0;
+				for (std::size_t j = i; j < count; ++j) {
+					if (routes[j] == routes[i]) {
+						n += route_counts[j];
+						done[j] = true;
+					}
+				}
+				render_route(s, routes[i], n);
+			}
+			if (route_counts[other_slot])
+				render_route(s, "(other)", route_counts[other_slot]);
+			if (route_counts[none_slot])
+				render_route(s, "(none)", route_counts[none_slot]);
+			s += "# HELP http_responses_total Responses by status code.\n# TYPE http_responses_total counter\n";
+			for (std::size_t i = 0; i < status_counts.size(); ++i) {
+				if (status_counts[i])
+					s += "http_responses_total{code=\"" + std::to_string(i + 100) + "\"} " + std::to_string(status_counts[i]) + '\n';
+			}
+			s += "# HELP http_received_bytes_total Bytes read from clients.\n# TYPE http_received_bytes_total counter\n";
+			s += "http_received_bytes_total " + std::to_string(in) + '\n';
+			s += "# HELP http_sent_bytes_total Bytes written to clients.\n# TYPE http_sent_bytes_total counter\n";
+			s += "http_sent_bytes_total " + std::to_string(out) + '\n';
+			s += "# HELP http_open_connections Connections open now.\n# TYPE http_open_connections gauge\n";
+			s += "http_open_connections " + std::to_string(connections.load(std::memory_order_relaxed)) + '\n';
+			render_histogram(s, "http_parse_duration_seconds", "Time from the first byte of a request head until it was parsed.", latencies(Latency::Parse));
+			render_histogram(s, "http_handler_duration_seconds", "Time routes took to give a response.", latencies(Latency::Handler));
+			render_histogram(s, "http_write_duration_seconds", "Time taken to write responses.", latencies(Latency::Write));
+			s += "# HELP http_offload_queued Requests waiting for a thread of an offload pool.\n# TYPE http_offload_queued gauge\n";
+			s += "http_offload_queued " + std::to_string(offload_queued.load(std::memory_order_relaxed)) + '\n';
+			render_histogram(s, "http_offload_wait_seconds", "Time requests waited for a thread of an offload pool.", latencies(Latency::Offload));
+			return s;
+		}
+
+		// Open connections, kept by the Server, which also uses it to enforce Limits::max_connections
+		std::atomic<std::size_t> connections{ 0 };
+		// Requests handed to an OffloadPool that no thread of it has taken yet
+		std::atomic<std::size_t> offload_queued{ 0 };
+
+	private:
+		static constexpr std::size_t other_slot = max_routes;
+		static constexpr std::size_t none_slot = max_routes + 1;
+		static constexpr std::size_t route_slots = max_routes + 2;
+
+		struct alignas(64) Block {
+			std::thread::id thread;
+			std::array<Counter, route_slots> routes;
+			std::array<Counter, 500> statuses; // 100 to 599
+			Counter received;
+			Counter sent;
+			std::array<Histogram, static_cast<std::size_t>(Latency::Count)> latencies;
+		};
+
+		// The calling thread's block, found through a thread-local cache. The cache holds the
+		// serial of its Metrics rather than the address, which a later Metrics could reuse.
+		// A thread recording into several alternately finds its block again under the lock.
+		Block& local() {
+			struct Cache {
+				std::uint64_t serial = 0;
+				Block* block = nullptr;
+			};
+			static thread_local Cache cache;
+			if (cache.serial != serial) {
+				auto id = std::this_thread::get_id();
+				std::lock_guard<std::mutex> lock(mutex);
+				auto it = std::find_if(blocks.begin(), blocks.end(), [id](auto& b) { return b->thread == id; });
+				if (it == blocks.end()) {
+					blocks.push_back(std::make_unique<Block>());
+					blocks.back()->thread = id;
+					it = blocks.end() - 1;
+				}
+				cache.block = it->get();
+				cache.serial = serial;
+			}
+			return *cache.block;
+		}
+
+		static std::uint64_t next_serial() {
+			static std::atomic<std::uint64_t> n{ 0 };
+			return ++n;
+		}
+
+		static void render_route(std::string& s, std::string_view route, std::uint64_t n) {
+			s += "http_requests_total{route=\"";
+			// Label values escape backslashes, quotes and line breaks
+			for (auto c : route) {
+				if (c == '\n') {
+					s += "\\n";
+					continue;
+				}
+				if (c == '\\' || c == '"')
+					s += '\\';
+				s += c;
+			}
+			s += "\"} " + std::to_string(n) + '\n';
+		}
+
+		// Powers of two of microseconds for the buckets, from 1 us to about 67 s
+		static void render_histogram(std::string& s, std::string_view name, std::string_view help, Histogram::Snapshot const& h) {
+			s.append("# HELP ").append(name).append(" ").append(help).append("\n# TYPE ").append(name).append(" histogram\n");
+			std::size_t i = 0;
+			std::uint64_t below = 0;
+			char le[32];
+			for (unsigned k = 0; k <= 26; ++k) {
+				std::uint64_t bound = std::uint64_t(1) << k;
+				while (i < Histogram::bucket_count && Histogram::upper_bound(i) <= bound) {
+					below += h.buckets[i++];
+				}
+				std::snprintf(le, sizeof(le), "%g", bound / 1e6);
+				s.append(name).append("_bucket{le=\"").append(le).append("\"} ").append(std::to_string(below)).append("\n");
+			}
+			s.append(name).append("_bucket{le=\"+Inf\"} ").append(std::to_string(h.count)).append("\n");
+			std::snprintf(le, sizeof(le), "%.6f", h.sum / 1e6);
+			s.append(name).append("_sum ").append(le).append("\n");
+			s.append(name).append("_count ").append(std::to_string(h.count)).append("\n");
+		}
+
+		std::uint64_t serial;
+		mutable std::mutex mutex;
+		std::vector<std::unique_ptr<Block>> blocks;
+	}; // class Metrics
+} // namespace bb
@@ -0,0 +1,68 @@
+// Checks the latency histograms: every value falls in a bucket whose bounds hold it, and the
+// Prometheus buckets count the samples less than or equal to their le= bound, those exactly
+// at it included.
+//   g++ -std=c++17 -O2 metrics_test.cpp -o metrics_test -lpthread
+//   metrics_test
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+#define ASIO_STANDALONE 1
+#define ASIO_NO_DEPRECATED 1
+
+#include "metrics.hpp"
+#include "test_support.hpp"
+
+using namespace bb;
+using namespace std::chrono_literals;
+
+// The count on the line of name's bucket with bound le, or -1 if there is none
+static long long bucket(std::string const& text, std::string const& name, std::string const& le) {
+	auto line = name + "_bucket{le=\"" + le + "\"} ";
+	auto at = text.find(line);
+	return at == std::string::npos ? -1 : std::stoll(text.substr(at + line.size()));
+}
+
+static void buckets() {
+	bool held = true, tight = true;
+	for (std::uint64_t v = 0; v < (1 << 20); ++v) {
+		auto i = Histogram::bucket_of(v);
+		held = held && v <= Histogram::upper_bound(i) && (i == 0 || v > Histogram::upper_bound(i - 1));
+	}
+	for (std::size_t i = Histogram::sub_count + 1; i < Histogram::bucket_count; ++i) {
+		tight = tight && (Histogram::upper_bound(i) - Histogram::upper_bound(i - 1)) * 8 <= Histogram::upper_bound(i - 1);
+	}
+	check(held, "a value falls in the bucket whose bounds hold it");
+	check(tight, "buckets are no more than an eighth of their lower bound wide");
+	bool powers = true;
+	for (unsigned k = 0; k < Histogram::max_bits; ++k) {
+		powers = powers && Histogram::upper_bound(Histogram::bucket_of(std::uint64_t(1) << k)) == std::uint64_t(1) << k;
+	}
+	check(powers, "every power of two is the top of a bucket");
+}
+
+static void rendered() {
+	Metrics m;
+	m.latency(Metrics::Latency::Handler, 1us);
+	m.latency(Metrics::Latency::Handler, 1024us);
+	m.latency(Metrics::Latency::Handler, 1025us);
+	m.latency(Metrics::Latency::Handler, 3s);
+	auto text = m.render({});
+	auto name = "http_handler_duration_seconds";
+	check(bucket(text, name, "1e-06") == 1, "a sample at the lowest bound is counted in it");
+	check(bucket(text, name, "0.000512") == 1, "a bucket holds nothing above its bound");
+	check(bucket(text, name, "0.001024") == 2, "a sample exactly at a bound is counted in that bucket");
+	check(bucket(text, name, "0.002048") == 3, "one just above it in the next");
+	check(bucket(text, name, "2.09715") == 3 && bucket(text, name, "4.1943") == 4, "buckets count up to seconds");
+	check(bucket(text, name, "+Inf") == 4 && text.find(std::string(name) + "_count 4\n") != std::string::npos, "every sample is in +Inf and the count");
+
+	auto h = m.latencies(Metrics::Latency::Handler);
+	check(h.quantile(0.25) == 1024 && h.quantile(0) == 1, "a quantile at a power of two is exact");
+}
+
+int main() {
+	buckets();
+	rendered();
+	return finish();
+}
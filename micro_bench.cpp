@@ -0,0 +1,120 @@
+// Time per call of the steps every request goes through: parsing the head, decoding the
+// URI, finding the route and building the response. Run it before and after a change
+// to the hot path. Build with optimizations, e.g.
+//   g++ -std=c++17 -O2 micro_bench.cpp -o micro_bench -lpthread
+//   micro_bench [rounds]
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#define ASIO_STANDALONE 1
+#define ASIO_NO_DEPRECATED 1
+
+#include "server_connection.hpp"
+
+using namespace bb;
+
+// Calls f rounds times and prints the time per call
+template<typename F>
+static void measure(char const* name, unsigned int rounds, F f) {
+	// Once to warm up caches and pools
+	f();
+	auto start = std::chrono::steady_clock::now();
+	for (unsigned int i = 0; i < rounds; ++i) {
+		f();
+	}
+	std::chrono::duration<double, std::nano> took = std::chrono::steady_clock::now() - start;
+	std::cout << name << ": " << took.count() / rounds << " ns\n";
+}
+
+int main(int argc, char* argv[])
+{
+	unsigned int rounds = argc > 1 ? std::stoul(argv[1]) : 1000000;
+	volatile std::size_t sink = 0;
+
+	// What a browser sends, give or take
+	const std::string request =
+		"GET /api/v1/users/12345/posts?sort=new&tag=caf%C3%A9 HTTP/1.1\r\n"
+		"Host: www.example.com\r\n"
+		"User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:120.0) Gecko/20100101 Firefox/120.0\r\n"
+		"Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+		"Accept-Language: en-US,en;q=0.5\r\n"
+		"Accept-Encoding: gzip, deflate, br\r\n"
+		"Connection: keep-alive\r\n"
+		"Cookie: session=0123456789abcdef0123456789abcdef; theme=dark\r\n"
+		"Upgrade-Insecure-Requests: 1\r\n"
+		"\r\n";
+
+	HttpParser parser(HttpParser::Kind::Request);
+	Headers headers;
+	measure("parse head", rounds, [&]() {
+		parser.reset();
+		headers.clear();
+		parser.parse(request.data(), request.size());
+		for (auto& h : parser.headers()) {
+			headers.add(h.name, h.value);
+		}
+		sink = sink + headers.size();
+	});
+
+	// Split into pieces the way a slow client's head arrives
+	measure("parse head in 64 byte reads", rounds / 4, [&]() {
+		parser.reset();
+		for (std::size_t n = 64; ; n += 64) {
+			if (parser.parse(request.data(), std::min(n, request.size())) != HttpParser::Result::Incomplete)
+				break;
+		}
+		sink = sink + parser.headers().size();
+	});
+
+	Arena arena;
+	const std::string plain = "/api/v1/users/12345/posts";
+	const std::string escaped = "/files/My%20Documents/r%C3%A9sum%C3%A9%20final%20%282%29.pdf";
+	measure("url_decode plain", rounds, [&]() {
+		arena.reset();
+		sink = sink + Connection::url_decode(plain, arena).size();
+	});
+	measure("url_decode escaped", rounds, [&]() {
+		arena.reset();
+		sink = sink + Connection::url_decode(escaped, arena).size();
+	});
+
+	// As many routes as a mid-sized API has
+	Router router;
+	for (unsigned int i = 0; i < 50; ++i) {
+		auto name = "/api/v1/resource" + std::to_string(i);
+		router.add_route(name, Methods::GET, [&sink](Captures const& c, Methods, Connection::ptr) { sink = sink + c.size(); });
+		router.add_route(name + "/{id:int}", Methods::GET | Methods::POST, [&sink](Captures const& c, Methods, Connection::ptr) { sink = sink + c.size(); });
+		router.add_route(name + "/{id:int}/{field}", Methods::GET, [&sink](Captures const& c, Methods, Connection::ptr) { sink = sink + c.size(); });
+	}
+	router.add_route("/static/{path:*}", Methods::GET, [&sink](Captures const& c, Methods, Connection::ptr) { sink = sink + c.size(); });
+	measure("handle_route static", rounds, [&]() { sink = sink + router.handle_route("/api/v1/resource37", "GET", nullptr); });
+	measure("handle_route params", rounds, [&]() { sink = sink + router.handle_route("/api/v1/resource37/991/name", "GET", nullptr); });
+	measure("handle_route wildcard", rounds, [&]() { sink = sink + router.handle_route("/static/css/site/main.css", "GET", nullptr); });
+	measure("handle_route miss", rounds, [&]() { sink = sink + router.handle_route("/api/v2/none", "GET", nullptr); });
+
+	const std::string small_body = "{\"id\":12345,\"name\":\"someone\"}";
+	const std::string large_body(64 * 1024, 'x');
+	// Status line, headers and body, and the buffers going back to the pool afterwards.
+	// Connection only adds Content-Length to that.
+	measure("build small response", rounds, [&]() {
+		Response resp(200);
+		resp.header("Content-Type", "application/json").header("Cache-Control", "no-cache").body(std::string_view(small_body));
+		sink = sink + resp.body_size();
+	});
+	measure("build 64 KB response", rounds / 10, [&]() {
+		Response resp(200);
+		resp.header("Content-Type", "application/octet-stream").body(std::string_view(large_body));
+		sink = sink + resp.body_size();
+	});
+	measure("build response by reference", rounds, [&]() {
+		Response resp(200);
+		resp.header("Content-Type", "application/octet-stream").body_ref(asio::buffer(large_body));
+		sink = sink + resp.body_size();
+	});
+
+	return 0;
+}
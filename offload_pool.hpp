@@ -0,0 +1,122 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace bb {
+	// Threads for handlers that would hold up the I/O thread they run on, and with it every
+	// other connection of that thread, e.g. ones that block or compute for long. Given to a
+	// route, its handler runs on the pool, e.g.
+	//   auto cpu = std::make_shared<OffloadPool>(4);
+	//   server.add_route("/report", Methods::GET, report, cpu);
+	// Responses go back through Connection::send_response() as usual, which is safe from any
+	// thread. The other Connection functions have to be posted to Connection::get_executor().
+	// Each thread has a queue of its own, and tasks are handed to them in turn. A thread that
+	// runs out takes the oldest task of another before going to sleep, so one long task only
+	// holds up its own queue for as long as the others are busy too.
+	class OffloadPool
+	{
+	public:
+		typedef std::function<void()> Task;
+
+		explicit OffloadPool(unsigned int threads = std::thread::hardware_concurrency()) {
+			threads = std::max(threads, 1u);
+			for (unsigned int i = 0; i < threads; ++i) {
+				workers.push_back(std::make_unique<Worker>());
+			}
+			for (unsigned int i = 0; i < threads; ++i) {
+				workers[i]->thread = std::thread([this, i]() { run(i); });
+			}
+		}
+
+		OffloadPool(OffloadPool const&) = delete;
+		OffloadPool& operator=(OffloadPool const&) = delete;
+
+		// Runs the tasks still queued first
+		~OffloadPool() {
+			{
+				std::lock_guard<std::mutex> lock(sleep_mutex);
+				stopping = true;
+			}
+			wake.notify_all();
+			for (auto& w : workers) {
+				w->thread.join();
+			}
+		}
+
+		void submit(Task task) {
+			// Counted before it is queued, so taking it never finds the count at zero. Pairs
+			// with run() counting itself idle before looking at pending: either that sees the
+			// task or this sees it idle and wakes it.
+			pending.fetch_add(1);
+			auto& w = *workers[next.fetch_add(1, std::memory_order_relaxed) % workers.size()];
+			{
+				std::lock_guard<std::mutex> lock(w.mutex);
+				w.tasks.push_back(std::move(task));
+			}
+			if (idle.load() > 0) {
+				std::lock_guard<std::mutex> lock(sleep_mutex);
+				wake.notify_one();
+			}
+		}
+
+		// Tasks waiting for a thread
+		std::size_t queued() const { return pending.load(std::memory_order_relaxed); }
+
+		unsigned int size() const { return static_cast<unsigned int>(workers.size()); }
+
+	private:
+		struct alignas(64) Worker {
+			std::mutex mutex;
+			std::deque<Task> tasks;
+			std::thread thread;
+		};
+
+		void run(std::size_t self) {
+			Task task;
+			for (;;) {
+				if (take(self, task)) {
+					task();
+					task = nullptr;
+					continue;
+				}
+				std::unique_lock<std::mutex> lock(sleep_mutex);
+				idle.fetch_add(1);
+				wake.wait(lock, [this]() { return pending.load() > 0 || stopping; });
+				idle.fetch_sub(1);
+				if (stopping && pending.load() == 0)
+					return;
+			}
+		}
+
+		// The oldest task of the thread's own queue, or else of the next one that has any
+		bool take(std::size_t self, Task& task) {
+			for (std::size_t i = 0; i < workers.size(); ++i) {
+				auto& w = *workers[(self + i) % workers.size()];
+				std::lock_guard<std::mutex> lock(w.mutex);
+				if (!w.tasks.empty()) {
+					task = std::move(w.tasks.front());
+					w.tasks.pop_front();
+					pending.fetch_sub(1, std::memory_order_relaxed);
+					return true;
+				}
+			}
+			return false;
+		}
+
+		std::vector<std::unique_ptr<Worker>> workers;
+		std::atomic<std::size_t> next{ 0 };
+		std::atomic<std::size_t> pending{ 0 };
+		std::atomic<unsigned int> idle{ 0 };
+		std::mutex sleep_mutex;
+		std::condition_variable wake;
+		bool stopping = false;
+	}; // class OffloadPool
+} // namespace bb
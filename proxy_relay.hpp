@@ -0,0 +1,136 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "asio.hpp"
+
+#include "client_connection.hpp"
+#include "headers.hpp"
+#include "response.hpp"
+#include "server_connection.hpp"
+
+namespace bb {
+	// Passes on the response whose head upstream has received from
+	// ClientConnection::async_stream_request() to one or more connections, e.g.
+	//   upstream->async_stream_request(Methods::GET, path, "", "", asio::bind_executor(con->get_executor(),
+	//     [con](asio::error_code ec, ClientConnection::ptr upstream) { if (!ec) ResponseRelay::start(upstream, { con }); }));
+	// The body goes out a piece at a time as it arrives, straight from the buffer upstream
+	// reads it into, which is reused for every piece. Every connection is given a piece before
+	// the next is read, so the slowest of them sets the pace and a slow upstream leaves them all
+	// waiting. The response takes the same memory however large it is and however many it goes to.
+	// A connection that fails drops out and the rest carry on. A body that upstream fails to
+	// finish leaves them all closed, rather than the clients taking what they got for all of
+	// it. The connection to upstream is reused once the body has been read to its end.
+	class ResponseRelay : public std::enable_shared_from_this<ResponseRelay>
+	{
+	public:
+		static void start(ClientConnection::ptr upstream, std::vector<Connection::ptr> cons) {
+			auto r = std::make_shared<ResponseRelay>(std::move(upstream));
+			r->cons = std::move(cons);
+			r->pending = r->cons.size();
+			for (auto& con : r->cons) {
+				asio::dispatch(con->get_executor(), [r, con]() { r->start_stream(*con); });
+			}
+		}
+
+		explicit ResponseRelay(ClientConnection::ptr up) : upstream(std::move(up)), status(upstream->status()) {
+			for (auto& h : upstream->headers()) {
+				if (!hop_by_hop(h.name)) {
+					headers.append(h.name).append(": ").append(h.value).append("\r\n");
+				}
+			}
+			// Chunked upstream is chunked again, anything else has its length
+			if (!upstream->headers().has(KnownHeader::TransferEncoding)) {
+				length = upstream->headers().content_length();
+			}
+		}
+
+	private:
+		// On con's executor. ready is kept by con itself, which it must not keep alive, the
+		// relay does that until con is done.
+		void start_stream(Connection& con) {
+			Response resp(static_cast<int>(status));
+			resp.headers(headers);
+			auto c = &con;
+			con.start_stream(std::move(resp), [r{ shared_from_this() }, c](asio::error_code ec) {
+				r->post_ready(c, ec);
+			}, length);
+		}
+
+		// Posted rather than dispatched, so cons is not changed while it is being gone through
+		void post_ready(Connection* c, asio::error_code ec) {
+			asio::post(upstream->get_executor(), [r{ shared_from_this() }, c, ec]() { r->ready(c, ec); });
+		}
+
+		// The rest is on upstream's executor. c has written what it was given, or failed to.
+		void ready(Connection* c, asio::error_code ec) {
+			if (ended)
+				return; // the end failed to go out
+			if (ec) {
+				drop(c);
+			}
+			if (--pending == 0) {
+				next();
+			}
+		}
+
+		void drop(Connection* c) {
+			for (auto it = cons.begin(); it != cons.end(); ++it) {
+				if (it->get() == c) {
+					cons.erase(it);
+					return;
+				}
+			}
+		}
+
+		void next() {
+			if (cons.empty())
+				return; // every client is gone, and upstream is dropped along with the relay
+			upstream->read_body([r{ shared_from_this() }](asio::error_code ec, std::string_view piece) {
+				r->piece(ec, piece);
+			});
+		}
+
+		void piece(asio::error_code ec, std::string_view piece) {
+			if (ec || piece.empty()) {
+				ended = true;
+				for (auto& con : cons) {
+					asio::dispatch(con->get_executor(), [con, ec]() {
+						if (ec) {
+							con->abort_stream();
+						}
+						else {
+							con->end_stream();
+						}
+					});
+				}
+				cons.clear();
+				return;
+			}
+			pending = cons.size();
+			for (auto& con : cons) {
+				asio::dispatch(con->get_executor(), [r{ shared_from_this() }, con, piece]() {
+					if (!con->send_chunk_ref(asio::buffer(piece.data(), piece.size()))) {
+						// more than the length it announced, which the client cannot be given
+						con->abort_stream();
+						r->post_ready(con.get(), asio::error::message_size);
+					}
+				});
+			}
+		}
+
+		ClientConnection::ptr upstream;
+		unsigned int status;
+		std::string headers;               // lines to pass on, each ending with "\r\n"
+		std::optional<std::uint64_t> length;
+		std::vector<Connection::ptr> cons; // those still taking the body
+		std::size_t pending = 0;           // of them, those still writing what they were given
+		bool ended = false;
+	}; // class ResponseRelay
+} // namespace bb
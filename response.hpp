@@ -0,0 +1,313 @@
+#pragma once
+
+#include <charconv>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <variant>
+#include <vector>
+
+#include "asio.hpp"
+
+#include "allocation.hpp"
+#include "headers.hpp"
+
+namespace bb {
+	inline const char* reason_phrase(int status) {
+		switch (status)
+		{
+		case 100: return "Continue";
+		case 101: return "Switching Protocols";
+		case 200: return "OK";
+		case 201: return "Created";
+		case 202: return "Accepted";
+		case 204: return "No Content";
+		case 206: return "Partial Content";
+		case 301: return "Moved Permanently";
+		case 302: return "Found";
+		case 303: return "See Other";
+		case 304: return "Not Modified";
+		case 307: return "Temporary Redirect";
+		case 308: return "Permanent Redirect";
+		case 400: return "Bad Request";
+		case 401: return "Unauthorized";
+		case 403: return "Forbidden";
+		case 404: return "Not Found";
+		case 405: return "Method Not Allowed";
+		case 408: return "Request Timeout";
+		case 411: return "Length Required";
+		case 412: return "Precondition Failed";
+		case 413: return "Payload Too Large";
+		case 414: return "URI Too Long";
+		case 416: return "Range Not Satisfiable";
+		case 429: return "Too Many Requests";
+		case 431: return "Request Header Fields Too Large";
+		case 500: return "Internal Server Error";
+		case 501: return "Not Implemented";
+		case 502: return "Bad Gateway";
+		case 503: return "Service Unavailable";
+		case 504: return "Gateway Timeout";
+		default:
+			if (status < 200) return "Informational";
+			if (status < 300) return "Success";
+			if (status < 400) return "Redirection";
+			if (status < 500) return "Client Error";
+			return "Server Error";
+		}
+	}
+
+	// Strings handed out to responses are recycled here once they have been written,
+	// so in steady state building a response does not allocate.
+	// The pool is per thread and needs no locking.
+	class BufferPool
+	{
+	public:
+		static std::string get() {
+			auto& p = pool();
+			if (p.empty()) {
+				AllocCounters::count(AllocCounters::buffer_pool_misses);
+				return std::string();
+			}
+			auto s = std::move(p.back());
+			p.pop_back();
+			return s;
+		}
+
+		static void put(std::string s) {
+			auto& p = pool();
+			// Strings short enough to be stored inline have nothing worth keeping
+			if (p.size() < max_pooled && s.capacity() > std::string().capacity() && s.capacity() <= max_capacity) {
+				s.clear();
+				p.push_back(std::move(s));
+			}
+		}
+
+	private:
+		static std::vector<std::string>& pool() {
+			static thread_local std::vector<std::string> p;
+			return p;
+		}
+
+		static constexpr std::size_t max_pooled = 256;
+		static constexpr std::size_t max_capacity = 64 * 1024;
+	}; // class BufferPool
+
+	// A response ready to be sent: the status line and headers, then the body.
+	// The head is written into a pooled buffer. The body is a separate buffer, so it goes
+	// to the socket without being copied.
+	class Response
+	{
+	public:
+		typedef std::vector<char> DATA;
+
+		explicit Response(int status) : head(BufferPool::get()), code(status) {
+			char num[12];
+			auto end = std::to_chars(num, num + sizeof(num), status).ptr;
+			head += "HTTP/1.1 ";
+			head.append(num, end);
+			head += ' ';
+			head += reason_phrase(status);
+			head += "\r\n";
+		}
+
+		Response(Response&&) = default;
+		Response& operator=(Response&&) = default;
+
+		~Response() {
+			BufferPool::put(std::move(head));
+			if (auto s = std::get_if<std::string>(&owned))
+				BufferPool::put(std::move(*s));
+		}
+
+		Response& header(std::string_view name, std::string_view value) {
+			head += name;
+			head += ": ";
+			head += value;
+			head += "\r\n";
+			return *this;
+		}
+
+		// Header lines that are already formatted, each ending with "\r\n"
+		Response& headers(std::string_view lines) {
+			head += lines;
+			return *this;
+		}
+
+		// Takes ownership of the body without copying it
+		Response& body(std::string&& b) {
+			owned = std::move(b);
+			return *this;
+		}
+
+		Response& body(DATA&& b) {
+			owned = std::move(b);
+			return *this;
+		}
+
+		// Copies the body into a pooled buffer, unless it is short enough to be stored inline
+		Response& body(std::string_view b) {
+			auto s = b.size() > std::string().capacity() ? BufferPool::get() : std::string();
+			s.assign(b.data(), b.size());
+			owned = std::move(s);
+			return *this;
+		}
+
+		Response& body(const char* b) { return body(std::string_view(b)); }
+		Response& body(DATA const& b) { return body(std::string_view(b.data(), b.size())); }
+
+		// The caller guarantees the memory outlives the write, e.g. static data
+		Response& body_ref(asio::const_buffer b) {
+			owned = b;
+			return *this;
+		}
+
+		// The memory is kept alive by holding on to keep, e.g. a memory mapping
+		Response& body_ref(asio::const_buffer b, std::shared_ptr<void const> keep_alive) {
+			owned = b;
+			keep = std::move(keep_alive);
+			return *this;
+		}
+
+		// Part of an open file, which goes from the page cache to the socket with sendfile()
+		// without passing through user space. fd must stay open for as long as keep is held.
+		// Only where FileRegion::supported.
+		Response& body_file(int fd, std::uint64_t offset, std::uint64_t length, std::shared_ptr<void const> keep_alive) {
+			owned = FileRegion{ fd, offset, length };
+			keep = std::move(keep_alive);
+			return *this;
+		}
+
+		// A response serialized earlier, e.g. by a cache. head ends with the blank line and
+		// both buffers are kept alive by holding on to keep.
+		static Response serialized(int status, asio::const_buffer head, asio::const_buffer body, std::shared_ptr<void const> keep_alive) {
+			Response resp;
+			resp.code = status;
+			resp.fixed_head = head;
+			resp.owned = body;
+			resp.keep = std::move(keep_alive);
+			return resp;
+		}
+
+		int status() const { return code; }
+
+		// Value of a header added so far, or an empty view
+		std::string_view header_value(std::string_view name) const {
+			std::string_view h(head);
+			auto pos = h.find("\r\n");
+			while (pos != std::string_view::npos && pos + 2 < h.size()) {
+				auto line = h.substr(pos + 2);
+				auto end = line.find("\r\n");
+				line = line.substr(0, end);
+				auto colon = line.find(':');
+				if (colon != std::string_view::npos && iequals(line.substr(0, colon), name)) {
+					auto v = line.substr(colon + 1);
+					while (!v.empty() && v.front() == ' ')
+						v.remove_prefix(1);
+					return v;
+				}
+				pos = end == std::string_view::npos ? end : pos + 2 + end;
+			}
+			return {};
+		}
+
+		// The body, when it is held in memory. Empty for a file.
+		std::string_view body_data() const {
+			auto b = body_buffer();
+			return std::string_view(static_cast<const char*>(b.data()), b.size());
+		}
+
+		std::size_t body_size() const {
+			if (auto f = std::get_if<FileRegion>(&owned))
+				return static_cast<std::size_t>(f->length);
+			return body_buffer().size();
+		}
+
+		struct FileRegion {
+#if defined(__linux__)
+			static constexpr bool supported = true;
+#else
+			static constexpr bool supported = false;
+#endif // defined(__linux__)
+
+			int fd;
+			std::uint64_t offset;
+			std::uint64_t length;
+		};
+
+	private:
+		friend class Connection;
+
+		// A piece of a streamed body, with its framing, if any, in head
+		Response() = default;
+
+		// Adds Content-Length and the blank line that ends the head
+		void finish() { finish(body_size()); }
+
+		void finish(std::uint64_t length) {
+			if (fixed_head.size())
+				return;
+			// These never have a body, and a 304 would be claiming the length of the one it stands for
+			if (code < 200 || code == 204 || code == 304) {
+				head += "\r\n";
+				return;
+			}
+			char num[24];
+			auto end = std::to_chars(num, num + sizeof(num), length).ptr;
+			head += "Content-Length: ";
+			head.append(num, end);
+			head += "\r\n\r\n";
+		}
+
+		void finish_chunked() {
+			head += "Transfer-Encoding: chunked\r\n\r\n";
+		}
+
+		// Adds Connection: close to a finished head. One serialized earlier is copied for it.
+		void close_after() {
+			if (fixed_head.size()) {
+				head.assign(static_cast<const char*>(fixed_head.data()), fixed_head.size());
+				fixed_head = asio::const_buffer();
+			}
+			head.insert(head.size() - 2, "Connection: close\r\n");
+		}
+
+		asio::const_buffer head_buffer() const { return fixed_head.size() ? fixed_head : asio::buffer(head); }
+
+		FileRegion* file() { return std::get_if<FileRegion>(&owned); }
+
+		asio::const_buffer body_buffer() const {
+			if (auto s = std::get_if<std::string>(&owned))
+				return asio::buffer(*s);
+			if (auto d = std::get_if<DATA>(&owned))
+				return asio::buffer(*d);
+			if (auto b = std::get_if<asio::const_buffer>(&owned))
+				return *b;
+			return {};
+		}
+
+		std::string head;
+		std::variant<std::monostate, std::string, DATA, asio::const_buffer, FileRegion> owned;
+		std::shared_ptr<void const> keep;
+		asio::const_buffer fixed_head; // when serialized() already, in place of head
+		int code = 200;
+		bool head_only = false; // answers a HEAD request
+	}; // class Response
+
+	// A stage a route's responses go through before they are sent, which may rewrite the body
+	// into a content coding the client accepts, e.g. Compression in compression.hpp
+	class ContentEncoder
+	{
+	public:
+		virtual ~ContentEncoder() = default;
+
+		// The coding a response to this request would get, or an empty view for none.
+		// Cached responses are kept apart by it.
+		virtual std::string_view coding(Headers const& request) const = 0;
+
+		// Encodes the body of resp, adding Content-Encoding, before the head is finished.
+		// Returns whether the response depends on Accept-Encoding, which the caller then
+		// adds to Vary.
+		virtual bool encode(Headers const& request, Response& resp) const = 0;
+	}; // class ContentEncoder
+} // namespace bb
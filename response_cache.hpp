@@ -0,0 +1,174 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "headers.hpp"
+
+namespace bb {
+	// Responses kept fully serialized, head and body, so a hit goes to the socket as is.
+	// Entries live for the ttl of the route that stored them. When the memory budget is
+	// exceeded the least recently used ones go first. The cache is split into shards, each
+	// with a lock of its own, so threads looking up different keys rarely meet.
+	class ResponseCache
+	{
+	public:
+		typedef std::chrono::steady_clock clock;
+
+		struct Options {
+			// Bytes of serialized responses and keys, spread evenly over the shards
+			std::size_t max_bytes = 64 * 1024 * 1024;
+			std::size_t shards = 16;
+		};
+
+		struct Entry {
+			std::string data;      // head, ending with the blank line, then the body
+			std::size_t head_size;
+			std::string etag;
+			clock::time_point expires;
+		};
+
+		typedef std::shared_ptr<Entry const> EntryPtr;
+
+		ResponseCache() : ResponseCache(Options()) { }
+		explicit ResponseCache(Options options)
+		  : shards(options.shards ? options.shards : 1), shard_bytes(options.max_bytes / shards.size()) { }
+
+		ResponseCache(ResponseCache const&) = delete;
+		ResponseCache& operator=(ResponseCache const&) = delete;
+
+		// The entry for key, or nullptr if there is none or it has expired
+		EntryPtr find(std::string const& key) {
+			auto& sh = shard(key);
+			std::lock_guard<std::mutex> lock(sh.mutex);
+			auto it = sh.map.find(key);
+			if (it == sh.map.end())
+				return nullptr;
+			if (clock::now() >= it->second->entry->expires) {
+				sh.erase(it);
+				return nullptr;
+			}
+			sh.lru.splice(sh.lru.begin(), sh.lru, it->second);
+			return it->second->entry;
+		}
+
+		// Replaces any entry for key. Entries too large for a shard are not kept.
+		void insert(std::string const& key, EntryPtr entry) {
+			auto size = cost(key, *entry);
+			auto& sh = shard(key);
+			std::lock_guard<std::mutex> lock(sh.mutex);
+			auto it = sh.map.find(key);
+			if (it != sh.map.end())
+				sh.erase(it);
+			if (size > shard_bytes)
+				return;
+			while (sh.bytes + size > shard_bytes)
+				sh.erase(sh.map.find(sh.lru.back().key));
+			sh.lru.push_front({ key, std::move(entry), size });
+			sh.map.emplace(key, sh.lru.begin());
+			sh.bytes += size;
+		}
+
+		void erase(std::string const& key) {
+			auto& sh = shard(key);
+			std::lock_guard<std::mutex> lock(sh.mutex);
+			auto it = sh.map.find(key);
+			if (it != sh.map.end())
+				sh.erase(it);
+		}
+
+		void clear() {
+			for (auto& sh : shards) {
+				std::lock_guard<std::mutex> lock(sh.mutex);
+				sh.map.clear();
+				sh.lru.clear();
+				sh.bytes = 0;
+			}
+		}
+
+		// Bytes in use over all shards
+		std::size_t size() {
+			std::size_t n = 0;
+			for (auto& sh : shards) {
+				std::lock_guard<std::mutex> lock(sh.mutex);
+				n += sh.bytes;
+			}
+			return n;
+		}
+
+		// A strong validator for a body, used when the response does not bring its own
+		static std::string make_etag(std::string_view body) {
+			std::uint64_t h = 0xcbf29ce484222325ull;
+			for (unsigned char c : body) {
+				h ^= c;
+				h *= 0x100000001b3ull;
+			}
+			char buf[20];
+			auto n = std::snprintf(buf, sizeof(buf), "\"%016llx\"", static_cast<unsigned long long>(h));
+			return std::string(buf, n);
+		}
+
+	private:
+		struct Item {
+			std::string key;
+			EntryPtr entry;
+			std::size_t size;
+		};
+
+		struct Shard {
+			typedef std::list<Item>::iterator iterator;
+
+			void erase(std::unordered_map<std::string, iterator>::iterator it) {
+				bytes -= it->second->size;
+				lru.erase(it->second);
+				map.erase(it);
+			}
+
+			std::mutex mutex;
+			std::list<Item> lru; // most recently used first
+			std::unordered_map<std::string, iterator> map;
+			std::size_t bytes = 0;
+		};
+
+		// The key is held by both the map and the list
+		static std::size_t cost(std::string const& key, Entry const& e) {
+			return 2 * key.size() + e.data.size() + e.etag.size() + sizeof(Entry) + sizeof(Item);
+		}
+
+		Shard& shard(std::string const& key) { return shards[std::hash<std::string>()(key) % shards.size()]; }
+
+		std::vector<Shard> shards;
+		std::size_t shard_bytes;
+	}; // class ResponseCache
+
+	// Makes a route answer GET and HEAD from a cache, e.g.
+	//   server.add_route("/news", Methods::GET | Methods::HEAD, news, CachePolicy{ cache, std::chrono::seconds(5) });
+	// The handler runs only on a miss. Its response is stored if it is a 200 whose
+	// Cache-Control allows it, and gets an ETag if it has none, so clients can revalidate
+	// with If-None-Match and get a 304.
+	struct CachePolicy {
+		std::shared_ptr<ResponseCache> cache;
+		ResponseCache::clock::duration ttl = std::chrono::seconds(10);
+		// Request headers whose values select different responses, sent back as Vary
+		std::vector<std::string> vary;
+
+		// GET and HEAD share an entry, since the head of both is the same
+		void make_key(std::string& key, std::string_view uri, Headers const& headers) const {
+			key.assign(uri.data(), uri.size());
+			for (auto& name : vary) {
+				key += '\n';
+				key += headers.get(name);
+			}
+		}
+	};
+} // namespace bb
@@ -1,43 +1,362 @@
 #pragma once
 
+#include <array>
+#include <charconv>
 #include <cstdint>
 #include <functional>
 #include <memory>
 #include <regex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <type_traits>
 #include <utility>
 #include <vector>
 
+#include "asio.hpp"
+
+#include "admission.hpp"
+#include "bitmask.hpp"
 #include "methods.hpp"
+#include "offload_pool.hpp"
+#include "response_cache.hpp"
 
 namespace bb {
 	class Connection;
+	class ContentEncoder;
+
+	enum class RouteOptions {
+		None = 0x00,
+		// The handler is called as soon as the head has arrived and reads the body itself with
+		// Connection::read_body(). Otherwise the whole body is read before it is called.
+		StreamBody = 0x01,
+	};
+
+	ENABLE_BITMASK_OPERATORS(RouteOptions);
+
+	// Parts of the request path captured by a route.
+	// Index 0 is the whole path and captures follow in the order they appear in the route,
+	// the same layout std::smatch had. The views point into the request URI and are valid
+	// until the connection starts reading its next request.
+	class Captures
+	{
+	public:
+		static constexpr std::size_t max_captures = 16;
+
+		std::string_view operator[](std::size_t i) const { return i < size() ? parts[i] : std::string_view(); }
+		std::size_t size() const { return count < max_captures ? count : max_captures; }
+
+		// Capture by the name it was given in the route pattern, or an empty view
+		std::string_view named(std::string_view name) const {
+			if (names) {
+				for (std::size_t i = 0; i < names->size(); ++i) {
+					if ((*names)[i] == name)
+						return (*this)[i + 1];
+				}
+			}
+			return {};
+		}
+
+		// Value of a capture declared as {name:int}. Other captures yield 0 if they are not a number.
+		std::int64_t integer(std::size_t i) const {
+			auto s = (*this)[i];
+			std::int64_t v = 0;
+			std::from_chars(s.data(), s.data() + s.size(), v);
+			return v;
+		}
+
+	private:
+		friend class Router;
+
+		void push(std::string_view s) {
+			if (count < max_captures)
+				parts[count] = s;
+			++count;
+		}
+
+		void pop() { --count; }
+
+		std::array<std::string_view, max_captures> parts;
+		std::size_t count = 0;
+		std::vector<std::string> const* names = nullptr;
+	}; // class Captures
 
+	// Routes are patterns made of static text and parameters:
+	//   /users/{name}           a non-empty path segment
+	//   /users/{id:int}/posts   a segment made only of digits
+	//   /files/{path:*}         the rest of the path, must come last
+	// They are kept in a radix tree, so a lookup costs about the length of the path and not
+	// the number of routes. When several routes match, static text is preferred over {int},
+	// {int} over plain parameters, and those over wildcards.
+	// A route containing any of ()[]*+?\|^$ outside of braces is taken to be a regular
+	// expression. These are only tried, in the order they were added, after the tree fails.
 	class Router
 	{
 	private:
 		typedef std::shared_ptr<Connection> ConnectionPtr;
-	
+
 	public:
-		typedef std::function<void(std::smatch const&, Methods, ConnectionPtr)> HandlerFunc;
+		typedef std::function<void(Captures const&, Methods, ConnectionPtr)> HandlerFunc;
+
+		struct Endpoint {
+			Methods methods;
+			HandlerFunc handler;
+			std::vector<std::string> names;
+			RouteOptions options;
+			std::shared_ptr<CachePolicy const> cache;
+			std::shared_ptr<ContentEncoder const> encoder;
+			std::shared_ptr<RouteGate> gate; // admission, if the route is limited
+			std::shared_ptr<OffloadPool> offload; // runs the handler, if not the I/O thread
+			std::size_t id; // index into routes()
+		};
 
-		void add_route(std::string const& route, Methods methods, HandlerFunc handler) {
-			std::regex route_regex(route, std::regex::optimize);
-			routes.emplace_back(route_regex, methods, handler);
+		// Settings may follow the handler in any order and combination:
+		//   RouteOptions                            see RouteOptions
+		//   CachePolicy                             responses are cached, see CachePolicy
+		//   std::shared_ptr<ContentEncoder const>   responses are encoded, e.g. by Compression
+		//   ConcurrencyLimit, RateLimit             requests past them are refused, see admission.hpp
+		//   std::shared_ptr<OffloadPool>            the handler runs on the pool, see OffloadPool
+		template<typename ... Settings>
+		void add_route(std::string const& route, Methods methods, HandlerFunc handler, Settings&& ... settings) {
+			Endpoint ep{ methods, std::move(handler), {}, RouteOptions::None, nullptr, nullptr, nullptr, nullptr, 0 };
+			(apply(ep, std::forward<Settings>(settings)), ...);
+			add_endpoint(route, std::move(ep));
 		}
 
-		bool handle_route(std::string const& route, std::string const& method_name, ConnectionPtr con) const {
-			auto method = method_from_name(method_name);
-			for (auto& r : routes) {
-				std::smatch parts;
-				if (((method & std::get<1>(r)) == method) && std::regex_match(route, parts, std::get<0>(r))) {
-					std::get<2>(r)(parts, method, std::move(con));
-					return true;
+#if defined(ASIO_HAS_CO_AWAIT)
+		// A handler can also be a coroutine returning asio::awaitable<void>. It runs on the
+		// connection's executor and can co_await body reads, upstream requests and timers
+		// with asio::use_awaitable without holding up the thread. The captures it is given
+		// stay valid until it has responded.
+		template<typename F, typename ... Rest, std::enable_if_t<std::is_same_v<std::invoke_result_t<F&, Captures const&, Methods, ConnectionPtr>, asio::awaitable<void>>, int> = 0>
+		void add_route(std::string const& route, Methods methods, F handler, Rest&& ... rest) {
+			// con is generic so that Connection only has to be complete where the route is added
+			add_route(route, methods, HandlerFunc([handler{ std::move(handler) }](Captures const& caps, Methods method, auto con) mutable {
+				con->spawn(handler(caps, method, con));
+			}), std::forward<Rest>(rest)...);
+		}
+#endif // defined(ASIO_HAS_CO_AWAIT)
+
+		// Finds the route for a request and fills in its captures, or returns nullptr
+		Endpoint const* find_route(std::string_view route, Methods method, Captures& caps) const {
+			caps = Captures();
+			caps.push(route);
+			if (auto ep = match(root, route, 0, method, caps)) {
+				caps.names = &ep->names;
+				return ep;
+			}
+
+			for (auto& r : regex_routes) {
+				// Reused, so matching does not allocate once it has grown to the largest route
+				static thread_local std::cmatch parts;
+				if (((method & r.second.methods) == method) && std::regex_match(route.data(), route.data() + route.size(), parts, r.first)) {
+					caps.count = 0;
+					for (auto& p : parts) {
+						caps.push(p.matched ? std::string_view(p.first, p.length()) : std::string_view());
+					}
+					return &r.second;
 				}
 			}
+			return nullptr;
+		}
+
+		// The pattern of every route in the order they were added, so by Endpoint::id
+		std::vector<std::string> const& routes() const { return patterns; }
+
+		bool handle_route(std::string_view route, std::string_view method_name, ConnectionPtr con) const {
+			auto method = method_from_name(method_name);
+			Captures caps;
+			if (auto ep = find_route(route, method, caps)) {
+				ep->handler(caps, method, std::move(con));
+				return true;
+			}
 			return false;
 		}
 
 	private:
-		std::vector<std::tuple<std::regex, Methods, HandlerFunc>> routes;
+		struct Node {
+			std::string label;
+			std::vector<std::unique_ptr<Node>> children; // static text, no two start with the same char
+			std::unique_ptr<Node> int_param;
+			std::unique_ptr<Node> str_param;
+			std::unique_ptr<Node> wildcard;
+			std::vector<Endpoint> endpoints;
+		};
+
+		static bool is_regex(std::string const& route) {
+			int depth = 0;
+			for (auto c : route) {
+				if (c == '{')
+					++depth;
+				else if (c == '}')
+					--depth;
+				else if (depth == 0 && std::string_view(R"(()[]*+?\|^$)").find(c) != std::string_view::npos)
+					return true;
+			}
+			return false;
+		}
+
+		static bool is_int(std::string_view s) {
+			if (s.empty())
+				return false;
+			for (auto c : s) {
+				if (c < '0' || c > '9')
+					return false;
+			}
+			return true;
+		}
+
+		static void apply(Endpoint& ep, RouteOptions options) { ep.options |= options; }
+		static void apply(Endpoint& ep, CachePolicy cache) { ep.cache = std::make_shared<CachePolicy const>(std::move(cache)); }
+		static void apply(Endpoint& ep, std::shared_ptr<ContentEncoder const> encoder) { ep.encoder = std::move(encoder); }
+		static void apply(Endpoint& ep, ConcurrencyLimit const& limit) { gate(ep).set(limit); }
+		static void apply(Endpoint& ep, RateLimit const& limit) { gate(ep).set(limit); }
+		static void apply(Endpoint& ep, std::shared_ptr<OffloadPool> pool) { ep.offload = std::move(pool); }
+
+		static RouteGate& gate(Endpoint& ep) {
+			if (!ep.gate)
+				ep.gate = std::make_shared<RouteGate>();
+			return *ep.gate;
+		}
+
+		void add_endpoint(std::string const& route, Endpoint ep) {
+			ep.id = patterns.size();
+			if (is_regex(route)) {
+				regex_routes.push_back({ std::regex(route, std::regex::optimize), std::move(ep) });
+			}
+			else {
+				insert(route, std::move(ep));
+			}
+			patterns.push_back(route);
+		}
+
+		void insert(std::string const& route, Endpoint ep) {
+			Node* node = &root;
+			std::size_t pos = 0;
+			while (pos < route.size()) {
+				auto open = route.find('{', pos);
+				if (open != pos) {
+					node = insert_static(node, std::string_view(route).substr(pos, open - pos));
+					if (open == std::string::npos)
+						break;
+				}
+
+				auto close = route.find('}', open);
+				if (close == std::string::npos)
+					throw std::invalid_argument("Unterminated parameter in route " + route);
+				auto param = std::string_view(route).substr(open + 1, close - open - 1);
+				auto colon = param.find(':');
+				auto type = colon == std::string_view::npos ? std::string_view() : param.substr(colon + 1);
+				ep.names.emplace_back(param.substr(0, colon));
+
+				std::unique_ptr<Node>* slot;
+				if (type.empty())
+					slot = &node->str_param;
+				else if (type == "int")
+					slot = &node->int_param;
+				else if (type == "*" && close + 1 == route.size())
+					slot = &node->wildcard;
+				else
+					throw std::invalid_argument("Bad parameter in route " + route);
+				if (!*slot)
+					*slot = std::make_unique<Node>();
+				node = slot->get();
+				pos = close + 1;
+			}
+			node->endpoints.push_back(std::move(ep));
+		}
+
+		// Walks the static text down from node, splitting edges where needed, and returns the node it ends at
+		static Node* insert_static(Node* node, std::string_view text) {
+			while (!text.empty()) {
+				Node* next = nullptr;
+				for (auto& c : node->children) {
+					if (c->label[0] == text[0]) {
+						next = c.get();
+						break;
+					}
+				}
+				if (!next) {
+					node->children.push_back(std::make_unique<Node>());
+					node->children.back()->label = text;
+					return node->children.back().get();
+				}
+
+				std::size_t common = 0;
+				while (common < text.size() && common < next->label.size() && text[common] == next->label[common])
+					++common;
+				if (common < next->label.size()) {
+					auto tail = std::make_unique<Node>();
+					tail->label = next->label.substr(common);
+					tail->children = std::move(next->children);
+					tail->int_param = std::move(next->int_param);
+					tail->str_param = std::move(next->str_param);
+					tail->wildcard = std::move(next->wildcard);
+					tail->endpoints = std::move(next->endpoints);
+					next->label.resize(common);
+					next->children.clear();
+					next->children.push_back(std::move(tail));
+				}
+				node = next;
+				text.remove_prefix(common);
+			}
+			return node;
+		}
+
+		static Endpoint const* find_endpoint(Node const& node, Methods method) {
+			for (auto& ep : node.endpoints) {
+				if ((method & ep.methods) == method)
+					return &ep;
+			}
+			return nullptr;
+		}
+
+		// Depth first, so a dead end under static text falls back to the parameters at the same level
+		static Endpoint const* match(Node const& node, std::string_view path, std::size_t pos, Methods method, Captures& caps) {
+			if (pos == path.size()) {
+				if (auto ep = find_endpoint(node, method))
+					return ep;
+			}
+			else {
+				for (auto& c : node.children) {
+					if (c->label[0] == path[pos]) {
+						if (path.compare(pos, c->label.size(), c->label) == 0) {
+							if (auto ep = match(*c, path, pos + c->label.size(), method, caps))
+								return ep;
+						}
+						break;
+					}
+				}
+
+				auto end = path.find('/', pos);
+				if (end == std::string_view::npos)
+					end = path.size();
+				auto segment = path.substr(pos, end - pos);
+				if (node.int_param && is_int(segment)) {
+					caps.push(segment);
+					if (auto ep = match(*node.int_param, path, end, method, caps))
+						return ep;
+					caps.pop();
+				}
+				if (node.str_param && !segment.empty()) {
+					caps.push(segment);
+					if (auto ep = match(*node.str_param, path, end, method, caps))
+						return ep;
+					caps.pop();
+				}
+			}
+
+			if (node.wildcard) {
+				if (auto ep = find_endpoint(*node.wildcard, method)) {
+					caps.push(path.substr(pos));
+					return ep;
+				}
+			}
+			return nullptr;
+		}
+
+		Node root;
+		std::vector<std::pair<std::regex, Endpoint>> regex_routes;
+		std::vector<std::string> patterns;
 	}; // class Router
 } // namespace bb
@@ -0,0 +1,85 @@
+// Compares the radix tree Router against the linear std::regex scan it replaced,
+// at 10, 100 and 1000 routes. Build with optimizations, e.g.
+//   g++ -std=c++17 -O2 router_bench.cpp -o router_bench
+
+#include <chrono>
+#include <iostream>
+#include <regex>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include "router.hpp"
+
+using namespace bb;
+
+// The old Router, kept here only to have something to measure against
+class LinearRegexRouter
+{
+public:
+	typedef std::function<void(std::smatch const&, Methods, std::shared_ptr<Connection>)> HandlerFunc;
+
+	void add_route(std::string const& route, Methods methods, HandlerFunc handler) {
+		std::regex route_regex(route, std::regex::optimize);
+		routes.emplace_back(route_regex, methods, handler);
+	}
+
+	bool handle_route(std::string const& route, std::string const& method_name, std::shared_ptr<Connection> con) const {
+		auto method = method_from_name(method_name);
+		for (auto& r : routes) {
+			std::smatch parts;
+			if (((method & std::get<1>(r)) == method) && std::regex_match(route, parts, std::get<0>(r))) {
+				std::get<2>(r)(parts, method, std::move(con));
+				return true;
+			}
+		}
+		return false;
+	}
+
+private:
+	std::vector<std::tuple<std::regex, Methods, HandlerFunc>> routes;
+};
+
+template<typename R>
+double ns_per_lookup(R const& router, std::vector<std::string> const& paths, unsigned int rounds) {
+	auto start = std::chrono::steady_clock::now();
+	for (unsigned int i = 0; i < rounds; ++i) {
+		for (auto& p : paths) {
+			if (!router.handle_route(p, "GET", nullptr)) {
+				std::cerr << "no route for " << p << '\n';
+				return 0;
+			}
+		}
+	}
+	std::chrono::duration<double, std::nano> took = std::chrono::steady_clock::now() - start;
+	return took.count() / (double(rounds) * paths.size());
+}
+
+int main()
+{
+	volatile std::size_t sink = 0;
+
+	for (unsigned int n : { 10, 100, 1000 }) {
+		Router tree;
+		LinearRegexRouter linear;
+		std::vector<std::string> paths;
+
+		// Half static routes, half routes with an integer id, looked up uniformly
+		for (unsigned int i = 0; i < n; i += 2) {
+			auto name = "/api/v1/resource" + std::to_string(i);
+			tree.add_route(name, Methods::GET, [&sink](Captures const& c, Methods, std::shared_ptr<Connection>) { sink = sink + c.size(); });
+			linear.add_route(name, Methods::GET, [&sink](std::smatch const& c, Methods, std::shared_ptr<Connection>) { sink = sink + c.size(); });
+			tree.add_route(name + "/items/{id:int}", Methods::GET, [&sink](Captures const& c, Methods, std::shared_ptr<Connection>) { sink = sink + c.size(); });
+			linear.add_route(name + "/items/([0-9]+)", Methods::GET, [&sink](std::smatch const& c, Methods, std::shared_ptr<Connection>) { sink = sink + c.size(); });
+			paths.push_back(name);
+			paths.push_back(name + "/items/" + std::to_string(i * 7));
+		}
+
+		unsigned int rounds = 200000 / n;
+		auto t = ns_per_lookup(tree, paths, rounds);
+		auto l = ns_per_lookup(linear, paths, rounds < 20 ? 20 : rounds / 10);
+		std::cout << n << " routes: radix " << t << " ns/lookup, linear regex " << l << " ns/lookup (" << l / t << "x)\n";
+	}
+
+	return 0;
+}
@@ -0,0 +1,127 @@
+// Checks which route Router picks and what it captures: static text over {int} over plain
+// parameters over wildcards, falling back from a dead end, methods, regular expressions
+// after the tree, and patterns it must refuse.
+//   g++ -std=c++17 -O2 router_test.cpp -o router_test -lpthread
+//   router_test
+
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+#define ASIO_STANDALONE 1
+#define ASIO_NO_DEPRECATED 1
+
+#include "router.hpp"
+#include "test_support.hpp"
+
+using namespace bb;
+
+static void nothing(Captures const&, Methods, std::shared_ptr<Connection>) { }
+
+// The pattern of the route found for path, or "" for none
+static std::string route_of(Router const& r, std::string_view path, Methods method, Captures& caps) {
+	auto ep = r.find_route(path, method, caps);
+	return ep ? r.routes()[ep->id] : std::string();
+}
+
+static std::string route_of(Router const& r, std::string_view path, Methods method = Methods::GET) {
+	Captures caps;
+	return route_of(r, path, method, caps);
+}
+
+static void precedence() {
+	Router r;
+	r.add_route("/users/{name}", Methods::GET, nothing);
+	r.add_route("/users/{rest:*}", Methods::GET, nothing);
+	r.add_route("/users/{id:int}", Methods::GET, nothing);
+	r.add_route("/users/me", Methods::GET, nothing);
+
+	Captures caps;
+	check(route_of(r, "/users/me", Methods::GET, caps) == "/users/me" && caps.size() == 1 && caps[0] == "/users/me", "static text first");
+	check(route_of(r, "/users/42", Methods::GET, caps) == "/users/{id:int}", "{int} before plain parameters");
+	check(caps[1] == "42" && caps.integer(1) == 42 && caps.named("id") == "42", "an {int} capture");
+	check(route_of(r, "/users/bob", Methods::GET, caps) == "/users/{name}" && caps.named("name") == "bob", "a plain parameter");
+	check(route_of(r, "/users/4x", Methods::GET, caps) == "/users/{name}" && caps.integer(1) == 4, "{int} takes digits only");
+	check(route_of(r, "/users/bob/posts/1", Methods::GET, caps) == "/users/{rest:*}" && caps[1] == "bob/posts/1", "the wildcard takes the rest");
+	check(route_of(r, "/users/", Methods::GET, caps) == "/users/{rest:*}" && caps[1].empty(), "a parameter is never empty, a wildcard can be");
+	check(route_of(r, "/users").empty() && route_of(r, "/user").empty() && route_of(r, "/usersx").empty(), "a prefix of a route is not a match");
+}
+
+static void dead_ends() {
+	Router r;
+	r.add_route("/a/static/c", Methods::GET, nothing);
+	r.add_route("/a/{x}/b", Methods::GET, nothing);
+	r.add_route("/api/version", Methods::GET, nothing);
+	r.add_route("/api/v1", Methods::GET, nothing);
+	r.add_route("/api/v1/{item}/{field}", Methods::GET, nothing);
+
+	Captures caps;
+	check(route_of(r, "/a/static/b", Methods::GET, caps) == "/a/{x}/b" && caps[1] == "static", "a dead end under static text falls back to a parameter");
+	check(route_of(r, "/a/static/c") == "/a/static/c", "the static route past the same text");
+	check(route_of(r, "/api/version") == "/api/version" && route_of(r, "/api/v1") == "/api/v1", "routes sharing text split it between them");
+	check(route_of(r, "/api/v").empty() && route_of(r, "/api/versions").empty(), "a split edge is not a route by itself");
+	check(route_of(r, "/api/v1/7/name", Methods::GET, caps) == "/api/v1/{item}/{field}" && caps.size() == 3, "captures in order");
+	check(caps[1] == "7" && caps[2] == "name" && caps.named("field") == "name" && caps.named("nope").empty(), "captures by index and by name");
+}
+
+static void methods() {
+	Router r;
+	r.add_route("/thing", Methods::GET | Methods::HEAD, nothing);
+	r.add_route("/thing", Methods::POST, nothing);
+	r.add_route("/thing/{id:int}", Methods::POST, nothing);
+	r.add_route("/thing/{name}", Methods::GET, nothing);
+
+	Captures caps;
+	auto get = r.find_route("/thing", Methods::GET, caps);
+	auto head = r.find_route("/thing", Methods::HEAD, caps);
+	auto post = r.find_route("/thing", Methods::POST, caps);
+	check(get && get == head && post && post != get, "one path, a route per method");
+	check(!r.find_route("/thing", Methods::OPTIONS, caps), "a method no route takes");
+	check(route_of(r, "/thing/5", Methods::POST) == "/thing/{id:int}", "the {int} route for its method");
+	check(route_of(r, "/thing/5", Methods::GET) == "/thing/{name}", "a parameter whose method matches when {int}'s does not");
+
+	bool called = false;
+	Router h;
+	h.add_route("/call/{n:int}", Methods::GET, [&called](Captures const& c, Methods m, std::shared_ptr<Connection>) {
+		called = c.integer(1) == 3 && m == Methods::GET;
+	});
+	check(h.handle_route("/call/3", "GET", nullptr) && called, "handle_route() calls the handler");
+	check(!h.handle_route("/call/3", "POST", nullptr), "handle_route() with no route");
+}
+
+static void regex_routes() {
+	Router r;
+	r.add_route("/re/([0-9]+)-([a-z]+)", Methods::GET, nothing);
+	r.add_route("/re/(.*)", Methods::GET, nothing);
+	r.add_route("/re/tree", Methods::GET, nothing);
+
+	Captures caps;
+	check(route_of(r, "/re/tree") == "/re/tree", "the tree before any regular expression");
+	check(route_of(r, "/re/12-ab", Methods::GET, caps) == "/re/([0-9]+)-([a-z]+)" && caps.size() == 3 && caps[1] == "12" && caps[2] == "ab", "regular expression groups are captures");
+	check(route_of(r, "/re/anything", Methods::GET, caps) == "/re/(.*)" && caps[1] == "anything", "regular expressions in the order they were added");
+	check(r.routes().size() == 3 && r.routes()[2] == "/re/tree", "routes() in the order they were added");
+}
+
+static void refused() {
+	static char const* const bad[] = { "/x/{unterminated", "/x/{n:float}", "/x/{rest:*}/more" };
+	for (auto b : bad) {
+		Router r;
+		bool threw = false;
+		try {
+			r.add_route(b, Methods::GET, nothing);
+		}
+		catch (std::invalid_argument const&) {
+			threw = true;
+		}
+		check(threw, "a malformed route is refused");
+	}
+}
+
+int main() {
+	precedence();
+	dead_ends();
+	methods();
+	regex_routes();
+	refused();
+	return finish();
+}
@@ -1,44 +1,198 @@
 #pragma once
 
+#include <chrono>
+#include <functional>
 #include <iostream>
+#include <memory>
+#include <string>
 #include <vector>
 #include <thread>
 
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif // defined(__linux__)
+
+// BB_IO_URING accepts connections through io_uring, see uring_accept.hpp. Where liburing is
+// there as well it also has asio do all socket I/O through io_uring, which takes asio 1.21 or
+// later, linking with -luring, and this header included before anything else that includes asio.
+#if defined(BB_IO_URING) && __has_include(<liburing.h>) && !defined(ASIO_HAS_IO_URING)
+#define ASIO_HAS_IO_URING 1
+#define ASIO_DISABLE_EPOLL 1
+#endif // defined(BB_IO_URING) && __has_include(<liburing.h>) && !defined(ASIO_HAS_IO_URING)
+
 #include "asio.hpp"
 
+#if defined(ASIO_DISABLE_EPOLL) && defined(ASIO_VERSION) && ASIO_VERSION < 102100
+#error "asio before 1.21 has no io_uring, and without epoll it would fall back to select"
+#endif // defined(ASIO_DISABLE_EPOLL) && defined(ASIO_VERSION) && ASIO_VERSION < 102100
+
+#include "access_log.hpp"
+#include "bitmask.hpp"
+#include "connection_registry.hpp"
+#include "handoff.hpp"
+#include "metrics.hpp"
 #include "server_connection.hpp"
 #include "router.hpp"
+#include "timer_wheel.hpp"
+#if defined(BB_IO_URING)
+#include "uring_accept.hpp"
+#endif // defined(BB_IO_URING)
 
 namespace bb {
+	enum class ServerOptions {
+		None = 0x00,
+		// One io_context and one SO_REUSEPORT acceptor per thread, so a connection stays on
+		// the thread that accepted it. Without SO_REUSEPORT this falls back to a shared context.
+		PerThreadContext = 0x01,
+		// Pin each thread started by run() to its own CPU (Linux only)
+		PinThreads = 0x02,
+	};
+
+	ENABLE_BITMASK_OPERATORS(ServerOptions);
+
 	class Server
 	{
 	public:
-		Server(unsigned short port = 0) : signals(io), acceptor(io, asio::ip::tcp::endpoint(asio::ip::tcp::v4(), port)) {
+		// listener is a socket that is listening already, handed over by take_listener(), in
+		// which case port is not used. Only where there are UNIX sockets to hand it over.
+		Server(unsigned short port = 0, ServerOptions options = ServerOptions::None, [[maybe_unused]] int listener = -1) : options(options), signals(io), acceptor(io),
+#if defined(BB_IO_URING)
+			ring(io),
+#endif // defined(BB_IO_URING)
+			drain_timer(io) {
+			wheel.start(io);
+#if !defined(SO_REUSEPORT)
+			this->options &= ~ServerOptions::PerThreadContext;
+#endif // !defined(SO_REUSEPORT)
+#if defined(ASIO_HAS_LOCAL_SOCKETS)
+			if (listener >= 0) {
+				sockaddr_storage addr{};
+				socklen_t len = sizeof(addr);
+				::getsockname(listener, reinterpret_cast<sockaddr*>(&addr), &len);
+				acceptor.assign(addr.ss_family == AF_INET6 ? asio::ip::tcp::v6() : asio::ip::tcp::v4(), listener);
+			}
+			else
+#endif // defined(ASIO_HAS_LOCAL_SOCKETS)
+			open_acceptor(acceptor, asio::ip::tcp::endpoint(asio::ip::tcp::v4(), port));
+
 			signals.add(SIGINT);
 			signals.add(SIGTERM);
 #if defined(SIGQUIT)
 			signals.add(SIGQUIT);
 #endif // defined(SIGQUIT)
-			signals.async_wait([this](auto, auto) {
-				std::cerr << "stopping... ";
-				acceptor.close();
+			signals.async_wait([this](auto err, auto) {
+				if (!err) {
+					std::cerr << "stopping... ";
+					stop();
+				}
 			});
 
-			do_accept();
+#if defined(BB_IO_URING)
+			ring_accept(io, acceptor, ring, wheel);
+#else
+			do_accept(io, acceptor, wheel);
+#endif // defined(BB_IO_URING)
 		}
 
+		~Server() { wheel.stop(); }
+
 		void run(unsigned int num_threads = 1) {
 			if (num_threads == 0)
 				num_threads = 1;
-			std::cerr << "Starting server on " << acceptor.local_endpoint().address() << ":" << acceptor.local_endpoint().port() << " using " << num_threads << " threads\n";
+			std::cerr << "Starting server on " << acceptor.local_endpoint().address() << ":" << acceptor.local_endpoint().port() << " using " << num_threads << " threads on " << io_backend()
+				<< (sharded() ? " with a context per thread\n" : "\n");
+
+			// The first shard is the shared context, which also owns the signal handler
+			if (sharded()) {
+				for (unsigned int i = 1; i < num_threads; ++i) {
+					auto shard = std::make_unique<Shard>();
+					open_acceptor(shard->acceptor, acceptor.local_endpoint());
+#if defined(BB_IO_URING)
+					ring_accept(shard->io, shard->acceptor, shard->ring, shard->wheel);
+#else
+					do_accept(shard->io, shard->acceptor, shard->wheel);
+#endif // defined(BB_IO_URING)
+					shards.push_back(std::move(shard));
+				}
+			}
+
 			for (unsigned int i = 0; i < num_threads; ++i) {
-				run_pool.emplace_back([this]() { io.run(); });
+				auto& ctx = (sharded() && i > 0) ? shards[i - 1]->io : io;
+				run_pool.emplace_back([this, i, &ctx]() {
+					pin_thread(i);
+					ctx.run();
+				});
 			}
 			for (unsigned int i = 0; i < num_threads; ++i) {
 				run_pool[i].join();
 			}
+			run_pool.clear();
+			shards.clear();
 		}
 
+		// Stops accepting new connections and drains the open ones: each is closed once it has
+		// answered the request it is on, with Connection: close on the answer, and those
+		// waiting for their next request are closed right away. Those still open after grace
+		// are closed regardless. run() returns once they are all gone.
+		void stop(std::chrono::steady_clock::duration grace) {
+			asio::post(io, [this, grace]() {
+				if (registry.draining())
+					return;
+				signals.cancel();
+#if defined(BB_IO_URING)
+				ring.close();
+#endif // defined(BB_IO_URING)
+				acceptor.close();
+#if defined(ASIO_HAS_LOCAL_SOCKETS)
+				if (handoff) {
+					handoff->close();
+				}
+#endif // defined(ASIO_HAS_LOCAL_SOCKETS)
+				// On the shared context, which only runs once run() has made every shard, so
+				// they are all there and none is being added
+				for (auto& shard : shards) {
+					asio::post(shard->io, [s = shard.get()]() {
+#if defined(BB_IO_URING)
+						s->ring.close();
+#endif // defined(BB_IO_URING)
+						s->acceptor.close();
+					});
+				}
+				registry.start_draining();
+				for (auto& f : stop_hooks) {
+					f();
+				}
+				registry.for_each([](std::shared_ptr<void> const& c) {
+					auto con = std::static_pointer_cast<Connection>(c);
+					asio::post(con->get_executor(), [con]() { con->drain(); });
+				});
+				drain_deadline = std::chrono::steady_clock::now() + grace;
+				watch_drain();
+			});
+		}
+
+		// Waits up to limits().drain_timeout, which SIGINT and SIGTERM do too
+		void stop() { stop(conn_limits.drain_timeout); }
+
+		// f is called on the shared context as stop() begins, e.g. to stop timers of one's own
+		// that would keep run() from returning. Add them before run().
+		void on_stop(std::function<void()> f) { stop_hooks.push_back(std::move(f)); }
+
+#if defined(ASIO_HAS_LOCAL_SOCKETS)
+		// Hands the listening socket over to the process that calls take_listener(path), and
+		// then stops as stop() does. The socket stays open throughout, so no connection is
+		// refused while the new process starts or this one drains.
+		// With PerThreadContext only the first socket is handed over. The new process opens the
+		// others next to it with SO_REUSEPORT, so it has to be run with that option as well.
+		void hand_off(std::string const& path) {
+			// A socket file left by an earlier run
+			::unlink(path.c_str());
+			handoff = std::make_unique<asio::local::stream_protocol::acceptor>(io, asio::local::stream_protocol::endpoint(path));
+			await_successor(path);
+		}
+#endif // defined(ASIO_HAS_LOCAL_SOCKETS)
+
 		auto address() const { return acceptor.local_endpoint().address(); }
 		auto port()    const { return acceptor.local_endpoint().port(); }
 
@@ -47,30 +201,251 @@ namespace bb {
 			return router.add_route(std::forward<T>(all)...);
 		}
 
+		// Applies to connections accepted after it is changed, so set it up before run()
+		Limits& limits() { return conn_limits; }
+
+		std::size_t connection_count() const { return stats.connections.load(std::memory_order_relaxed); }
+
+		// Requests, bytes and latencies of every connection this server has accepted
+		Metrics& metrics() { return stats; }
+
+		// Logs responses and errors, which otherwise go to std::cerr. Applies to connections
+		// accepted after it is called, so set it up before run().
+		void access_log(AccessLog::Options options) { logger = std::make_unique<AccessLog>(std::move(options)); }
+
+		AccessLog* access_log() { return logger.get(); }
+
+		// Serves metrics() at path in the Prometheus text format, labelling requests with the
+		// routes added before and after it alike
+		void add_metrics_route(std::string const& path = "/metrics") {
+			router.add_route(path, Methods::GET, [this](Captures const&, Methods, Connection::ptr con) {
+				con->make_response(200, "Content-Type: text/plain; version=0.0.4\r\n", stats.render(router.routes()));
+			});
+		}
+
+		// The event mechanism the contexts were built with, and how connections are accepted
+		// when built with BB_IO_URING, which falls back to asio where the kernel will not have it
+		static std::string io_backend() {
+#if defined(ASIO_HAS_IO_URING_AS_DEFAULT)
+			std::string name = "io_uring";
+#elif defined(ASIO_HAS_IOCP)
+			std::string name = "iocp";
+#elif defined(ASIO_HAS_EPOLL)
+			std::string name = "epoll";
+#elif defined(ASIO_HAS_KQUEUE)
+			std::string name = "kqueue";
+#else
+			std::string name = "select";
+#endif
+#if defined(BB_IO_URING)
+			name += " + io_uring multishot accept";
+#endif // defined(BB_IO_URING)
+			return name;
+		}
+
 		asio::io_context& context() { return io; }
 
+		// With PerThreadContext every thread started by run() has its own context.
+		// Otherwise there is a single shard and it is the shared context.
+		unsigned int shard_count() const { return static_cast<unsigned int>(shards.size()) + 1; }
+
+		asio::io_context& context(unsigned int shard) { return shard == 0 ? io : shards[shard - 1]->io; }
+
+		// Runs f on the thread that owns the given shard
+		template<typename F>
+		void post(unsigned int shard, F&& f) {
+			asio::post(context(shard % shard_count()), std::forward<F>(f));
+		}
+
 	private:
-		void do_accept() {
-			acceptor.async_accept([this](auto err, auto socket) {
-				if (!err) {
-					Connection::new_connection(std::move(socket), router)->start();
-					do_accept();
+		struct Shard {
+#if defined(BB_IO_URING)
+			Shard() : io(1), acceptor(io), ring(io) { wheel.start(io); }
+#else
+			Shard() : io(1), acceptor(io) { wheel.start(io); }
+#endif // defined(BB_IO_URING)
+			~Shard() { wheel.stop(); }
+
+			// The timeouts of the connections on this shard, before io for the same reason as the server's
+			TimerWheel wheel;
+			asio::io_context io;
+			asio::ip::tcp::acceptor acceptor;
+#if defined(BB_IO_URING)
+			UringAcceptor ring;
+#endif // defined(BB_IO_URING)
+		};
+
+		bool sharded() const { return (options & ServerOptions::PerThreadContext) == ServerOptions::PerThreadContext; }
+
+		// Looks for the last connections to be gone every so often, only while stopping
+		void watch_drain() {
+			drain_timer.expires_after(std::chrono::milliseconds(50));
+			drain_timer.async_wait([this](asio::error_code err) {
+				if (err || registry.size() == 0)
+					return;
+				if (std::chrono::steady_clock::now() < drain_deadline) {
+					watch_drain();
+					return;
+				}
+				registry.for_each([](std::shared_ptr<void> const& c) {
+					auto con = std::static_pointer_cast<Connection>(c);
+					asio::post(con->get_executor(), [con]() { con->close(); });
+				});
+			});
+		}
+
+#if defined(ASIO_HAS_LOCAL_SOCKETS)
+		void await_successor(std::string path) {
+			handoff->async_accept([this, path](asio::error_code err, asio::local::stream_protocol::socket successor) {
+				if (err)
+					return;
+				// One that went away before taking the socket does not count
+				if (!send_fd(successor.native_handle(), acceptor.native_handle())) {
+					await_successor(path);
+					return;
+				}
+				::unlink(path.c_str());
+				std::cerr << "handed over, stopping... ";
+				stop();
+			});
+		}
+#endif // defined(ASIO_HAS_LOCAL_SOCKETS)
+
+		void open_acceptor(asio::ip::tcp::acceptor& acc, asio::ip::tcp::endpoint const& endpoint) {
+			acc.open(endpoint.protocol());
+			acc.set_option(asio::socket_base::reuse_address(true));
+#if defined(SO_REUSEPORT)
+			if (sharded()) {
+				acc.set_option(asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>(true));
+			}
+#endif // defined(SO_REUSEPORT)
+			acc.bind(endpoint);
+			acc.listen();
+		}
+
+		void pin_thread(unsigned int i) {
+#if defined(__linux__)
+			if ((options & ServerOptions::PinThreads) == ServerOptions::PinThreads) {
+				cpu_set_t cpus;
+				CPU_ZERO(&cpus);
+				CPU_SET(i % std::thread::hardware_concurrency(), &cpus);
+				pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+			}
+#endif // defined(__linux__)
+		}
+
+		// Calls f once the server has room for another connection, as long as acc is open
+		template<typename F>
+		void when_not_full(asio::io_context& ctx, asio::ip::tcp::acceptor& acc, F f) {
+			// Only while the server is full, so the allocation does not matter
+			auto retry = std::make_shared<asio::steady_timer>(ctx, conn_limits.accept_retry);
+			retry->async_wait([this, &ctx, &acc, retry, f{ std::move(f) }](asio::error_code) mutable {
+				if (!acc.is_open())
+					return;
+				if (full())
+					when_not_full(ctx, acc, std::move(f));
+				else
+					f();
+			});
+		}
+
+		bool full() const { return stats.connections.load(std::memory_order_relaxed) >= conn_limits.max_connections; }
+
+		void add_connection(Connection::socket_type socket, TimerWheel& tw) {
+			// Past the limit the socket is closed as it goes out of scope
+			if (stats.connections.fetch_add(1, std::memory_order_relaxed) < conn_limits.max_connections) {
+				Connection::new_connection(std::move(socket), router, conn_limits, &tw, &stats, logger.get(), &registry)->start();
+			}
+			else {
+				stats.connections.fetch_sub(1, std::memory_order_relaxed);
+				if (logger) {
+					logger->error("connection refused, max_connections reached");
+				}
+			}
+		}
+
+		void accept_error(asio::error_code err) {
+			if (err.value() == asio::error::operation_aborted) {
+				std::cerr << "Stopped\n";
+			}
+			else if (logger) {
+				logger->error(err.message());
+			}
+			else {
+				std::cerr << err.message() << '\n';
+			}
+		}
+
+		void do_accept(asio::io_context& ctx, asio::ip::tcp::acceptor& acc, TimerWheel& tw) {
+			if (full()) {
+				when_not_full(ctx, acc, [this, &ctx, &acc, &tw]() { do_accept(ctx, acc, tw); });
+				return;
+			}
+			// Each connection gets its own strand, so handlers that answer from another thread are safe
+			acc.async_accept(asio::make_strand(ctx), [this, &ctx, &acc, &tw](asio::error_code err, Connection::socket_type socket) {
+				if (err) {
+					accept_error(err);
+					return;
+				}
+				add_connection(std::move(socket), tw);
+				do_accept(ctx, acc, tw);
+			});
+		}
+
+#if defined(BB_IO_URING)
+		// One multishot accept on ring for as long as acc is open, paused while the server is
+		// full. Where the kernel cannot do it, accepting goes on with do_accept().
+		void ring_accept(asio::io_context& ctx, asio::ip::tcp::acceptor& acc, UringAcceptor& ring, TimerWheel& tw) {
+			auto protocol = acc.local_endpoint().protocol();
+			bool started = ring.start(acc.native_handle(), [this, &ctx, &acc, &ring, &tw, protocol](asio::error_code err, int fd) {
+				if (err) {
+					if (err == asio::error::operation_not_supported)
+						do_accept(ctx, acc, tw);
+					else
+						accept_error(err);
+					return;
+				}
+				Connection::socket_type socket(asio::make_strand(ctx));
+				socket.assign(protocol, fd, err);
+				if (err) {
+					::close(fd);
+					accept_error(err);
 				}
 				else {
-					if (err.value() == asio::error::operation_aborted) {
-						std::cerr << "Stopped\n";
-					}
-					else {
-						std::cerr << err.message() << '\n';
-					}
+					add_connection(std::move(socket), tw);
+				}
+				if (full()) {
+					ring.pause();
+					when_not_full(ctx, acc, [&ring]() { ring.resume(); });
 				}
 			});
+			if (!started)
+				do_accept(ctx, acc, tw);
 		}
+#endif // defined(BB_IO_URING)
 
+		ServerOptions options;
+		// Before the contexts, since connections still in them at the end use these on the way out
+		Metrics stats;
+		std::unique_ptr<AccessLog> logger;
+		ConnectionRegistry registry;
+		Router router;
+		Limits conn_limits;
+		// The timeouts of the connections on the shared context
+		TimerWheel wheel;
 		asio::io_context io;
 		asio::signal_set signals;
 		asio::ip::tcp::acceptor acceptor;
+#if defined(BB_IO_URING)
+		UringAcceptor ring;
+#endif // defined(BB_IO_URING)
+#if defined(ASIO_HAS_LOCAL_SOCKETS)
+		std::unique_ptr<asio::local::stream_protocol::acceptor> handoff;
+#endif // defined(ASIO_HAS_LOCAL_SOCKETS)
+		asio::steady_timer drain_timer;
+		std::vector<std::function<void()>> stop_hooks;
+		std::chrono::steady_clock::time_point drain_deadline;
+		std::vector<std::unique_ptr<Shard>> shards;
 		std::vector<std::thread> run_pool;
-		Router router;
 	}; // class Server
 } // namespace bb
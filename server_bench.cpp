@@ -0,0 +1,88 @@
+// Throughput of the shared io_context against one context per thread.
+// Runs a local Server in each mode and hammers it with keep-alive GETs from blocking clients,
+// then with a new connection for every GET, which is mostly accepting.
+//   server_bench [threads] [connections] [seconds]
+// Numbers are only meaningful on a machine with at least as many cores as threads + clients.
+// The event mechanism the build uses is printed with them, see Server::io_backend(). To set
+// io_uring against epoll on the same load, build it both ways and run both with the same
+// arguments:
+//   g++ -std=c++17 -O2 server_bench.cpp -o server_bench -lpthread
+//   g++ -std=c++17 -O2 -DBB_IO_URING server_bench.cpp -o server_bench_uring -lpthread
+
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define ASIO_STANDALONE 1
+#define ASIO_NO_DEPRECATED 1
+
+#include "server.hpp"
+
+using namespace bb;
+
+static double requests_per_second(ServerOptions options, unsigned int threads, unsigned int connections, unsigned int seconds, bool reconnect = false) {
+	Server s(0, options);
+	s.add_route("/", Methods::GET, [](Captures const&, Methods, Connection::ptr con) {
+		con->make_response(200, "", "ok\n");
+	});
+	std::thread server_thread([&s, threads]() { s.run(threads); });
+	std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+	std::atomic<bool> done{ false };
+	std::atomic<unsigned long> count{ 0 };
+	std::vector<std::thread> clients;
+	for (unsigned int i = 0; i < connections; ++i) {
+		clients.emplace_back([&]() {
+			static const std::string req = "GET / HTTP/1.1\r\nHost: localhost\r\n\r\n";
+			asio::io_context io;
+			asio::ip::tcp::socket sock(io);
+			sock.connect({ asio::ip::address_v4::loopback(), s.port() });
+			asio::streambuf in;
+			unsigned long n = 0;
+			while (!done) {
+				if (reconnect && n > 0) {
+					sock.close();
+					sock.connect({ asio::ip::address_v4::loopback(), s.port() });
+				}
+				asio::write(sock, asio::buffer(req));
+				auto head = asio::read_until(sock, in, "\r\n\r\n");
+				in.consume(head);
+				// The body is "ok\n"
+				if (in.size() < 3)
+					asio::read(sock, in, asio::transfer_at_least(3 - in.size()));
+				in.consume(3);
+				++n;
+			}
+			count += n;
+		});
+	}
+
+	std::this_thread::sleep_for(std::chrono::seconds(seconds));
+	done = true;
+	for (auto& c : clients) {
+		c.join();
+	}
+	s.stop();
+	server_thread.join();
+	return double(count) / seconds;
+}
+
+int main(int argc, char* argv[])
+{
+	unsigned int threads = argc > 1 ? std::stoul(argv[1]) : std::thread::hardware_concurrency();
+	unsigned int connections = argc > 2 ? std::stoul(argv[2]) : 4 * threads;
+	unsigned int seconds = argc > 3 ? std::stoul(argv[3]) : 5;
+
+	auto shared = requests_per_second(ServerOptions::None, threads, connections, seconds);
+	auto per_thread = requests_per_second(ServerOptions::PerThreadContext | ServerOptions::PinThreads, threads, connections, seconds);
+	auto reconnecting = requests_per_second(ServerOptions::PerThreadContext | ServerOptions::PinThreads, threads, connections, seconds, true);
+	std::cout << threads << " threads, " << connections << " connections on " << Server::io_backend() << '\n'
+		<< "shared context:     " << shared << " req/s\n"
+		<< "context per thread: " << per_thread << " req/s\n"
+		<< "connection per GET: " << reconnecting << " req/s\n";
+
+	return 0;
+}
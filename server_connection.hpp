@@ -1,20 +1,37 @@
 #pragma once
 
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <charconv>
 #include <chrono>
+#include <cstdint>
+#include <exception>
+#include <functional>
 #include <iostream>
 #include <memory>
-#include <regex>
+#include <optional>
 #include <sstream>
 #include <string>
+#include <string_view>
+#include <utility>
 #include <vector>
 
+#if defined(__linux__)
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/sendfile.h>
+#endif // defined(__linux__)
+
 #include "asio.hpp"
 
+#include "access_log.hpp"
 #include "connection_base.hpp"
+#include "connection_registry.hpp"
+#include "response.hpp"
+#include "router.hpp"
 
 namespace bb {
-	class Router;
-
 	class Connection : public http_connection_base<Connection>
 	{
 	public:
@@ -23,76 +40,519 @@ namespace bb {
 			return std::shared_ptr<Connection>(new Connection(std::forward<T>(all)...));
 		}
 
-		void start() { get_req(); }
+		void start() {
+			if (logger) {
+				asio::error_code ec;
+				peer = socket.remote_endpoint(ec).address();
+			}
+			if (registry) {
+				entry.init(registry, weak_from_this());
+				// Accepted as the server stops, so it gets to make the one request
+				draining = registry->draining();
+			}
+			start_timer();
+			get_req();
+		}
 
-		template<typename T>
-		auto send_response(T resp) -> decltype(asio::buffer(resp), std::enable_if_t<!asio::is_const_buffer_sequence<T>::value>()) {
-			auto ptr = std::make_unique<T>(std::move(resp));
-			auto buf = asio::buffer(*ptr);
-			asio::async_write(socket, buf, [this, self{ shared_from_this() }, ptr{ std::move(ptr) }](auto ec, auto) {
-				if (handle_error(ec)) {
-					get_req(); // reuse connection
-				}
-			});
+		~Connection() {
+			if (admitted) {
+				admitted->abandon();
+			}
+			if (metrics) {
+				metrics->connections.fetch_sub(1, std::memory_order_relaxed);
+			}
 		}
 
-		void send_response(asio::streambuf resp) {
-			auto ptr = std::make_unique<asio::streambuf>(std::move(resp));
-			auto& buf = *ptr;
-			asio::async_write(socket, buf, [this, self{ shared_from_this() }, ptr{ std::move(ptr) }](auto ec, auto) {
-				if (handle_error(ec)) {
-					get_req(); // reuse connection
+		// Responses are queued and written in order. Those made while requests that were
+		// pipelined behind them are still being handled go out together in one write.
+		// Safe to call from any thread, the work is done on the connection's strand.
+		void send_response(Response resp) {
+			asio::dispatch(socket.get_executor(), [this, self{ shared_from_this() }, resp{ std::move(resp) }]() mutable {
+				auto policy = std::exchange(caching, nullptr);
+				auto encoder = std::exchange(encoding, nullptr);
+				bool by_encoding = encoder && encoder->encode(rcv_headers, resp);
+				if (policy) {
+					store(*policy, resp, by_encoding);
+				}
+				else {
+					add_vary(resp, nullptr, by_encoding);
+					resp.finish();
+				}
+				resp.head_only = method == "HEAD";
+				served = true;
+				if (draining) {
+					closing = true;
+					resp.close_after();
+				}
+				count_request(resp.status(), resp.head_only ? 0 : resp.body_size());
+				// With the rest of the body unread there is no finding where the next request starts
+				if (!body_decoder.done()) {
+					closing = true;
+				}
+				out_queue.push_back(std::move(resp));
+				awaiting_response = false;
+				if (!dispatching) {
+					get_req();
 				}
 			});
 		}
 
+		// Starts a response whose body is sent a piece at a time with send_chunk(), so it can go
+		// out before all of it exists, e.g. server-sent events. Without a length the body is sent
+		// with chunked transfer coding. With one it is sent as is and the chunks must add up to it.
+		// ready(asio::error_code) is called every time the stream can take another chunk: once
+		// the head has been written and again after each chunk has drained to the socket. After
+		// an error the stream is over and ready is not called again.
+		// Only the head of resp is sent. Unlike send_response(), this and the other stream
+		// functions must be called on the connection's executor.
+		void start_stream(Response resp, std::function<void(asio::error_code)> ready, std::optional<std::uint64_t> length = std::nullopt) {
+			// Streams are neither cached nor encoded
+			caching = nullptr;
+			encoding = nullptr;
+			stream_length = length;
+			stream_sent = 0;
+			stream_head_only = method == "HEAD";
+			count_request(resp.status(), stream_head_only ? 0 : length.value_or(0));
+			if (length) {
+				resp.finish(*length);
+			}
+			else {
+				resp.finish_chunked();
+			}
+			served = true;
+			if (draining) {
+				closing = true;
+				resp.close_after();
+			}
+			resp.owned = std::monostate();
+			if (!body_decoder.done()) {
+				closing = true;
+			}
+			stream_ready = std::move(ready);
+			streaming = true;
+			chunk_pending = true;
+			crlf_due = false;
+			out_queue.push_back(std::move(resp));
+			flush();
+		}
+
+		// Returns false, and takes nothing, while the previous chunk has not drained yet, or if
+		// the chunk would go past the length the stream was started with
+		bool send_chunk(std::string data) {
+			Response chunk;
+			chunk.body(std::move(data));
+			return queue_chunk(std::move(chunk));
+		}
+
+		// The caller keeps data alive until ready is called
+		bool send_chunk_ref(asio::const_buffer data) {
+			Response chunk;
+			chunk.body_ref(data);
+			return queue_chunk(std::move(chunk));
+		}
+
+		// Ends the body. The next request is handled once the end has been written.
+		void end_stream() {
+			if (!streaming)
+				return;
+			streaming = false;
+			Response last;
+			if (!stream_length && !stream_head_only) {
+				last.head = crlf_due ? "\r\n0\r\n\r\n" : "0\r\n\r\n";
+			}
+			else if (stream_length && stream_sent != *stream_length) {
+				// the client would be left waiting for the rest
+				closing = true;
+			}
+			last.head_only = stream_head_only;
+			stream_ending = true;
+			out_queue.push_back(std::move(last));
+			flush();
+		}
+
+		// Gives up on a stream whose body cannot be finished, e.g. because its source failed.
+		// The connection is closed, so the client sees the body cut short rather than taking
+		// what it got for all of it.
+		void abort_stream() {
+			if (!streaming)
+				return;
+			streaming = false;
+			close();
+		}
+
 		void make_response(int status, std::string const& headers, std::string const& body) {
-			asio::streambuf resp_buf;
-			std::ostream os(&resp_buf);
-			os << "HTTP/1.1 " << status << " STAT\r\nContent-Length: " << body.size() << "\r\n" << headers << "\r\n" << body;
-			send_response(std::move(resp_buf));
+			Response resp(status);
+			resp.headers(headers).body(std::string_view(body));
+			send_response(std::move(resp));
+		}
+
+		void make_response(int status, std::string const& headers, std::string&& body) {
+			Response resp(status);
+			resp.headers(headers).body(std::move(body));
+			send_response(std::move(resp));
 		}
 
 		void make_response(int status, HeaderMap const& headers, std::string const& body) {
-			make_response(status, headers_string(headers), body);
+			auto resp = with_headers(status, headers);
+			resp.body(std::string_view(body));
+			send_response(std::move(resp));
 		}
 
 		void make_response(int status, std::string const& headers, DATA const& body) {
-			asio::streambuf resp_buf;
-			std::ostream os(&resp_buf);
-			os << "HTTP/1.1 " << status << " STAT\r\nContent-Length: " << body.size() << "\r\n" << headers << "\r\n";
-			std::ostreambuf_iterator<DATA::value_type> it(&resp_buf);
-			std::copy(body.cbegin(), body.cend(), it);
-			send_response(std::move(resp_buf));
+			Response resp(status);
+			resp.headers(headers).body(body);
+			send_response(std::move(resp));
+		}
+
+		void make_response(int status, std::string const& headers, DATA&& body) {
+			Response resp(status);
+			resp.headers(headers).body(std::move(body));
+			send_response(std::move(resp));
 		}
 
 		void make_response(int status, HeaderMap const& headers, DATA const& body) {
-			make_response(status, headers_string(headers), body);
+			auto resp = with_headers(status, headers);
+			resp.body(body);
+			send_response(std::move(resp));
+		}
+
+		// Decodes %XX escapes. The decoded URI is never longer than the encoded one, so it is
+		// written straight into the arena.
+		static std::string_view url_decode(std::string_view url, Arena& arena) {
+			auto dec = static_cast<char*>(arena.allocate(url.length() ? url.length() : 1, 1));
+			auto d = dec;
+			auto pe = url.end();
+			for (auto p = url.begin(); p != pe; ++p) {
+				if (*p == '%' && pe - p > 2) {
+					char c = from_hex(*++p) << 4;
+					c |= from_hex(*++p);
+					*d++ = c;
+				}
+				else {
+					*d++ = *p;
+				}
+			}
+			return std::string_view(dec, d - dec);
 		}
 
 	private:
 		friend http_connection_base<Connection>;
+		friend Router;
+		friend class Server;
 
-		Connection(asio::ip::tcp::socket socket, Router const& router) : http_connection_base(std::move(socket)), router(router) { }
+#if defined(ASIO_HAS_CO_AWAIT)
+		// Runs a coroutine handler. One that fails before it has responded is answered with 500.
+		void spawn(asio::awaitable<void> handler) {
+			asio::co_spawn(socket.get_executor(), std::move(handler), [this, self{ shared_from_this() }](std::exception_ptr e) {
+				if (!e)
+					return;
+				try {
+					std::rethrow_exception(e);
+				}
+				catch (std::exception const& ex) {
+					report(ex.what());
+				}
+				catch (...) {
+				}
+				if (awaiting_response && !stream_ready) {
+					closing = true;
+					respond(500);
+				}
+			});
+		}
+#endif // defined(ASIO_HAS_CO_AWAIT)
+
+		// With metrics the connection is counted in them, and leaves Metrics::connections when it is gone.
+		// With a logger its responses and errors are logged.
+		// With a registry it is in it from start() on, so it can be drained.
+		Connection(socket_type socket, Router const& router, Limits const& limits = Limits::defaults(), TimerWheel* wheel = nullptr, Metrics* metrics = nullptr, AccessLog* logger = nullptr, ConnectionRegistry* registry = nullptr)
+		  : http_connection_base(std::move(socket), HttpParser::Kind::Request, limits, wheel), router(router), logger(logger), registry(registry) {
+			this->metrics = metrics;
+		}
+
+		// Finishes the request the connection is on and closes it after the response, which
+		// says Connection: close. One waiting for its next request is closed right away.
+		void drain() {
+			draining = true;
+			if (between_requests()) {
+				close();
+			}
+		}
+
+		// Waiting for the next request, with every response written. A request that has begun
+		// to arrive, or the first one of a new connection, is waited for instead, since the
+		// client could not tell whether it was handled.
+		bool between_requests() const {
+			return served && !awaiting_response && !writing && out_queue.empty() && buf_in.size() == 0;
+		}
+
+		// Called once per request as its response is given, whether by a handler or by the
+		// connection refusing the request
+		void count_request(int status, std::uint64_t bytes) {
+			if (!metrics && !logger && !admitted)
+				return;
+			auto took = awaiting_response ? Metrics::clock::now() - handler_start : Metrics::clock::duration();
+			if (admitted) {
+				std::exchange(admitted, nullptr)->leave(took);
+			}
+			if (metrics) {
+				metrics->request(route ? route->id : Metrics::no_route, status);
+				if (awaiting_response)
+					metrics->latency(Metrics::Latency::Handler, took);
+			}
+			if (logger) {
+				logger->access(peer, method, uri, parser.minor_version(), status, bytes, took);
+			}
+		}
+
+		// To the log if there is one. Otherwise standard error, which takes a lock.
+		void report(std::string_view message) {
+			if (logger) {
+				logger->error(message, peer);
+			}
+			else {
+				std::cerr << message << '\n';
+			}
+		}
 
+		// Handles every request that is already complete in buf_in before flushing the
+		// responses, and only reads from the socket when none is left.
 		void get_req() {
-			asio::async_read_until(socket, buf_in, "\r\n", [this, self{ shared_from_this() }](auto ec, auto) {
-				if (handle_error(ec)) {
-					std::istream is(&buf_in);
-					std::string line;
-					std::getline(is, line);
-
-					std::smatch parts;
-					if (std::regex_match(line, parts, re_req)) {
-						method = parts[1];
-						uri = url_decode(parts[2]);
-						get_headers();
-					}
-					else {
-						// not HTTP, just close connection
-					}
+			if (in_get_req) {
+				again = true;
+				return;
+			}
+			in_get_req = true;
+			do {
+				again = false;
+				if (closing)
+					break;
+				if (out_queue.size() >= max_queued) {
+					// resumed once the queued responses are written
+					stalled = true;
+					break;
 				}
-			});
+				next_message();
+				if (draining && between_requests()) {
+					closing = true;
+					break;
+				}
+				parse_head();
+			} while (again);
+			in_get_req = false;
+			flush();
+		}
+
+		bool queue_chunk(Response chunk) {
+			auto n = chunk.body_size();
+			if (!streaming || chunk_pending || (stream_length && *stream_length - stream_sent < n))
+				return false;
+			stream_sent += n;
+			if (!stream_length && !stream_head_only && n) {
+				// The line break that ends the previous chunk goes in front of this one's size
+				char num[20];
+				auto end = std::to_chars(num, num + sizeof(num), n, 16).ptr;
+				if (crlf_due) {
+					chunk.head += "\r\n";
+				}
+				chunk.head.append(num, end);
+				chunk.head += "\r\n";
+				crlf_due = true;
+			}
+			chunk.head_only = stream_head_only;
+			chunk_pending = true;
+			out_queue.push_back(std::move(chunk));
+			flush();
+			return true;
+		}
+
+		// Refers to out_bufs, where passing the vector itself would copy it into the write operation
+		struct BufferRange {
+			typedef asio::const_buffer value_type;
+			typedef asio::const_buffer const* const_iterator;
+
+			const_iterator first;
+			const_iterator last;
+
+			const_iterator begin() const { return first; }
+			const_iterator end() const { return last; }
+		};
+
+		void flush() {
+			if (writing || out_queue.empty())
+				return;
+			if (!socket.is_open()) {
+				// closed by a timeout, there is no one left to answer
+				out_queue.clear();
+				fail_stream(asio::error::not_connected);
+				return;
+			}
+			writing = true;
+			if (metrics)
+				write_start = Metrics::clock::now();
+			out_flight.swap(out_queue);
+			// Whether this write takes the pending chunk of a stream, or the end of one
+			flight_drains_chunk = chunk_pending;
+			flight_ends_stream = stream_ending;
+			stream_ending = false;
+			write_from(0);
+		}
+
+		// Writes out_flight from first on in one gather, up to the first body that is a file.
+		// That one goes with sendfile() once the heads before it are out.
+		void write_from(std::size_t first) {
+			out_bufs.clear();
+			auto next = first;
+			auto file_at = out_flight.size();
+			for (; next < out_flight.size() && file_at == out_flight.size(); ++next) {
+				auto& r = out_flight[next];
+				out_bufs.push_back(r.head_buffer());
+				if (r.head_only)
+					continue;
+				if (r.file()) {
+					file_at = next;
+				}
+				else {
+					out_bufs.push_back(r.body_buffer());
+				}
+			}
+			if (file_at < out_flight.size()) {
+				cork(true);
+			}
+			time_write(true);
+			// Every bit of progress puts the write timeout back
+			auto progress = [this](asio::error_code const& ec, std::size_t n) -> std::size_t {
+				if (ec)
+					return 0;
+				if (n)
+					time_write(true);
+				return 65536;
+			};
+			asio::async_write(socket, BufferRange{ out_bufs.data(), out_bufs.data() + out_bufs.size() }, progress, alloc_handler(write_mem, [this, self{ shared_from_this() }, file_at, next](auto ec, auto n) {
+				if (metrics)
+					metrics->sent(n);
+				if (ec) {
+					write_done(ec);
+				}
+				else if (file_at < out_flight.size()) {
+					send_file(file_at, next);
+				}
+				else if (next < out_flight.size()) {
+					write_from(next);
+				}
+				else {
+					write_done(ec);
+				}
+			}));
+		}
+
+		// Sends as much of the file as the socket takes, then waits for it to take more
+		void send_file(std::size_t at, std::size_t next) {
+#if defined(__linux__)
+			auto& f = *out_flight[at].file();
+			asio::error_code ec;
+			socket.native_non_blocking(true, ec);
+			while (!ec && f.length) {
+				auto off = static_cast<off_t>(f.offset);
+				auto n = ::sendfile(socket.native_handle(), f.fd, &off, static_cast<std::size_t>(std::min<std::uint64_t>(f.length, 1 << 30)));
+				if (n > 0) {
+					f.offset += n;
+					f.length -= n;
+					if (metrics)
+						metrics->sent(static_cast<std::size_t>(n));
+				}
+				else if (n < 0 && errno == EAGAIN) {
+					time_write(true);
+					socket.async_wait(asio::socket_base::wait_write, alloc_handler(write_mem, [this, self{ shared_from_this() }, at, next](auto ec) {
+						if (ec) {
+							write_done(ec);
+						}
+						else {
+							send_file(at, next);
+						}
+					}));
+					return;
+				}
+				else if (n < 0 && errno != EINTR) {
+					ec.assign(errno, asio::error::get_system_category());
+				}
+				else if (n == 0) {
+					// the file has been cut short since its length was sent
+					ec = asio::error::eof;
+				}
+			}
+			cork(false);
+			if (ec) {
+				write_done(ec);
+			}
+			else if (next < out_flight.size()) {
+				write_from(next);
+			}
+			else {
+				write_done(ec);
+			}
+#else
+			write_done(asio::error::operation_not_supported);
+#endif // defined(__linux__)
+		}
+
+		// Holds back partial segments while the head and the file that follows it go out in
+		// separate calls, so a small file does not wait out Nagle and a delayed ACK
+		void cork(bool on) {
+#if defined(__linux__)
+			int v = on;
+			::setsockopt(socket.native_handle(), IPPROTO_TCP, TCP_CORK, &v, sizeof(v));
+#endif // defined(__linux__)
+		}
+
+		// Tells a stream's source that it is over, since ready would not be called again
+		void fail_stream(asio::error_code ec) {
+			if (!stream_ready)
+				return;
+			streaming = false;
+			auto ready = std::move(stream_ready);
+			stream_ready = nullptr;
+			ready(ec);
+		}
+
+		void write_done(asio::error_code ec) {
+			writing = false;
+			out_flight.clear();
+			time_write(false);
+			if (metrics)
+				metrics->latency(Metrics::Latency::Write, Metrics::clock::now() - write_start);
+			if (ec) {
+				if (ec != asio::error::operation_aborted) {
+					report(ec.message());
+				}
+				fail_stream(ec);
+				return;
+			}
+			if (flight_ends_stream) {
+				// Let go of ready, and whatever it holds on to, before moving on to the next request
+				stream_ready = nullptr;
+				chunk_pending = false;
+				awaiting_response = false;
+				get_req();
+				return;
+			}
+			if (flight_drains_chunk) {
+				chunk_pending = false;
+				if (streaming) {
+					stream_ready(asio::error_code());
+				}
+			}
+			if (stalled) {
+				stalled = false;
+				get_req();
+			}
+			else if (draining && between_requests()) {
+				// Drained while this went out, the connection is waiting for a request that will not be served
+				close();
+			}
+			else {
+				flush();
+			}
 		}
 
 		static char from_hex(char c) {
@@ -102,24 +562,184 @@ namespace bb {
 			return 0;
 		}
 
-		static std::string url_decode(std::string const& url) {
-			std::string dec;
-			dec.reserve(url.length());
-			auto pe = url.end();
-			for (auto p = url.begin(); p != pe; ++p) {
-				if (*p == '%') {
-					char c = from_hex(*++p) << 4;
-					c |= from_hex(*++p);
-					dec += c;
+		// Content-Length is always set by the response itself, so a copied one is left out
+		static Response with_headers(int status, HeaderMap const& headers) {
+			Response resp(status);
+			auto length = headers.find("content-length");
+			for (auto it = headers.begin(); it != headers.end(); ++it) {
+				if (it != length) {
+					resp.header(it->name, it->value);
 				}
-				else {
-					dec += *p;
+			}
+			return resp;
+		}
+
+		void handle_head() {
+			method = parser.method();
+			uri = url_decode(parser.target(), arena);
+			route = router.find_route(uri, method_from_name(method), caps);
+			// HTTP/1.0 clients only keep the connection open if they ask to
+			if (parser.minor_version() == 0 ? !rcv_headers.has_token(KnownHeader::Connection, "keep-alive") : rcv_headers.has_token(KnownHeader::Connection, "close")) {
+				closing = true;
+			}
+			if (!start_body())
+				return;
+			if (route && (route->options & RouteOptions::StreamBody) == RouteOptions::StreamBody) {
+				handle_body();
+			}
+			else {
+				get_body();
+			}
+		}
+
+		// Hands the request to its route, with the body read or, for a streaming route, still to come
+		void handle_body() {
+			if (metrics || logger || (route && route->gate))
+				handler_start = Metrics::clock::now();
+			awaiting_response = true;
+			dispatching = true;
+			caching = nullptr;
+			encoding = route ? route->encoder.get() : nullptr;
+			if (route) {
+				if ((!route->cache || !from_cache()) && admit()) {
+					call_handler();
 				}
 			}
-			return dec;
+			else {
+				make_test_response();
+			}
+			dispatching = false;
+			// The handler has answered already, so the next request can be handled right away.
+			// Otherwise its response will pick things up from here when it is sent.
+			if (!awaiting_response) {
+				get_req();
+			}
 		}
 
-		void handle_body();
+		// On the route's offload pool if it has one, which leaves the I/O thread to the other
+		// connections. The captures stay as they are until the response is given.
+		void call_handler() {
+			auto m = method_from_name(method);
+			if (!route->offload) {
+				route->handler(caps, m, shared_from_this());
+				return;
+			}
+			if (metrics)
+				metrics->offload_queued.fetch_add(1, std::memory_order_relaxed);
+			route->offload->submit([this, self{ shared_from_this() }, ep{ route }, m, queued{ handler_start }]() {
+				if (metrics) {
+					metrics->offload_queued.fetch_sub(1, std::memory_order_relaxed);
+					metrics->latency(Metrics::Latency::Offload, Metrics::clock::now() - queued);
+				}
+				ep->handler(caps, m, self);
+			});
+		}
+
+		// Refuses the request if the route's limits say so. The refusals are made up front, so
+		// they cost next to nothing. Answers from the cache are not limited.
+		bool admit() {
+			if (!route->gate)
+				return true;
+			auto verdict = route->gate->enter(handler_start);
+			if (verdict == RouteGate::Verdict::Admit) {
+				admitted = route->gate.get();
+				return true;
+			}
+			static const char busy[] = "HTTP/1.1 503 Service Unavailable\r\nRetry-After: 1\r\nContent-Length: 0\r\n\r\n";
+			static const char limited[] = "HTTP/1.1 429 Too Many Requests\r\nRetry-After: 1\r\nContent-Length: 0\r\n\r\n";
+			caching = nullptr;
+			encoding = nullptr;
+			if (verdict == RouteGate::Verdict::Busy) {
+				send_response(Response::serialized(503, asio::buffer(busy, sizeof(busy) - 1), asio::const_buffer(), nullptr));
+			}
+			else {
+				send_response(Response::serialized(429, asio::buffer(limited, sizeof(limited) - 1), asio::const_buffer(), nullptr));
+			}
+			return false;
+		}
+
+		// Answers from the route's cache if it has the response. On a miss for a GET, the
+		// response the handler sends is stored.
+		bool from_cache() {
+			auto m = method_from_name(method);
+			if (m != Methods::GET && m != Methods::HEAD)
+				return false;
+			auto& policy = *route->cache;
+			policy.make_key(cache_key, uri, rcv_headers);
+			if (route->encoder) {
+				cache_key += '\n';
+				cache_key += route->encoder->coding(rcv_headers);
+			}
+			auto entry = policy.cache->find(cache_key);
+			if (!entry) {
+				if (m == Methods::GET) {
+					caching = &policy;
+				}
+				return false;
+			}
+			encoding = nullptr;
+			if (not_modified(entry->etag)) {
+				Response resp(304);
+				resp.header("ETag", entry->etag);
+				send_response(std::move(resp));
+			}
+			else {
+				auto& d = entry->data;
+				send_response(Response::serialized(200, asio::buffer(d.data(), entry->head_size), asio::buffer(d.data() + entry->head_size, d.size() - entry->head_size), entry));
+			}
+			return true;
+		}
+
+		// Finishes the response to a cache miss and keeps a copy of it, if it may be kept.
+		// It gets an ETag unless it has one already, so it can be revalidated.
+		void store(CachePolicy const& policy, Response& resp, bool by_encoding) {
+			add_vary(resp, &policy, by_encoding);
+			auto cc = resp.header_value("Cache-Control");
+			if (resp.status() != 200 || resp.file() || cc.find("no-store") != std::string_view::npos || cc.find("private") != std::string_view::npos) {
+				resp.finish();
+				return;
+			}
+			auto entry = std::make_shared<ResponseCache::Entry>();
+			auto body = resp.body_buffer();
+			entry->etag = resp.header_value("ETag");
+			if (entry->etag.empty()) {
+				entry->etag = ResponseCache::make_etag(std::string_view(static_cast<const char*>(body.data()), body.size()));
+				resp.header("ETag", entry->etag);
+			}
+			resp.finish();
+			entry->head_size = resp.head.size();
+			entry->data.reserve(resp.head.size() + body.size());
+			entry->data.append(resp.head).append(static_cast<const char*>(body.data()), body.size());
+			entry->expires = ResponseCache::clock::now() + policy.ttl;
+			policy.cache->insert(cache_key, entry);
+
+			if (not_modified(entry->etag)) {
+				resp = Response(304);
+				resp.header("ETag", entry->etag);
+				resp.finish();
+			}
+		}
+
+		// Lists the request headers the response was chosen by, unless the handler has already
+		static void add_vary(Response& resp, CachePolicy const* policy, bool by_encoding) {
+			if ((!by_encoding && (!policy || policy->vary.empty())) || !resp.header_value("Vary").empty())
+				return;
+			std::string vary;
+			if (policy) {
+				for (auto& name : policy->vary) {
+					vary += vary.empty() ? "" : ", ";
+					vary += name;
+				}
+			}
+			if (by_encoding) {
+				vary += vary.empty() ? "Accept-Encoding" : ", Accept-Encoding";
+			}
+			resp.header("Vary", vary);
+		}
+
+		bool not_modified(std::string_view etag) const {
+			return rcv_headers.get(KnownHeader::IfNoneMatch) == "*" || rcv_headers.has_token(KnownHeader::IfNoneMatch, etag);
+		}
 
 		void respond(int stat) {
 			make_response(stat, "", "");
@@ -131,21 +751,58 @@ namespace bb {
 			if (err == asio::error::eof)
 				return true;
 			if (err != asio::error::operation_aborted) {
+				closing = true;
 				respond(500);
-				std::cerr << err.message() << '\n';
+				report(err.message());
 			}
 			return false;
 		}
 
-		void handle_parse_error() {
-			respond(400);
+		// 400, or 431 for a head over the limits
+		void handle_parse_error(int status = 400) {
+			// there is no telling where the next request would start
+			closing = true;
+			route = nullptr;
+			method = uri = std::string_view();
+			respond(status);
+		}
+
+		// A client that has gone quiet is dropped. One that stopped halfway through a request
+		// is told so first, unless a response is on its way, which a 408 would cut into.
+		void handle_timeout(Wait what) {
+			// Idle keep-alive connections closing is business as usual
+			if (logger && what != Wait::Idle) {
+				logger->error(what == Wait::Write ? "write timed out" : "request timed out", peer);
+			}
+			if ((what == Wait::Head || what == Wait::Body) && !writing && out_queue.empty()) {
+				static const char timed_out[] = "HTTP/1.1 408 Request Timeout\r\nConnection: close\r\nContent-Length: 0\r\n\r\n";
+				asio::error_code ec;
+				socket.non_blocking(true, ec);
+				socket.write_some(asio::buffer(timed_out, sizeof(timed_out) - 1), ec);
+			}
+			close();
+		}
+
+		// Cancels whatever is pending, so the connection goes away once the handlers holding it have run
+		void close() {
+			closing = true;
+			read_deadline = write_deadline = TimerWheel::clock::time_point::max();
+			timer.cancel();
+			asio::error_code ec;
+			socket.shutdown(asio::socket_base::shutdown_both, ec);
+			socket.close(ec);
+		}
+
+		void handle_body_error(BodyDecoder::Result res) {
+			closing = true;
+			respond(res == BodyDecoder::Result::TooLarge ? 413 : 400);
 		}
 
 		void make_test_response() {
 			std::ostringstream os;
 			os << method << ' ' << uri << '\n';
 			for (const auto& h : rcv_headers) {
-				os << h.first << " = " << h.second << '\n';
+				os << h.name << " = " << h.value << '\n';
 			}
 			os << "Body length: " << rcv_body.size() << '\n';
 			os << std::hex;
@@ -155,22 +812,48 @@ namespace bb {
 			make_response(404, "", os.str());
 		}
 
-		std::string method, uri;
+		// Valid until the next request starts, method points into buf_in and uri into the arena
+		std::string_view method, uri;
 		Router const& router;
+		AccessLog* logger;
+		ConnectionRegistry* registry;
+		ConnectionRegistry::Entry entry;
+		asio::ip::address peer; // only known with a logger
+		Router::Endpoint const* route = nullptr;
+		RouteGate* admitted = nullptr; // the request counts against this until it is answered
+		Captures caps;
+		CachePolicy const* caching = nullptr; // the response goes into this route cache
+		ContentEncoder const* encoding = nullptr; // and through this encoder first
+		std::string cache_key;
+		HandlerMemory write_mem;
+		Metrics::clock::time_point handler_start, write_start;
 
-		const static std::regex re_req;
-	}; // class Connection
-} // namespace bb
+		std::vector<Response> out_queue;
+		std::vector<Response> out_flight;
+		std::vector<asio::const_buffer> out_bufs;
+		bool awaiting_response = false;
+		bool dispatching = false;
+		bool in_get_req = false;
+		bool again = false;
+		bool writing = false;
+		bool stalled = false;
+		bool closing = false;
+		bool draining = false; // closing once the request it is on is answered
+		bool served = false;   // has answered a request
 
-#include "router.hpp"
+		// The response being streamed, if any
+		std::function<void(asio::error_code)> stream_ready;
+		std::optional<std::uint64_t> stream_length;
+		std::uint64_t stream_sent = 0;
+		bool streaming = false;
+		bool stream_ending = false;
+		bool stream_head_only = false;
+		bool chunk_pending = false; // sent but not drained yet, so the next one has to wait
+		bool crlf_due = false;
+		bool flight_drains_chunk = false;
+		bool flight_ends_stream = false;
 
-namespace bb {
-	inline void Connection::handle_body() {
-		if (!router.handle_route(uri, method, shared_from_this())) {
-			make_test_response();
-		}
-	}
-
-	// The '\r' at the end is needed since getline only strips the '\n'
-	const std::regex Connection::re_req(R"(([A-Z]+) ([-/%.+?=&:\w]+) HTTP/1.[10]\r)", std::regex::optimize);
+		// A client that pipelines without reading its responses stops being served at this depth
+		static constexpr std::size_t max_queued = 64;
+	}; // class Connection
 } // namespace bb
@@ -0,0 +1,176 @@
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "asio.hpp"
+
+#include "client_connection.hpp"
+#include "proxy_relay.hpp"
+#include "response.hpp"
+#include "server_connection.hpp"
+
+namespace bb {
+	// Shares one upstream request among identical ones made while it is under way, so a
+	// burst of clients asking for the same thing costs the upstream a single request, e.g.
+	//   flights.get(host + path, con->get_executor(), fetch, [con](SingleFlight::ResultPtr r) {
+	//     con->send_response(SingleFlight::response(r));
+	//   });
+	// Only for requests whose response depends on nothing but the key, such as GETs of the
+	// same URL without credentials. Once a response is in, the next request starts anew,
+	// keeping responses is what ResponseCache is for.
+	// The response is kept once, and every waiter's Response refers to it rather than
+	// holding a copy. A response too large to keep can be relayed with relay() instead.
+	// Safe to use from any thread.
+	class SingleFlight
+	{
+	public:
+		typedef ClientConnection::executor_type executor_type;
+
+		// Never changed once it has been handed out
+		struct Result {
+			asio::error_code error; // the rest is empty if set
+			unsigned int status = 0;
+			std::string headers;    // lines to pass on, each ending with "\r\n"
+			ClientConnection::DATA body;
+		};
+
+		typedef std::shared_ptr<Result const> ResultPtr;
+		typedef std::function<void(ResultPtr)> Handler;
+		// Starts the upstream request and calls its argument with the result, once, on any thread
+		typedef std::function<void(Handler)> Fetch;
+		// Called with the connection to upstream once the head of its response is in, e.g. by
+		// ClientConnection::async_stream_request()
+		typedef std::function<void(asio::error_code, ClientConnection::ptr)> StreamHandler;
+		typedef std::function<void(StreamHandler)> StreamFetch;
+
+		SingleFlight() : state(std::make_shared<State>()) { }
+
+		SingleFlight(SingleFlight const&) = delete;
+		SingleFlight& operator=(SingleFlight const&) = delete;
+
+		// Calls h on ex with the result for key. Only the first caller for a key that is not
+		// under way has its fetch called.
+		void get(std::string const& key, executor_type const& ex, Fetch fetch, Handler h) {
+			{
+				std::lock_guard<std::mutex> lock(state->mutex);
+				auto it = state->flights.try_emplace(key).first;
+				it->second.push_back({ ex, std::move(h) });
+				if (it->second.size() > 1)
+					return;
+			}
+			fetch([s{ state }, key](ResultPtr r) { s->finish(key, std::move(r)); });
+		}
+
+		// get() for any completion token, e.g. asio::use_awaitable
+		template<typename CompletionToken>
+		auto async_get(std::string const& key, executor_type const& ex, Fetch fetch, CompletionToken&& token) {
+			return asio::async_initiate<CompletionToken, void(ResultPtr)>([this](auto handler, std::string const& key, executor_type const& ex, Fetch fetch) {
+				get(key, ex, std::move(fetch), shared_handler(std::move(handler), ex));
+			}, token, key, ex, std::move(fetch));
+		}
+
+		// Like get(), but the response is passed on as it arrives rather than kept, with one
+		// ResponseRelay that sends it to every waiter a piece at a time. A request for a key
+		// whose response has started arriving starts anew, since the start of the body is gone.
+		// The waiters are answered with 502 if the fetch fails.
+		void relay(std::string const& key, Connection::ptr con, StreamFetch fetch) {
+			{
+				std::lock_guard<std::mutex> lock(state->mutex);
+				auto it = state->relays.try_emplace(key).first;
+				it->second.push_back(std::move(con));
+				if (it->second.size() > 1)
+					return;
+			}
+			fetch([s{ state }, key](asio::error_code ec, ClientConnection::ptr upstream) { s->relay(key, ec, std::move(upstream)); });
+		}
+
+		// Keys with a request under way
+		std::size_t in_flight() const {
+			std::lock_guard<std::mutex> lock(state->mutex);
+			return state->flights.size() + state->relays.size();
+		}
+
+		// The response upstream has just received. Its body is moved out, not copied, and the
+		// headers that only apply to the upstream connection are left out.
+		static ResultPtr result(ClientConnection& upstream) {
+			auto r = std::make_shared<Result>();
+			r->status = upstream.status();
+			for (auto& h : upstream.headers()) {
+				if (!hop_by_hop(h.name)) {
+					r->headers.append(h.name).append(": ").append(h.value).append("\r\n");
+				}
+			}
+			r->body = upstream.take_body();
+			return r;
+		}
+
+		static ResultPtr failure(asio::error_code ec) {
+			auto r = std::make_shared<Result>();
+			r->error = ec;
+			return r;
+		}
+
+		// Passes r on. The body is referred to and kept alive by the response.
+		static Response response(ResultPtr const& r) {
+			Response resp(static_cast<int>(r->status));
+			resp.headers(r->headers).body_ref(asio::buffer(r->body), r);
+			return resp;
+		}
+
+	private:
+		struct Waiter {
+			executor_type ex;
+			Handler handler;
+		};
+
+		struct State {
+			void finish(std::string const& key, ResultPtr r) {
+				std::vector<Waiter> waiters;
+				{
+					std::lock_guard<std::mutex> lock(mutex);
+					auto it = flights.find(key);
+					if (it == flights.end())
+						return;
+					waiters = std::move(it->second);
+					flights.erase(it);
+				}
+				for (auto& w : waiters) {
+					asio::dispatch(w.ex, [h{ std::move(w.handler) }, r]() { h(r); });
+				}
+			}
+
+			void relay(std::string const& key, asio::error_code ec, ClientConnection::ptr upstream) {
+				std::vector<Connection::ptr> cons;
+				{
+					std::lock_guard<std::mutex> lock(mutex);
+					auto it = relays.find(key);
+					if (it == relays.end())
+						return;
+					cons = std::move(it->second);
+					relays.erase(it);
+				}
+				if (!ec && upstream) {
+					ResponseRelay::start(std::move(upstream), std::move(cons));
+					return;
+				}
+				if (!ec)
+					ec = asio::error::fault;
+				for (auto& con : cons) {
+					asio::dispatch(con->get_executor(), [con, ec]() { con->make_response(502, "", ec.message() + '\n'); });
+				}
+			}
+
+			mutable std::mutex mutex;
+			std::unordered_map<std::string, std::vector<Waiter>> flights;
+			std::unordered_map<std::string, std::vector<Connection::ptr>> relays;
+		};
+
+		std::shared_ptr<State> state;
+	}; // class SingleFlight
+} // namespace bb
@@ -0,0 +1,101 @@
+// Throughput of StaticFiles against a handler that copies the same file into the response.
+// Runs a local Server with both routes and downloads each file size over keep-alive
+// connections from blocking clients.
+//   static_bench [threads] [connections] [seconds]
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/stat.h>
+
+#define ASIO_STANDALONE 1
+#define ASIO_NO_DEPRECATED 1
+
+#include "server.hpp"
+#include "static_files.hpp"
+
+using namespace bb;
+
+static double megabytes_per_second(unsigned short port, std::string const& path, std::size_t size, unsigned int connections, unsigned int seconds) {
+	std::atomic<bool> done{ false };
+	std::atomic<unsigned long long> bytes{ 0 };
+	std::vector<std::thread> clients;
+	for (unsigned int i = 0; i < connections; ++i) {
+		clients.emplace_back([&]() {
+			const std::string req = "GET " + path + " HTTP/1.1\r\nHost: localhost\r\n\r\n";
+			asio::io_context io;
+			asio::ip::tcp::socket sock(io);
+			sock.connect({ asio::ip::address_v4::loopback(), port });
+			asio::streambuf in;
+			unsigned long long n = 0;
+			while (!done) {
+				asio::write(sock, asio::buffer(req));
+				auto head = asio::read_until(sock, in, "\r\n\r\n");
+				in.consume(head);
+				if (in.size() < size)
+					asio::read(sock, in, asio::transfer_at_least(size - in.size()));
+				in.consume(size);
+				n += size;
+			}
+			bytes += n;
+		});
+	}
+
+	std::this_thread::sleep_for(std::chrono::seconds(seconds));
+	done = true;
+	for (auto& c : clients) {
+		c.join();
+	}
+	return double(bytes) / seconds / (1024 * 1024);
+}
+
+int main(int argc, char* argv[])
+{
+	unsigned int threads = argc > 1 ? std::stoul(argv[1]) : std::thread::hardware_concurrency();
+	unsigned int connections = argc > 2 ? std::stoul(argv[2]) : 2 * threads;
+	unsigned int seconds = argc > 3 ? std::stoul(argv[3]) : 3;
+
+	const std::size_t sizes[] = { 4 * 1024, 64 * 1024, 1024 * 1024, 16 * 1024 * 1024 };
+	const std::string dir = "static_bench_files";
+	::mkdir(dir.c_str(), 0755);
+	for (auto size : sizes) {
+		std::ofstream(dir + '/' + std::to_string(size) + ".bin", std::ios::binary) << std::string(size, 'x');
+	}
+
+	Server s(0);
+	s.add_route("/static/{path:*}", Methods::GET, StaticFiles(dir));
+	// What a handler without StaticFiles would do: read the file and copy it into the response
+	s.add_route("/copy/{path:*}", Methods::GET, [dir](Captures const& caps, Methods, Connection::ptr con) {
+		std::ifstream f(dir + '/' + std::string(caps[1]), std::ios::binary);
+		Connection::DATA body{ std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>() };
+		con->make_response(200, "", std::move(body));
+	});
+	std::thread server_thread([&s, threads]() { s.run(threads); });
+	std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+	std::cout << threads << " threads, " << connections << " connections\n";
+	for (auto size : sizes) {
+		auto name = std::to_string(size) + ".bin";
+		auto copied = megabytes_per_second(s.port(), "/copy/" + name, size, connections, seconds);
+		auto sent = megabytes_per_second(s.port(), "/static/" + name, size, connections, seconds);
+		std::cout << size / 1024 << " KB\n"
+			<< "  copy:        " << copied << " MB/s\n"
+			<< "  StaticFiles: " << sent << " MB/s\n";
+	}
+
+	s.stop();
+	server_thread.join();
+	for (auto size : sizes) {
+		std::remove((dir + '/' + std::to_string(size) + ".bin").c_str());
+	}
+	std::remove(dir.c_str());
+
+	return 0;
+}
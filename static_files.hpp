@@ -0,0 +1,425 @@
+#pragma once
+
+#include <charconv>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <ctime>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#if !defined(__linux__)
+#include <sys/mman.h>
+#endif // !defined(__linux__)
+
+#include "asio.hpp"
+
+#include "server_connection.hpp"
+
+namespace bb {
+	// IMF-fixdate, e.g. "Sun, 06 Nov 1994 08:49:37 GMT"
+	inline std::string format_http_date(std::time_t t) {
+		std::tm tm;
+		gmtime_r(&t, &tm);
+		char buf[32];
+		auto n = std::strftime(buf, sizeof(buf), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+		return std::string(buf, n);
+	}
+
+	// Only IMF-fixdate, which is all a server is expected to understand from caches that
+	// echo back its own Last-Modified
+	inline bool parse_http_date(std::string_view s, std::time_t& t) {
+		static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+		if (s.size() != 29 || s[3] != ',' || s.substr(25) != " GMT")
+			return false;
+		auto num = [&](std::size_t pos, std::size_t len, int& v) {
+			v = 0;
+			for (auto i = pos; i < pos + len; ++i) {
+				if (s[i] < '0' || s[i] > '9')
+					return false;
+				v = v * 10 + (s[i] - '0');
+			}
+			return true;
+		};
+		int day, year, hour, min, sec, mon = -1;
+		for (int i = 0; i < 12; ++i) {
+			if (s.substr(8, 3) == std::string_view(months + i * 3, 3))
+				mon = i + 1;
+		}
+		if (mon < 0 || !num(5, 2, day) || !num(12, 4, year) || !num(17, 2, hour) || !num(20, 2, min) || !num(23, 2, sec))
+			return false;
+
+		// Days since the epoch of a civil date
+		auto y = year - (mon <= 2);
+		auto era = (y >= 0 ? y : y - 399) / 400;
+		auto yoe = y - era * 400;
+		auto doy = (153 * (mon + (mon > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+		auto doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+		std::int64_t days = std::int64_t(era) * 146097 + doe - 719468;
+		t = static_cast<std::time_t>(days * 86400 + hour * 3600 + min * 60 + sec);
+		return true;
+	}
+
+	// A regular file kept open, along with what its responses need to say about it
+	class OpenFile
+	{
+	public:
+		OpenFile(OpenFile const&) = delete;
+		OpenFile& operator=(OpenFile const&) = delete;
+
+		~OpenFile() {
+#if !defined(__linux__)
+			if (map)
+				::munmap(map, size);
+#endif // !defined(__linux__)
+			::close(fd);
+		}
+
+		// nullptr if path is not a regular file that can be read
+		static std::shared_ptr<OpenFile> open(std::string const& path) {
+			int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+			if (fd < 0)
+				return nullptr;
+			struct stat st;
+			if (::fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+				::close(fd);
+				return nullptr;
+			}
+			std::shared_ptr<OpenFile> f(new OpenFile(fd, st, content_type_of(path)));
+#if !defined(__linux__)
+			// Without sendfile() the file is sent from a mapping of it
+			if (f->size) {
+				f->map = ::mmap(nullptr, f->size, PROT_READ, MAP_SHARED, fd, 0);
+				if (f->map == MAP_FAILED) {
+					f->map = nullptr;
+					return nullptr;
+				}
+			}
+#endif // !defined(__linux__)
+			return f;
+		}
+
+		// Whether st still describes the file that was opened
+		bool same(struct stat const& st) const {
+			return st.st_ino == ino && st.st_dev == dev && static_cast<std::uint64_t>(st.st_size) == size && st.st_mtime == mtime;
+		}
+
+		int fd;
+		std::uint64_t size;
+		std::time_t mtime;
+		std::string etag;
+		std::string last_modified;
+		std::string_view content_type;
+		void* map = nullptr;
+
+	private:
+		OpenFile(int fd, struct stat const& st, std::string_view type)
+		  : fd(fd), size(static_cast<std::uint64_t>(st.st_size)), mtime(st.st_mtime),
+			last_modified(format_http_date(st.st_mtime)), content_type(type), ino(st.st_ino), dev(st.st_dev)
+		{
+			char buf[64];
+			auto n = std::snprintf(buf, sizeof(buf), "\"%llx-%llx-%llx\"", static_cast<unsigned long long>(st.st_ino),
+				static_cast<unsigned long long>(st.st_size), static_cast<unsigned long long>(st.st_mtime));
+			etag.assign(buf, n);
+		}
+
+		static std::string_view content_type_of(std::string_view path) {
+			static const std::pair<std::string_view, std::string_view> types[] = {
+				{ ".html", "text/html; charset=utf-8" },
+				{ ".htm", "text/html; charset=utf-8" },
+				{ ".css", "text/css; charset=utf-8" },
+				{ ".js", "text/javascript; charset=utf-8" },
+				{ ".json", "application/json" },
+				{ ".txt", "text/plain; charset=utf-8" },
+				{ ".xml", "application/xml" },
+				{ ".svg", "image/svg+xml" },
+				{ ".png", "image/png" },
+				{ ".jpg", "image/jpeg" },
+				{ ".jpeg", "image/jpeg" },
+				{ ".gif", "image/gif" },
+				{ ".webp", "image/webp" },
+				{ ".ico", "image/x-icon" },
+				{ ".woff", "font/woff" },
+				{ ".woff2", "font/woff2" },
+				{ ".wasm", "application/wasm" },
+				{ ".pdf", "application/pdf" },
+			};
+			auto dot = path.rfind('.');
+			if (dot != std::string_view::npos && path.find('/', dot) == std::string_view::npos) {
+				auto ext = path.substr(dot);
+				for (auto& t : types) {
+					if (iequals(ext, t.first))
+						return t.second;
+				}
+			}
+			return "application/octet-stream";
+		}
+
+		ino_t ino;
+		dev_t dev;
+	}; // class OpenFile
+
+	// Open files by path. An entry is trusted for check_interval, after which a stat() tells
+	// whether the file has changed and has to be opened again.
+	class FileCache
+	{
+	public:
+		typedef std::chrono::steady_clock clock;
+
+		FileCache(clock::duration check_interval, std::size_t max_open, std::string index)
+		  : check_interval(check_interval), max_open(max_open), index(std::move(index)) { }
+
+		// The file at path, or the index file if path is a directory. nullptr if there is none.
+		std::shared_ptr<OpenFile> get(std::string const& path, bool allow_dir = true) {
+			auto now = clock::now();
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				auto it = entries.find(path);
+				if (it != entries.end() && now - it->second.checked < check_interval)
+					return it->second.file;
+			}
+
+			struct stat st;
+			if (::stat(path.c_str(), &st) != 0) {
+				// Remembered as missing too, as lookups of precompressed siblings mostly miss
+				std::lock_guard<std::mutex> lock(mutex);
+				if (entries.size() >= max_open && entries.find(path) == entries.end())
+					entries.erase(entries.begin());
+				entries[path] = { nullptr, now };
+				return nullptr;
+			}
+			if (S_ISDIR(st.st_mode))
+				return allow_dir && !index.empty() ? get(path + '/' + index, false) : nullptr;
+
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				auto it = entries.find(path);
+				if (it != entries.end() && it->second.file && it->second.file->same(st)) {
+					it->second.checked = now;
+					return it->second.file;
+				}
+			}
+
+			auto file = OpenFile::open(path);
+			std::lock_guard<std::mutex> lock(mutex);
+			if (!file) {
+				entries.erase(path);
+				return nullptr;
+			}
+			if (entries.size() >= max_open && entries.find(path) == entries.end())
+				entries.erase(entries.begin());
+			entries[path] = { file, now };
+			return file;
+		}
+
+	private:
+		struct Entry {
+			std::shared_ptr<OpenFile> file;
+			clock::time_point checked;
+		};
+
+		clock::duration check_interval;
+		std::size_t max_open;
+		std::string index;
+		std::mutex mutex;
+		std::unordered_map<std::string, Entry> entries;
+	}; // class FileCache
+
+	// A route handler serving the files under a directory, e.g.
+	//   server.add_route("/static/{path:*}", Methods::GET | Methods::HEAD, StaticFiles("public"));
+	// The last capture of the route is the path of the file, relative to the directory.
+	// Bodies go out with sendfile() on Linux, and from a memory mapping elsewhere. Single
+	// byte ranges and conditional requests, by ETag or by date, are answered as such.
+	// With Options::precompressed, clients that take gzip get name.gz in place of name when
+	// there is one, so static assets are compressed once ahead of time and not per request.
+	// POSIX only.
+	class StaticFiles
+	{
+	public:
+		struct Options {
+			std::chrono::steady_clock::duration check_interval = std::chrono::seconds(1);
+			std::size_t max_open = 1024;
+			std::string index = "index.html";
+			std::string cache_control; // sent as Cache-Control when not empty
+			bool precompressed = false;
+		};
+
+		explicit StaticFiles(std::string root) : StaticFiles(std::move(root), Options()) { }
+
+		StaticFiles(std::string root, Options options)
+		  : root(std::move(root)), cache_control(std::move(options.cache_control)), precompressed(options.precompressed),
+			cache(std::make_shared<FileCache>(options.check_interval, options.max_open, std::move(options.index)))
+		{ }
+
+		void operator()(Captures const& caps, Methods, Connection::ptr con) const {
+			std::string path;
+			std::shared_ptr<OpenFile> file;
+			if (map_path(caps[caps.size() - 1], path))
+				file = cache->get(path);
+			if (!file) {
+				con->make_response(404, "", "");
+				return;
+			}
+
+			auto& headers = con->headers();
+			auto content_type = file->content_type;
+			bool gzipped = false;
+			bool varies = false;
+			if (precompressed) {
+				if (auto gz = cache->get(path + ".gz", false)) {
+					varies = true;
+					if (accept_weight(headers.get(KnownHeader::AcceptEncoding), "gzip") > 0) {
+						file = std::move(gz);
+						gzipped = true;
+					}
+				}
+			}
+
+			if (not_modified(headers, *file)) {
+				Response resp(304);
+				resp.header("ETag", file->etag).header("Last-Modified", file->last_modified);
+				if (varies) {
+					resp.header("Vary", "Accept-Encoding");
+				}
+				con->send_response(std::move(resp));
+				return;
+			}
+
+			std::uint64_t first = 0;
+			std::uint64_t length = file->size;
+			int status = 200;
+			auto range = headers.get(KnownHeader::Range);
+			if (!range.empty() && if_range_matches(headers, *file)) {
+				switch (parse_range(range, file->size, first, length))
+				{
+				case RangeResult::Satisfiable:
+					status = 206;
+					break;
+				case RangeResult::Unsatisfiable: {
+					Response resp(416);
+					resp.header("Content-Range", "bytes */" + std::to_string(file->size));
+					con->send_response(std::move(resp));
+					return;
+				}
+				case RangeResult::Ignored:
+					break;
+				}
+			}
+
+			Response resp(status);
+			resp.header("Content-Type", content_type)
+				.header("Last-Modified", file->last_modified)
+				.header("ETag", file->etag)
+				.header("Accept-Ranges", "bytes");
+			if (gzipped) {
+				resp.header("Content-Encoding", "gzip");
+			}
+			if (varies) {
+				resp.header("Vary", "Accept-Encoding");
+			}
+			if (status == 206) {
+				resp.header("Content-Range", "bytes " + std::to_string(first) + '-' + std::to_string(first + length - 1) + '/' + std::to_string(file->size));
+			}
+			if (!cache_control.empty()) {
+				resp.header("Cache-Control", cache_control);
+			}
+			if (Response::FileRegion::supported) {
+				resp.body_file(file->fd, first, length, file);
+			}
+			else {
+				resp.body_ref(asio::buffer(static_cast<const char*>(file->map) + first, static_cast<std::size_t>(length)), file);
+			}
+			con->send_response(std::move(resp));
+		}
+
+	private:
+		enum class RangeResult { Satisfiable, Unsatisfiable, Ignored };
+
+		// Puts the captured path under root, refusing anything that would climb out of it. The
+		// path has been percent-decoded already, along with the rest of the request target,
+		// so an escaped '/' separates segments like any other.
+		bool map_path(std::string_view rel, std::string& out) const {
+			rel = rel.substr(0, rel.find('?'));
+			out = root;
+			while (!rel.empty()) {
+				auto slash = rel.find('/');
+				auto name = rel.substr(0, slash);
+				rel = slash == std::string_view::npos ? std::string_view() : rel.substr(slash + 1);
+				if (name.empty() || name == ".")
+					continue;
+				if (name == ".." || name.find_first_of(std::string_view("\\\0", 2)) != std::string_view::npos)
+					return false;
+				out += '/';
+				out += name;
+			}
+			return true;
+		}
+
+		// If-None-Match wins over If-Modified-Since when both are there
+		static bool not_modified(Headers const& headers, OpenFile const& file) {
+			if (headers.has(KnownHeader::IfNoneMatch)) {
+				auto v = headers.get(KnownHeader::IfNoneMatch);
+				if (v == "*")
+					return true;
+				auto weak = "W/" + file.etag;
+				return headers.has_token(KnownHeader::IfNoneMatch, file.etag) || headers.has_token(KnownHeader::IfNoneMatch, weak);
+			}
+			std::time_t since;
+			return parse_http_date(headers.get(KnownHeader::IfModifiedSince), since) && file.mtime <= since;
+		}
+
+		// A Range goes with If-Range only if the file is still the one the client has part of
+		static bool if_range_matches(Headers const& headers, OpenFile const& file) {
+			if (!headers.has(KnownHeader::IfRange))
+				return true;
+			auto v = headers.get(KnownHeader::IfRange);
+			return v == file.etag || v == file.last_modified;
+		}
+
+		// A single range, bytes=first-last, bytes=first- or bytes=-suffix. Several ranges are
+		// answered with the whole file, which is allowed.
+		static RangeResult parse_range(std::string_view range, std::uint64_t size, std::uint64_t& first, std::uint64_t& length) {
+			if (range.substr(0, 6) != "bytes=" || range.find(',') != std::string_view::npos)
+				return RangeResult::Ignored;
+			range.remove_prefix(6);
+			auto dash = range.find('-');
+			if (dash == std::string_view::npos)
+				return RangeResult::Ignored;
+			auto num = [](std::string_view s, std::uint64_t& v) {
+				auto res = std::from_chars(s.data(), s.data() + s.size(), v);
+				return !s.empty() && res.ec == std::errc() && res.ptr == s.data() + s.size();
+			};
+			std::uint64_t a = 0, b = 0;
+			auto from = range.substr(0, dash);
+			auto to = range.substr(dash + 1);
+			if (from.empty()) {
+				if (!num(to, b))
+					return RangeResult::Ignored;
+				if (b == 0 || size == 0)
+					return RangeResult::Unsatisfiable;
+				first = b < size ? size - b : 0;
+				length = size - first;
+				return RangeResult::Satisfiable;
+			}
+			if (!num(from, a) || (!to.empty() && (!num(to, b) || b < a)))
+				return RangeResult::Ignored;
+			if (a >= size)
+				return RangeResult::Unsatisfiable;
+			first = a;
+			length = (to.empty() || b >= size ? size - 1 : b) - a + 1;
+			return RangeResult::Satisfiable;
+		}
+
+		std::string root;
+		std::string cache_control;
+		bool precompressed;
+		std::shared_ptr<FileCache> cache;
+	}; // class StaticFiles
+} // namespace bb
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <thread>
+
+#include "client_connection.hpp"
+
+namespace bb {
+	// What the tests have in common. check() reports what fails and counts it, and main()
+	// ends with finish(), which says how it went and returns what the process should.
+	inline int failures = 0;
+
+	inline void check(bool ok, char const* what) {
+		if (!ok) {
+			std::cout << "FAILED: " << what << "\n";
+			++failures;
+		}
+	}
+
+	inline int finish() {
+		std::cout << (failures ? "failed\n" : "passed\n");
+		return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+	}
+
+	// Polls f for up to two seconds, for what another thread or a timer brings about
+	template<typename F>
+	bool eventually(F f) {
+		for (int i = 0; i < 200; ++i) {
+			if (f())
+				return true;
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		}
+		return false;
+	}
+
+	// A response from a TestUpstream as the pool and group tests take it
+	struct Result {
+		asio::error_code ec;
+		ClientConnection::ptr con; // what ClientPool::get() handed out, which keeps the connection out of the pool
+		unsigned int status = 0;
+		std::string body;
+	};
+} // namespace bb
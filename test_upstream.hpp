@@ -0,0 +1,119 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+
+#include "asio.hpp"
+
+namespace bb {
+	// A loopback server for the tests to send upstream requests to, on a thread of its own.
+	// Every request is answered with its path as the body, after delay_ms and with status
+	// if they are set, and the path can ask for more:
+	//   /close      answered with Connection: close, then closed
+	//   /bye        closed 50 ms after it is answered, without a word
+	//   /delay/N    answered after N ms
+	//   /status/N   answered with status N
+	// It counts the connections it has had and has open.
+	class TestUpstream
+	{
+	public:
+		TestUpstream() : acceptor(io, { asio::ip::address_v4::loopback(), 0 }) {
+			accept();
+			thread = std::thread([this]() { io.run(); });
+		}
+
+		~TestUpstream() {
+			io.stop();
+			thread.join();
+		}
+
+		std::string port() const { return std::to_string(acceptor.local_endpoint().port()); }
+
+		// A port nothing listens on, so connections to it are refused
+		static std::string closed_port() {
+			asio::io_context io;
+			asio::ip::tcp::acceptor a(io, { asio::ip::address_v4::loopback(), 0 });
+			return std::to_string(a.local_endpoint().port());
+		}
+
+		// Before io, since sessions still in it at the end count themselves out
+		std::atomic<int> accepted{ 0 };
+		std::atomic<int> open{ 0 };
+		std::atomic<int> most_open{ 0 };
+		std::atomic<int> requests{ 0 };
+		std::atomic<int> delay_ms{ 0 };
+		std::atomic<int> status{ 200 };
+
+	private:
+		struct Session : std::enable_shared_from_this<Session> {
+			Session(TestUpstream& up, asio::ip::tcp::socket s) : up(up), sock(std::move(s)), timer(sock.get_executor()) {
+				++up.accepted;
+				auto n = ++up.open;
+				auto most = up.most_open.load();
+				while (n > most && !up.most_open.compare_exchange_weak(most, n)) { }
+			}
+
+			~Session() { --up.open; }
+
+			void read() {
+				asio::async_read_until(sock, in, "\r\n\r\n", [self{ shared_from_this() }](asio::error_code ec, std::size_t n) {
+					if (!ec)
+						self->request(n);
+				});
+			}
+
+			void request(std::size_t n) {
+				++up.requests;
+				std::string head(asio::buffers_begin(in.data()), asio::buffers_begin(in.data()) + n);
+				in.consume(n);
+				auto start = head.find(' ') + 1;
+				auto path = head.substr(start, head.find(' ', start) - start);
+				auto delay = up.delay_ms.load();
+				auto status = up.status.load();
+				if (path.compare(0, 7, "/delay/") == 0)
+					delay = std::stoi(path.substr(7));
+				if (path.compare(0, 8, "/status/") == 0)
+					status = std::stoi(path.substr(8));
+				timer.expires_after(std::chrono::milliseconds(delay));
+				timer.async_wait([self{ shared_from_this() }, path, status](asio::error_code) { self->answer(path, status); });
+			}
+
+			void answer(std::string const& path, int status) {
+				out = "HTTP/1.1 " + std::to_string(status) + " Whatever\r\nContent-Length: " + std::to_string(path.size()) + "\r\n"
+					+ (path == "/close" ? "Connection: close\r\n" : "") + "\r\n" + path;
+				asio::async_write(sock, asio::buffer(out), [self{ shared_from_this() }, path](asio::error_code ec, std::size_t) {
+					if (ec || path == "/close")
+						return; // closed as the session goes
+					if (path == "/bye") {
+						self->timer.expires_after(std::chrono::milliseconds(50));
+						self->timer.async_wait([self](asio::error_code) { });
+						return;
+					}
+					self->read();
+				});
+			}
+
+			TestUpstream& up;
+			asio::ip::tcp::socket sock;
+			asio::steady_timer timer;
+			asio::streambuf in;
+			std::string out;
+		};
+
+		void accept() {
+			acceptor.async_accept([this](asio::error_code ec, asio::ip::tcp::socket s) {
+				if (ec)
+					return;
+				std::make_shared<Session>(*this, std::move(s))->read();
+				accept();
+			});
+		}
+
+		asio::io_context io;
+		asio::ip::tcp::acceptor acceptor;
+		std::thread thread;
+	}; // class TestUpstream
+} // namespace bb
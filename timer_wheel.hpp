@@ -0,0 +1,244 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <utility>
+#include <vector>
+
+#include "asio.hpp"
+
+namespace bb {
+	// Timeouts for many objects with a single steady_timer, ticking once per resolution.
+	// Timers hang off a ring of slots by their deadline, and every tick looks only at the
+	// slot whose turn it is. Moving a deadline later, which is what a connection does on
+	// every read, only stores the new deadline: the timer is moved to its new slot when its
+	// old one comes around. Deadlines are rounded up to the next tick.
+	// The wheel only ticks while timers are scheduled, so it does not keep its io_context
+	// from running out of work. It is safe to use from any thread.
+	// A wheel declared ahead of its io_context, so that it outlives the connections still in
+	// it, is given the context by start() and has to be stopped before the context goes.
+	class TimerWheel
+	{
+	public:
+		typedef std::chrono::steady_clock clock;
+
+		// Lives inside the object it times out. fire is called on whatever thread the wheel
+		// ticks on, with owner locked, and is expected to post to owner's own executor. It
+		// can be called for a deadline that has since moved, so the owner has to check.
+		class Timer
+		{
+		public:
+			typedef void (*FireFunc)(std::shared_ptr<void> const& owner);
+
+			Timer() = default;
+			Timer(Timer const&) = delete;
+			Timer& operator=(Timer const&) = delete;
+
+			~Timer() {
+				if (wheel)
+					wheel->remove(*this);
+			}
+
+			void init(TimerWheel* w, std::weak_ptr<void> o, FireFunc f) {
+				wheel = w;
+				owner = std::move(o);
+				fire = f;
+			}
+
+			void schedule(clock::time_point deadline) {
+				if (wheel)
+					wheel->schedule(*this, deadline);
+			}
+
+			void cancel() { tick.store(never, std::memory_order_relaxed); }
+
+		private:
+			friend class TimerWheel;
+
+			static constexpr std::int64_t never = std::numeric_limits<std::int64_t>::max();
+			static constexpr std::int64_t unlinked = -1;
+
+			TimerWheel* wheel = nullptr;
+			std::weak_ptr<void> owner;
+			FireFunc fire = nullptr;
+			std::atomic<std::int64_t> tick{ never };     // deadline
+			std::atomic<std::int64_t> slot_tick{ unlinked }; // tick of the slot it hangs off
+			Timer* prev = nullptr;
+			Timer* next = nullptr;
+		}; // class Timer
+
+		explicit TimerWheel(clock::duration resolution = std::chrono::seconds(1), std::size_t slots = 256)
+		  : resolution(resolution), epoch(clock::now()), slots(slots) { }
+
+		explicit TimerWheel(asio::io_context& io, clock::duration resolution = std::chrono::seconds(1), std::size_t slots = 256)
+		  : TimerWheel(resolution, slots) {
+			start(io);
+		}
+
+		TimerWheel(TimerWheel const&) = delete;
+		TimerWheel& operator=(TimerWheel const&) = delete;
+
+		// Ticks on io from now on, whenever timers are scheduled
+		void start(asio::io_context& io) {
+			std::lock_guard<std::mutex> lock(mutex);
+			timer.emplace(io);
+			if (count > 0 && !ticking) {
+				ticking = true;
+				arm();
+			}
+		}
+
+		// Stops ticking and lets go of the steady_timer, which must not outlive the
+		// io_context. Timers can still be scheduled and removed, but never fire.
+		void stop() {
+			std::lock_guard<std::mutex> lock(mutex);
+			timer.reset();
+		}
+
+	private:
+		void schedule(Timer& t, clock::time_point deadline) {
+			auto tick = tick_of(deadline);
+			// Sequentially consistent with visit() unlinking the timer, so either this sees it
+			// unlinked or visit() sees the new deadline
+			t.tick.store(tick);
+			auto at = t.slot_tick.load();
+			// Later than the slot it is in: picked up when that slot comes around
+			if (at != Timer::unlinked && at <= tick)
+				return;
+
+			std::lock_guard<std::mutex> lock(mutex);
+			at = t.slot_tick.load(std::memory_order_relaxed);
+			if (at != Timer::unlinked) {
+				if (at <= tick)
+					return;
+				unlink(t);
+			}
+			if (!ticking) {
+				// Nothing is linked, so the ticks missed while idle can be skipped
+				current = tick_of(clock::now()) - 1;
+			}
+			link(t, tick < current + 1 ? current + 1 : tick);
+			if (!ticking) {
+				ticking = true;
+				arm();
+			}
+		}
+
+		void remove(Timer& t) {
+			std::lock_guard<std::mutex> lock(mutex);
+			if (t.slot_tick.load(std::memory_order_relaxed) != Timer::unlinked)
+				unlink(t);
+		}
+
+		// Called with the lock held
+		void link(Timer& t, std::int64_t tick) {
+			auto& head = slots[static_cast<std::size_t>(tick) % slots.size()];
+			t.prev = nullptr;
+			t.next = head;
+			if (head)
+				head->prev = &t;
+			head = &t;
+			t.slot_tick.store(tick, std::memory_order_release);
+			++count;
+		}
+
+		// Called with the lock held
+		void unlink(Timer& t) {
+			auto& head = slots[static_cast<std::size_t>(t.slot_tick.load(std::memory_order_relaxed)) % slots.size()];
+			if (t.prev)
+				t.prev->next = t.next;
+			else
+				head = t.next;
+			if (t.next)
+				t.next->prev = t.prev;
+			t.prev = t.next = nullptr;
+			t.slot_tick.store(Timer::unlinked);
+			--count;
+		}
+
+		// Called with the lock held
+		void arm() {
+			if (!timer) {
+				ticking = false; // not started, or stopped
+				return;
+			}
+			timer->expires_at(epoch + (current + 1) * resolution);
+			timer->async_wait([this](asio::error_code ec) {
+				if (!ec)
+					on_tick();
+			});
+		}
+
+		void on_tick() {
+			std::vector<std::pair<Timer*, std::shared_ptr<void>>> due;
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				auto now = tick_of(clock::now());
+				// Every slot at most once, however long the wheel was held up
+				auto from = now - current > static_cast<std::int64_t>(slots.size()) ? now - static_cast<std::int64_t>(slots.size()) + 1 : current + 1;
+				for (auto tick = from; tick <= now; ++tick) {
+					visit(tick, now, due);
+				}
+				current = now;
+				if (count > 0) {
+					arm();
+				}
+				else {
+					ticking = false;
+				}
+			}
+			// Outside the lock, since firing may schedule timers again
+			for (auto& d : due) {
+				d.first->fire(d.second);
+			}
+		}
+
+		// Called with the lock held. Fires what is due in the slot and moves on the rest.
+		void visit(std::int64_t tick, std::int64_t now, std::vector<std::pair<Timer*, std::shared_ptr<void>>>& due) {
+			auto t = slots[static_cast<std::size_t>(tick) % slots.size()];
+			while (t) {
+				auto next = t->next;
+				auto deadline = t->tick.load(std::memory_order_relaxed);
+				if (deadline == Timer::never || (deadline > now && t->slot_tick.load(std::memory_order_relaxed) != deadline)) {
+					unlink(*t);
+					relink(*t, now);
+				}
+				else {
+					unlink(*t);
+					// An owner on its way out has nothing left to time out
+					if (auto owner = t->owner.lock())
+						due.emplace_back(t, std::move(owner));
+				}
+				t = next;
+			}
+		}
+
+		// Called with the lock held, on a timer visit() has just unlinked. A deadline set
+		// meanwhile may have found it still linked and left it to this slot, so the deadline
+		// is read again now that schedule() would see it unlinked.
+		void relink(Timer& t, std::int64_t now) {
+			auto deadline = t.tick.load();
+			if (deadline != Timer::never)
+				link(t, deadline > now ? deadline : now + 1);
+		}
+
+		std::int64_t tick_of(clock::time_point tp) const {
+			auto d = tp - epoch;
+			return static_cast<std::int64_t>((d + resolution - clock::duration(1)) / resolution);
+		}
+
+		std::mutex mutex;
+		std::optional<asio::steady_timer> timer; // from start() until stop()
+		clock::duration resolution;
+		clock::time_point epoch;
+		std::vector<Timer*> slots;
+		std::int64_t current = 0; // last tick handled
+		std::size_t count = 0;    // timers linked
+		bool ticking = false;
+	}; // class TimerWheel
+} // namespace bb
@@ -0,0 +1,120 @@
+// Checks the TimerWheel: deadlines fire once and not early, moved and cancelled ones
+// do what they should, a deadline set while the tick thread is dropping the timer is not
+// lost, and a wheel declared ahead of its io_context can be stopped and outlive it.
+//   g++ -std=c++17 -O2 timer_wheel_test.cpp -o timer_wheel_test -lpthread
+//   timer_wheel_test
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <thread>
+
+#define ASIO_STANDALONE 1
+#define ASIO_NO_DEPRECATED 1
+
+#include "test_support.hpp"
+#include "timer_wheel.hpp"
+
+using namespace bb;
+using namespace std::chrono_literals;
+
+struct Owner : std::enable_shared_from_this<Owner> {
+	void init(TimerWheel& wheel) {
+		timer.init(&wheel, shared_from_this(), [](std::shared_ptr<void> const& o) {
+			auto self = static_cast<Owner*>(o.get());
+			self->fired_at = TimerWheel::clock::now();
+			self->fired.fetch_add(1);
+		});
+	}
+
+	TimerWheel::Timer timer;
+	std::atomic<int> fired{ 0 };
+	TimerWheel::clock::time_point fired_at;
+};
+
+static void fires_once() {
+	asio::io_context io;
+	TimerWheel wheel(io, 10ms);
+	auto o = std::make_shared<Owner>();
+	o->init(wheel);
+	auto start = TimerWheel::clock::now();
+	o->timer.schedule(start + 30ms);
+	// Returns once nothing is scheduled, since the wheel stops ticking
+	io.run();
+	check(o->fired == 1, "a deadline fires once");
+	check(o->fired_at >= start + 30ms, "a deadline does not fire early");
+}
+
+static void moved_and_cancelled() {
+	asio::io_context io;
+	TimerWheel wheel(io, 10ms);
+	auto later = std::make_shared<Owner>();
+	later->init(wheel);
+	auto start = TimerWheel::clock::now();
+	later->timer.schedule(start + 20ms);
+	later->timer.schedule(start + 60ms);
+	auto cancelled = std::make_shared<Owner>();
+	cancelled->init(wheel);
+	cancelled->timer.schedule(start + 20ms);
+	cancelled->timer.cancel();
+	io.run();
+	check(later->fired == 1 && later->fired_at >= start + 60ms, "a deadline moved later fires at the new one");
+	check(cancelled->fired == 0, "a cancelled deadline does not fire");
+}
+
+// Cancels and schedules again while the wheel ticks on another thread, as a connection
+// does between requests, which must never leave the timer without a deadline
+static void cancel_then_schedule() {
+	asio::io_context io;
+	auto work = asio::make_work_guard(io);
+	TimerWheel wheel(io, 1ms, 8);
+	std::thread ticker([&io]() { io.run(); });
+	auto o = std::make_shared<Owner>();
+	o->init(wheel);
+	int lost = 0;
+	for (int i = 0; i < 1000; ++i) {
+		auto before = o->fired.load();
+		// Linked in the slot about to come around, then cancelled, then scheduled later,
+		// which leaves it to that slot
+		o->timer.schedule(TimerWheel::clock::now() + 1ms);
+		o->timer.cancel();
+		std::this_thread::sleep_for(std::chrono::microseconds(rand() % 1500));
+		o->timer.schedule(TimerWheel::clock::now() + 2ms);
+		auto until = TimerWheel::clock::now() + 200ms;
+		while (o->fired.load() == before && TimerWheel::clock::now() < until) {
+			std::this_thread::yield();
+		}
+		if (o->fired.load() == before)
+			++lost;
+	}
+	work.reset();
+	o->timer.cancel();
+	ticker.join();
+	check(lost == 0, "a deadline set while the wheel drops a cancelled timer is kept");
+}
+
+static void declared_before_io() {
+	TimerWheel wheel(10ms);
+	auto o = std::make_shared<Owner>();
+	o->init(wheel);
+	{
+		asio::io_context io;
+		// Scheduled before start(), it waits for the wheel to tick
+		o->timer.schedule(TimerWheel::clock::now() + 10ms);
+		wheel.start(io);
+		io.run();
+		check(o->fired == 1, "a deadline scheduled before start() fires");
+		o->timer.schedule(TimerWheel::clock::now() + 10ms);
+		wheel.stop();
+	}
+	// Still linked, with no context left, and taken off the wheel on the way out
+	o.reset();
+}
+
+int main() {
+	fires_once();
+	moved_and_cancelled();
+	cancel_then_schedule();
+	declared_before_io();
+	return finish();
+}
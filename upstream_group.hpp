@@ -0,0 +1,458 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "asio.hpp"
+
+#include "client_connection.hpp"
+#include "client_pool.hpp"
+#include "methods.hpp"
+
+namespace bb {
+	// Several servers that serve the same thing, e.g.
+	//   UpstreamGroup api({ { "10.0.0.1", "80" }, { "10.0.0.2", "80" } }, pool);
+	//   api.send(con->get_executor(), Methods::GET, "/items", "", "", handler);
+	// Each request goes to the target that looks least busy, and fails over to another when
+	// a target does not answer. Targets that fail requests in a row, or get slow, are left
+	// out for a while, as are those that fail their health checks.
+	// Connections come from the ClientPool, which has to outlive the group. Safe to use from
+	// any thread.
+	class UpstreamGroup
+	{
+	public:
+		typedef std::chrono::steady_clock clock;
+		typedef ClientConnection::executor_type executor_type;
+		typedef std::function<void(asio::error_code, ClientConnection::ptr)> ResultFunc;
+
+		enum class Balance {
+			// The less busy of two targets picked at random, which spreads load nearly as well as
+			// looking at all of them without every request piling onto the same one
+			PowerOfTwoChoices,
+			// The target with the fewest requests under way, the fastest of those on a tie
+			LeastOutstanding,
+		};
+
+		struct Target {
+			std::string host;
+			std::string port;
+		};
+
+		struct Options {
+			Balance balance = Balance::PowerOfTwoChoices;
+			// A request is given up after this, however many targets it has been sent to
+			clock::duration timeout = std::chrono::seconds(10);
+			// Tries per request. A failed GET or HEAD is tried again on another target, any
+			// other request only if its connection was refused.
+			unsigned int attempts = 2;
+			// A GET without a response after this is sent to a second target as well, and
+			// whichever answers first is used. Zero for none.
+			clock::duration hedge_after = clock::duration::zero();
+
+			// Active health checks, a GET of health_path every health_interval, which has to be
+			// answered with 2xx within health_timeout. Only with a path.
+			std::string health_path;
+			clock::duration health_interval = std::chrono::seconds(5);
+			clock::duration health_timeout = std::chrono::seconds(2);
+			unsigned int unhealthy_after = 2; // failed checks in a row
+			unsigned int healthy_after = 2;   // passed checks in a row
+
+			// Outlier ejection, from the requests themselves. A target that fails this many in a
+			// row, with an error or a 5xx, is left out for eject_time, and for longer each time
+			// it happens again, up to max_eject_time.
+			unsigned int eject_after_errors = 5;
+			// Also one whose average latency goes over this. Zero for none.
+			clock::duration slow_latency = clock::duration::zero();
+			clock::duration eject_time = std::chrono::seconds(30);
+			clock::duration max_eject_time = std::chrono::minutes(5);
+			// Ejecting never leaves more than this share of the targets out
+			unsigned int max_ejected_percent = 50;
+		};
+
+		struct Status {
+			Target target;
+			bool healthy;
+			bool ejected;
+			unsigned int outstanding;
+			clock::duration latency; // average
+		};
+
+		UpstreamGroup(std::vector<Target> const& targets, ClientPool& pool) : UpstreamGroup(targets, pool, Options()) { }
+		UpstreamGroup(std::vector<Target> const& targets, ClientPool& pool, Options options) : state(std::make_shared<State>(pool, std::move(options))) {
+			for (auto& t : targets) {
+				state->peers.push_back(std::make_unique<Peer>(t));
+			}
+		}
+
+		UpstreamGroup(UpstreamGroup const&) = delete;
+		UpstreamGroup& operator=(UpstreamGroup const&) = delete;
+
+		~UpstreamGroup() { stop_health_checks(); }
+
+		// Calls h(error_code, connection) on ex once a target has answered, or all that were
+		// tried have failed. A response with a 5xx status is passed on, not tried again.
+		// The connection is the one ClientPool::get() handed out, so it stays out of the pool,
+		// and its response stays readable, for as long as h holds on to it.
+		void send(executor_type const& ex, Methods method, std::string path, std::string headers, std::string body, ResultFunc h) {
+			if (state->peers.empty()) {
+				asio::dispatch(ex, [h{ std::move(h) }]() { h(asio::error::host_not_found, nullptr); });
+				return;
+			}
+			auto call = std::make_shared<Call>(state, ex);
+			call->method = method;
+			call->path = std::move(path);
+			call->headers = std::move(headers);
+			call->body = std::move(body);
+			call->handler = std::move(h);
+			asio::dispatch(ex, [call]() { call->start(); });
+		}
+
+		// send() for any completion token, e.g. asio::use_awaitable
+		template<typename CompletionToken>
+		auto async_send(executor_type const& ex, Methods method, std::string path, std::string headers, std::string body, CompletionToken&& token) {
+			return asio::async_initiate<CompletionToken, void(asio::error_code, ClientConnection::ptr)>([this](auto handler, executor_type const& ex, Methods method, std::string path, std::string headers, std::string body) {
+				send(ex, method, std::move(path), std::move(headers), std::move(body), shared_handler(std::move(handler), ex));
+			}, token, ex, method, std::move(path), std::move(headers), std::move(body));
+		}
+
+		// Runs the health checks on ex until stop_health_checks(), which has to be called for
+		// the context to run out of work, e.g. from Server::on_stop()
+		void start_health_checks(executor_type const& ex) {
+			if (state->options.health_path.empty())
+				return;
+			{
+				std::lock_guard<std::mutex> lock(state->mutex);
+				if (state->checking)
+					return;
+				state->checking = true;
+				state->health_timer = std::make_shared<asio::steady_timer>(ex);
+			}
+			asio::dispatch(ex, [s{ state }, ex]() { State::check_all(s, ex); });
+		}
+
+		void stop_health_checks() {
+			std::lock_guard<std::mutex> lock(state->mutex);
+			state->checking = false;
+			if (auto timer = std::exchange(state->health_timer, nullptr)) {
+				asio::post(timer->get_executor(), [timer]() { timer->cancel(); });
+			}
+		}
+
+		std::vector<Status> status() const {
+			std::vector<Status> all;
+			auto now = clock::now().time_since_epoch().count();
+			for (auto& p : state->peers) {
+				all.push_back({ p->target, p->healthy.load(std::memory_order_relaxed), p->ejected_until.load(std::memory_order_relaxed) > now,
+					p->outstanding.load(std::memory_order_relaxed), clock::duration(p->latency.load(std::memory_order_relaxed)) });
+			}
+			return all;
+		}
+
+	private:
+		// A target and what is known about it. Written from the executors of the requests
+		// sent to it, hence the atomics. Updates that race may lose one, which only makes
+		// the numbers a little less exact.
+		struct Peer {
+			explicit Peer(Target t) : target(std::move(t)) { }
+
+			Target target;
+			std::atomic<unsigned int> outstanding{ 0 };
+			std::atomic<unsigned int> errors{ 0 };        // failed requests in a row
+			std::atomic<std::int64_t> latency{ 0 };       // moving average, in clock ticks
+			std::atomic<std::int64_t> ejected_until{ 0 }; // clock ticks since the epoch
+			std::atomic<bool> healthy{ true };
+			unsigned int ejections = 0;                   // with State::mutex held
+			unsigned int checks_failed = 0, checks_passed = 0; // on the health check executor
+		};
+
+		struct State {
+			State(ClientPool& pool, Options options) : pool(pool), options(std::move(options)) { }
+
+			bool usable(Peer const& p, std::int64_t now) const {
+				return p.healthy.load(std::memory_order_relaxed) && p.ejected_until.load(std::memory_order_relaxed) <= now;
+			}
+
+			static bool less_busy(Peer const& a, Peer const& b) {
+				auto x = a.outstanding.load(std::memory_order_relaxed), y = b.outstanding.load(std::memory_order_relaxed);
+				return x != y ? x < y : a.latency.load(std::memory_order_relaxed) < b.latency.load(std::memory_order_relaxed);
+			}
+
+			// Any target but exclude, which is only picked if there is no other. When none is
+			// usable one is picked all the same, which beats failing every request outright.
+			std::size_t pick(std::size_t exclude) {
+				static thread_local std::minstd_rand rng(std::random_device{}());
+				static thread_local std::vector<std::size_t> candidates;
+				auto now = clock::now().time_since_epoch().count();
+				candidates.clear();
+				for (std::size_t i = 0; i < peers.size(); ++i) {
+					if (i != exclude && usable(*peers[i], now))
+						candidates.push_back(i);
+				}
+				if (candidates.empty()) {
+					for (std::size_t i = 0; i < peers.size(); ++i) {
+						if (i != exclude)
+							candidates.push_back(i);
+					}
+				}
+				if (candidates.empty())
+					return exclude;
+				if (options.balance == Balance::LeastOutstanding) {
+					return *std::min_element(candidates.begin(), candidates.end(), [this](std::size_t a, std::size_t b) { return less_busy(*peers[a], *peers[b]); });
+				}
+				auto n = candidates.size();
+				auto a = candidates[rng() % n];
+				if (n == 1)
+					return a;
+				auto b = candidates[rng() % (n - 1)];
+				if (b == a)
+					b = candidates[n - 1];
+				return less_busy(*peers[b], *peers[a]) ? b : a;
+			}
+
+			void record(std::size_t i, bool ok, clock::duration took) {
+				auto& p = *peers[i];
+				if (ok) {
+					p.errors.store(0, std::memory_order_relaxed);
+				}
+				else {
+					p.errors.fetch_add(1, std::memory_order_relaxed);
+				}
+				sample(i, took);
+			}
+
+			// Latency alone, e.g. of a request that lost to its hedge, which shows only that the
+			// target is at least that slow
+			void sample(std::size_t i, clock::duration took) {
+				auto& p = *peers[i];
+				auto l = p.latency.load(std::memory_order_relaxed);
+				auto t = took.count();
+				p.latency.store(l == 0 ? t : l + (t - l) / 8, std::memory_order_relaxed);
+				bool slow = options.slow_latency != clock::duration::zero() && p.latency.load(std::memory_order_relaxed) > options.slow_latency.count();
+				if (slow || p.errors.load(std::memory_order_relaxed) >= options.eject_after_errors) {
+					eject(p);
+				}
+			}
+
+			void eject(Peer& p) {
+				std::lock_guard<std::mutex> lock(mutex);
+				auto now = clock::now().time_since_epoch().count();
+				if (p.ejected_until.load(std::memory_order_relaxed) > now)
+					return;
+				std::size_t out = 0;
+				for (auto& q : peers) {
+					out += q->ejected_until.load(std::memory_order_relaxed) > now;
+				}
+				if ((out + 1) * 100 > peers.size() * options.max_ejected_percent)
+					return;
+				auto time = std::min(options.eject_time * ++p.ejections, options.max_eject_time);
+				p.ejected_until.store(now + time.count(), std::memory_order_relaxed);
+				// Back with a clean slate, or it would be ejected again by its first request
+				p.errors.store(0, std::memory_order_relaxed);
+				p.latency.store(0, std::memory_order_relaxed);
+			}
+
+			static void check_all(std::shared_ptr<State> const& s, executor_type const& ex) {
+				std::shared_ptr<asio::steady_timer> timer;
+				{
+					std::lock_guard<std::mutex> lock(s->mutex);
+					if (!s->checking)
+						return;
+					timer = s->health_timer;
+				}
+				for (std::size_t i = 0; i < s->peers.size(); ++i) {
+					check(s, ex, i);
+				}
+				timer->expires_after(s->options.health_interval);
+				timer->async_wait([s, ex](asio::error_code ec) {
+					if (!ec)
+						check_all(s, ex);
+				});
+			}
+
+			static void check(std::shared_ptr<State> const& s, executor_type const& ex, std::size_t i) {
+				auto& t = s->peers[i]->target;
+				auto timer = std::make_shared<asio::steady_timer>(ex, s->options.health_timeout);
+				auto held = std::make_shared<ClientConnection::ptr>();
+				timer->async_wait([held](asio::error_code ec) {
+					if (!ec && *held) {
+						auto con = *held;
+						asio::post(con->get_executor(), [con]() { con->cancel(); });
+					}
+				});
+				s->pool.get(ex, t.host, t.port, [s, ex, i, timer, held](asio::error_code ec, ClientConnection::ptr con) {
+					if (ec) {
+						timer->cancel();
+						s->checked(i, false);
+						return;
+					}
+					*held = con;
+					con->async_send_request(Methods::GET, s->options.health_path, "", "", asio::bind_executor(ex, [s, i, timer, held](asio::error_code ec, ClientConnection::ptr con) {
+						timer->cancel();
+						held->reset();
+						s->checked(i, !ec && con->status() >= 200 && con->status() < 300);
+					}));
+				});
+			}
+
+			// On the health check executor
+			void checked(std::size_t i, bool passed) {
+				auto& p = *peers[i];
+				if (passed) {
+					p.checks_failed = 0;
+					if (++p.checks_passed >= options.healthy_after)
+						p.healthy.store(true, std::memory_order_relaxed);
+				}
+				else {
+					p.checks_passed = 0;
+					if (++p.checks_failed >= options.unhealthy_after)
+						p.healthy.store(false, std::memory_order_relaxed);
+				}
+			}
+
+			ClientPool& pool;
+			Options options;
+			std::vector<std::unique_ptr<Peer>> peers;
+			std::mutex mutex;
+			bool checking = false;
+			std::shared_ptr<asio::steady_timer> health_timer; // on the health check executor
+		};
+
+		// One request and the attempts made at it, all on the executor of the caller
+		struct Call : std::enable_shared_from_this<Call> {
+			struct Attempt {
+				std::size_t id;
+				std::size_t peer;
+				clock::time_point start;
+				ClientConnection::ptr con; // once it has one
+			};
+
+			Call(std::shared_ptr<State> s, executor_type const& ex) : state(std::move(s)), ex(ex), deadline(ex), hedge(ex) { }
+
+			void start() {
+				retries = state->options.attempts > 1 ? state->options.attempts - 1 : 0;
+				deadline.expires_after(state->options.timeout);
+				deadline.async_wait([self{ shared_from_this() }](asio::error_code ec) {
+					if (!ec && !self->done)
+						self->finish(asio::error::timed_out, nullptr);
+				});
+				auto first = launch(state->peers.size());
+				if (method == Methods::GET && state->options.hedge_after != clock::duration::zero() && state->peers.size() > 1) {
+					hedge.expires_after(state->options.hedge_after);
+					hedge.async_wait([self{ shared_from_this() }, first](asio::error_code ec) {
+						if (!ec && !self->done && self->attempts.size() == 1)
+							self->launch(first);
+					});
+				}
+			}
+
+			std::size_t launch(std::size_t exclude) {
+				auto i = state->pick(exclude);
+				auto& t = state->peers[i]->target;
+				state->peers[i]->outstanding.fetch_add(1, std::memory_order_relaxed);
+				auto id = ++launched;
+				attempts.push_back({ id, i, clock::now(), nullptr });
+				state->pool.get(ex, t.host, t.port, [self{ shared_from_this() }, id](asio::error_code ec, ClientConnection::ptr con) {
+					auto a = self->find(id);
+					if (!a)
+						return;
+					if (ec) {
+						self->attempt_done(id, ec, nullptr);
+						return;
+					}
+					a->con = con;
+					con->async_send_request(self->method, self->path, self->headers, self->body, asio::bind_executor(self->ex, [self, id](asio::error_code ec, ClientConnection::ptr con) {
+						self->attempt_done(id, ec, std::move(con));
+					}));
+				});
+				return i;
+			}
+
+			Attempt* find(std::size_t id) {
+				for (auto& a : attempts) {
+					if (a.id == id)
+						return &a;
+				}
+				return nullptr;
+			}
+
+			void attempt_done(std::size_t id, asio::error_code ec, ClientConnection::ptr con) {
+				auto a = find(id);
+				if (!a)
+					return; // given up on already, and counted then
+				auto peer = a->peer;
+				state->peers[peer]->outstanding.fetch_sub(1, std::memory_order_relaxed);
+				state->record(peer, !ec && con->status() < 500, clock::now() - a->start);
+				// con does not keep the connection out of the pool, the pointer get() handed out does
+				auto lease = std::move(a->con);
+				attempts.erase(attempts.begin() + (a - attempts.data()));
+				if (done)
+					return;
+				if (ec) {
+					if (retries > 0 && retryable(ec)) {
+						--retries;
+						launch(peer);
+						return;
+					}
+					// the hedge may still come through
+					if (!attempts.empty())
+						return;
+				}
+				finish(ec, std::move(lease));
+			}
+
+			bool retryable(asio::error_code ec) const {
+				return method == Methods::GET || method == Methods::HEAD || ec == asio::error::connection_refused;
+			}
+
+			// The attempts still under way are cancelled, as failures if time ran out. They hold
+			// on to their connections until then, so none can go back to the pool and be
+			// cancelled in another's hands.
+			void finish(asio::error_code ec, ClientConnection::ptr con) {
+				done = true;
+				deadline.cancel();
+				hedge.cancel();
+				auto now = clock::now();
+				for (auto& a : attempts) {
+					state->peers[a.peer]->outstanding.fetch_sub(1, std::memory_order_relaxed);
+					if (ec == asio::error::timed_out) {
+						state->record(a.peer, false, now - a.start);
+					}
+					else {
+						state->sample(a.peer, now - a.start);
+					}
+					if (a.con) {
+						auto cex = a.con->get_executor();
+						asio::post(cex, [c{ std::move(a.con) }]() { c->cancel(); });
+					}
+				}
+				attempts.clear();
+				auto h = std::move(handler);
+				handler = nullptr;
+				h(ec, std::move(con));
+			}
+
+			std::shared_ptr<State> state;
+			executor_type ex;
+			Methods method;
+			std::string path, headers, body;
+			ResultFunc handler;
+			asio::steady_timer deadline;
+			asio::steady_timer hedge;
+			std::vector<Attempt> attempts; // under way
+			std::size_t launched = 0;
+			unsigned int retries = 0;
+			bool done = false;
+		};
+
+		std::shared_ptr<State> state;
+	}; // class UpstreamGroup
+} // namespace bb
@@ -0,0 +1,238 @@
+// Checks UpstreamGroup against loopback stand-in upstreams: requests are spread over the
+// targets and fail over from one that refuses them, a 5xx is passed on and not sent again,
+// targets that fail are ejected and those that fail their health checks left out until they
+// pass again, a request runs out after the timeout, a slow one is hedged, and the response
+// handed over stays the caller's for as long as it holds the connection.
+//   g++ -std=c++17 -O2 upstream_group_test.cpp -o upstream_group_test -lpthread
+//   upstream_group_test
+
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define ASIO_STANDALONE 1
+#define ASIO_NO_DEPRECATED 1
+
+#include "upstream_group.hpp"
+#include "test_support.hpp"
+#include "test_upstream.hpp"
+
+using namespace bb;
+using namespace std::chrono_literals;
+
+// The pool and a thread for the group's requests to run on. The group goes before the
+// client, which has to outlive it.
+struct Client {
+	explicit Client(ClientPool::Options options = {}) : work(asio::make_work_guard(io)), ex(asio::make_strand(io)), pool(options) {
+		thread = std::thread([this]() { io.run(); });
+	}
+
+	~Client() {
+		pool.close();
+		work.reset();
+		thread.join();
+	}
+
+	template<typename F>
+	void start(UpstreamGroup& group, Methods method, std::string const& path, F done) {
+		group.send(ex, method, path, "", "", [done](asio::error_code ec, ClientConnection::ptr con) mutable {
+			if (ec) {
+				done(Result{ ec, nullptr, 0, {} });
+				return;
+			}
+			auto status = con->status();
+			auto& b = con->body();
+			std::string body(b.begin(), b.end());
+			done(Result{ ec, std::move(con), status, std::move(body) });
+		});
+	}
+
+	Result fetch(UpstreamGroup& group, std::string const& path, Methods method = Methods::GET) {
+		std::promise<Result> p;
+		start(group, method, path, [&p](Result r) { p.set_value(std::move(r)); });
+		auto r = p.get_future().get();
+		r.con.reset();
+		return r;
+	}
+
+	asio::io_context io;
+	asio::executor_work_guard<asio::io_context::executor_type> work;
+	ClientPool::executor_type ex;
+	ClientPool pool;
+	std::thread thread;
+};
+
+static UpstreamGroup::Target at(std::string port) {
+	return { "127.0.0.1", std::move(port) };
+}
+
+static void spread(TestUpstream& a, TestUpstream& b) {
+	Client c;
+	UpstreamGroup group({ at(a.port()), at(b.port()) }, c.pool);
+	auto before_a = a.requests.load(), before_b = b.requests.load();
+	std::atomic<int> ok{ 0 }, left{ 20 };
+	std::promise<void> all;
+	for (int i = 0; i < 20; ++i) {
+		c.start(group, Methods::GET, "/delay/20", [&](Result r) {
+			ok += !r.ec && r.status == 200 && r.body == "/delay/20";
+			r.con.reset();
+			if (--left == 0)
+				all.set_value();
+		});
+	}
+	all.get_future().get();
+	check(ok == 20, "requests to a group are answered");
+	check(a.requests - before_a > 0 && b.requests - before_b > 0, "requests under way at once are spread over the targets");
+}
+
+static void failover(TestUpstream& a) {
+	Client c;
+	UpstreamGroup group({ at(TestUpstream::closed_port()), at(a.port()) }, c.pool);
+	bool ok = true;
+	for (int i = 0; i < 10; ++i) {
+		auto r = c.fetch(group, "/get");
+		ok = ok && !r.ec && r.body == "/get";
+	}
+	check(ok, "a GET fails over from a target that refuses it");
+	ok = true;
+	for (int i = 0; i < 10; ++i) {
+		auto r = c.fetch(group, "/post", Methods::POST);
+		ok = ok && !r.ec && r.body == "/post";
+	}
+	check(ok, "so does a POST, which was never sent");
+}
+
+static void passed_on(TestUpstream& a, TestUpstream& b) {
+	Client c;
+	UpstreamGroup group({ at(a.port()), at(b.port()) }, c.pool);
+	auto before = a.requests + b.requests;
+	auto r = c.fetch(group, "/status/503");
+	check(!r.ec && r.status == 503, "a 5xx is passed on");
+	check(a.requests + b.requests - before == 1, "a 5xx is not sent again");
+}
+
+static void ejection(TestUpstream& a) {
+	TestUpstream bad;
+	bad.status = 503;
+	Client c;
+	UpstreamGroup::Options o;
+	o.eject_after_errors = 2;
+	UpstreamGroup group({ at(bad.port()), at(a.port()) }, c.pool, o);
+	// A target that fails fast looks the less busy, which is what ejection is there for
+	a.delay_ms = 20;
+	for (int i = 0; i < 20 && !group.status()[0].ejected; ++i) {
+		c.fetch(group, "/e");
+	}
+	auto s = group.status();
+	check(s[0].ejected && !s[1].ejected, "a target that fails requests in a row is ejected");
+	auto before = bad.requests.load();
+	bool ok = true;
+	for (int i = 0; i < 10; ++i) {
+		ok = ok && c.fetch(group, "/e").status == 200;
+	}
+	check(ok && bad.requests == before, "an ejected target is left out");
+	a.delay_ms = 0;
+
+	// Never more than max_ejected_percent of them, here the one that is left
+	a.status = 503;
+	for (int i = 0; i < 5; ++i) {
+		c.fetch(group, "/e");
+	}
+	a.status = 200;
+	check(!group.status()[1].ejected, "ejecting leaves max_ejected_percent of the targets in");
+}
+
+static void health(TestUpstream& a, TestUpstream& b) {
+	Client c;
+	UpstreamGroup::Options o;
+	o.health_path = "/health";
+	o.health_interval = 20ms;
+	o.health_timeout = 200ms;
+	UpstreamGroup group({ at(a.port()), at(b.port()) }, c.pool, o);
+	group.start_health_checks(c.ex);
+
+	a.status = 500;
+	check(eventually([&]() { return !group.status()[0].healthy; }), "a target that fails its health checks is unhealthy");
+	check(group.status()[1].healthy, "one that passes them is not");
+	// Sent to a these would be answered with its 500
+	bool ok = true;
+	for (int i = 0; i < 10; ++i) {
+		ok = ok && c.fetch(group, "/h").status == 200;
+	}
+	check(ok, "an unhealthy target is left out");
+	a.status = 200;
+	check(eventually([&]() { return group.status()[0].healthy; }), "a target that passes its health checks again is back");
+	group.stop_health_checks();
+}
+
+static void timeout(TestUpstream& a) {
+	Client c;
+	UpstreamGroup::Options o;
+	o.timeout = 100ms;
+	UpstreamGroup group({ at(a.port()) }, c.pool, o);
+	auto start = std::chrono::steady_clock::now();
+	auto r = c.fetch(group, "/delay/1000");
+	auto took = std::chrono::steady_clock::now() - start;
+	check(r.ec == asio::error::timed_out && took >= 100ms && took < 900ms, "a request is given up after the timeout");
+	check(group.status()[0].outstanding == 0, "and is no longer counted as under way");
+}
+
+static void hedge(TestUpstream& a, TestUpstream& b) {
+	Client c;
+	UpstreamGroup::Options o;
+	o.balance = UpstreamGroup::Balance::LeastOutstanding;
+	o.hedge_after = 30ms;
+	// The first of two that are alike, so the first request goes to the slow one
+	UpstreamGroup group({ at(a.port()), at(b.port()) }, c.pool, o);
+	a.delay_ms = 500;
+	bool fast = true, ok = true;
+	for (int i = 0; i < 5; ++i) {
+		auto start = std::chrono::steady_clock::now();
+		auto r = c.fetch(group, "/hedged");
+		fast = fast && std::chrono::steady_clock::now() - start < 300ms;
+		ok = ok && !r.ec && r.body == "/hedged";
+	}
+	a.delay_ms = 0;
+	check(ok, "hedged requests are answered");
+	check(fast, "a slow target is overtaken by the hedge");
+}
+
+static void lease(TestUpstream& a) {
+	ClientPool::Options po;
+	po.max_per_host = 1;
+	Client c(po);
+	UpstreamGroup group({ at(a.port()) }, c.pool);
+
+	std::promise<Result> p;
+	c.start(group, Methods::GET, "/first", [&p](Result r) { p.set_value(std::move(r)); });
+	auto first = p.get_future().get();
+
+	std::promise<Result> q;
+	c.start(group, Methods::GET, "/second", [&q](Result r) { q.set_value(std::move(r)); });
+	auto second = q.get_future();
+	std::this_thread::sleep_for(50ms);
+	check(second.wait_for(0s) == std::future_status::timeout, "a connection that is held is not handed to the next request");
+	auto& b = first.con->body();
+	check(first.con->status() == 200 && std::string(b.begin(), b.end()) == "/first", "the response stays readable while the connection is held");
+
+	auto raw = first.con.get();
+	first.con.reset();
+	auto r = second.get();
+	check(!r.ec && r.body == "/second" && r.con.get() == raw, "the connection let go of serves the next request");
+}
+
+int main() {
+	TestUpstream a, b;
+	spread(a, b);
+	failover(a);
+	passed_on(a, b);
+	ejection(a);
+	health(a, b);
+	timeout(a);
+	hedge(a, b);
+	lease(a);
+	return finish();
+}
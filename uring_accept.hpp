@@ -0,0 +1,253 @@
+#pragma once
+
+#if !defined(__linux__)
+#error "uring_accept.hpp, and BB_IO_URING, are for Linux only"
+#endif // !defined(__linux__)
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <utility>
+
+#include <linux/io_uring.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "asio.hpp"
+
+namespace bb {
+	// Accepts connections with a single multishot accept on an io_uring of its own, which
+	// goes on accepting until it is cancelled: there is no submission per connection, and
+	// each wake-up takes every connection that has arrived since the last one, in one batch.
+	// The ring tells asio of completions through an eventfd, so it works next to whichever
+	// backend asio was built with. Needs Linux 5.19 or later; where the kernel has no
+	// io_uring, e.g. one that seccomp forbids, start() fails, and where it has no multishot
+	// accept the handler gets operation_not_supported, so the caller can accept as before.
+	// Runs on a strand of the context it is made with, and is safe to use from its threads.
+	class UringAcceptor
+	{
+	public:
+		// The socket accepted, which is the handler's to close, or an error and -1. After an
+		// error nothing more is accepted.
+		typedef std::function<void(asio::error_code, int)> AcceptFunc;
+
+		explicit UringAcceptor(asio::io_context& io) : strand(asio::make_strand(io)), notify(strand) { }
+
+		UringAcceptor(UringAcceptor const&) = delete;
+		UringAcceptor& operator=(UringAcceptor const&) = delete;
+
+		~UringAcceptor() {
+			if (sqes)
+				::munmap(sqes, sqes_size);
+			if (cq_map && cq_map != sq_map)
+				::munmap(cq_map, cq_size);
+			if (sq_map)
+				::munmap(sq_map, sq_size);
+			if (ring >= 0)
+				::close(ring);
+		}
+
+		// Starts accepting on the listening socket fd, which has to stay open until close().
+		// false if no ring could be set up.
+		bool start(int fd, AcceptFunc f) {
+			if (!setup())
+				return false;
+			asio::dispatch(strand, [this, fd, f{ std::move(f) }]() mutable {
+				listener = fd;
+				handler = std::move(f);
+				arm();
+				wait();
+			});
+			return true;
+		}
+
+		// Stops accepting until resume(), e.g. while the server is full. Connections accepted
+		// meanwhile are still handed over.
+		void pause() {
+			asio::dispatch(strand, [this]() {
+				paused = true;
+				if (armed)
+					cancel();
+			});
+		}
+
+		void resume() {
+			asio::dispatch(strand, [this]() {
+				paused = false;
+				arm();
+			});
+		}
+
+		// Stops for good. The listening socket is only let go of by the ring once the accept
+		// has been cancelled, so this comes before closing it for a hand-off to be clean.
+		void close() {
+			asio::dispatch(strand, [this]() {
+				closed = true;
+				if (armed)
+					cancel();
+				asio::error_code ignored;
+				notify.close(ignored);
+			});
+		}
+
+	private:
+		enum : std::uint64_t { accept_op = 1, cancel_op = 2 };
+
+		bool setup() {
+			io_uring_params p;
+			std::memset(&p, 0, sizeof(p));
+			// Room for a burst of connections between two wake-ups. A multishot accept whose
+			// completions overflow the queue ends, and is armed again.
+			p.flags = IORING_SETUP_CQSIZE;
+			p.cq_entries = 256;
+			ring = static_cast<int>(::syscall(__NR_io_uring_setup, 4, &p));
+			if (ring < 0)
+				return false;
+			sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+			cq_size = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+			bool single = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+			if (single)
+				sq_size = cq_size = std::max(sq_size, cq_size);
+			sq_map = map(sq_size, IORING_OFF_SQ_RING);
+			cq_map = single ? sq_map : map(cq_size, IORING_OFF_CQ_RING);
+			sqes_size = p.sq_entries * sizeof(io_uring_sqe);
+			sqes = static_cast<io_uring_sqe*>(map(sqes_size, IORING_OFF_SQES));
+			if (!sq_map || !cq_map || !sqes)
+				return false;
+			auto sq = static_cast<char*>(sq_map);
+			sq_tail = reinterpret_cast<unsigned*>(sq + p.sq_off.tail);
+			sq_mask = *reinterpret_cast<unsigned*>(sq + p.sq_off.ring_mask);
+			sq_array = reinterpret_cast<unsigned*>(sq + p.sq_off.array);
+			auto cq = static_cast<char*>(cq_map);
+			cq_head = reinterpret_cast<unsigned*>(cq + p.cq_off.head);
+			cq_tail = reinterpret_cast<unsigned*>(cq + p.cq_off.tail);
+			cq_mask = *reinterpret_cast<unsigned*>(cq + p.cq_off.ring_mask);
+			cqes = reinterpret_cast<io_uring_cqe*>(cq + p.cq_off.cqes);
+
+			int efd = ::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+			if (efd < 0)
+				return false;
+			if (::syscall(__NR_io_uring_register, ring, IORING_REGISTER_EVENTFD, &efd, 1) < 0) {
+				::close(efd);
+				return false;
+			}
+			asio::error_code ec;
+			notify.assign(efd, ec);
+			if (ec) {
+				::close(efd);
+				return false;
+			}
+			return true;
+		}
+
+		void* map(std::size_t size, off_t offset) {
+			void* p = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, offset);
+			return p == MAP_FAILED ? nullptr : p;
+		}
+
+		// There are never more than the accept and its cancellation under way, so the
+		// submission queue always has room
+		void submit(io_uring_sqe const& e) {
+			unsigned tail = *sq_tail;
+			unsigned i = tail & sq_mask;
+			sqes[i] = e;
+			sq_array[i] = i;
+			__atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+			int r;
+			do {
+				r = static_cast<int>(::syscall(__NR_io_uring_enter, ring, 1, 0, 0, nullptr, 0));
+			} while (r < 0 && errno == EINTR);
+		}
+
+		void arm() {
+			if (armed || paused || closed || failed)
+				return;
+			io_uring_sqe e;
+			std::memset(&e, 0, sizeof(e));
+			e.opcode = IORING_OP_ACCEPT;
+			e.fd = listener;
+			e.ioprio = IORING_ACCEPT_MULTISHOT;
+			e.accept_flags = SOCK_CLOEXEC;
+			e.user_data = accept_op;
+			submit(e);
+			armed = true;
+		}
+
+		void cancel() {
+			io_uring_sqe e;
+			std::memset(&e, 0, sizeof(e));
+			e.opcode = IORING_OP_ASYNC_CANCEL;
+			e.fd = -1;
+			e.addr = accept_op;
+			e.user_data = cancel_op;
+			submit(e);
+		}
+
+		void wait() {
+			notify.async_wait(asio::posix::stream_descriptor::wait_read, [this](asio::error_code ec) {
+				if (ec)
+					return;
+				std::uint64_t n;
+				while (::read(notify.native_handle(), &n, sizeof(n)) < 0 && errno == EINTR) { }
+				reap();
+				if (!closed)
+					wait();
+			});
+		}
+
+		// Everything that has completed, in one go
+		void reap() {
+			unsigned head = *cq_head;
+			unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+			for (; head != tail; ++head) {
+				auto c = cqes[head & cq_mask];
+				// Handed back before the handler runs, which may pause() or close()
+				__atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+				if (c.user_data != accept_op)
+					continue;
+				if ((c.flags & IORING_CQE_F_MORE) == 0)
+					armed = false;
+				if (c.res >= 0) {
+					if (closed)
+						::close(c.res);
+					else
+						handler({}, c.res);
+				}
+				else if (c.res != -ECANCELED && !closed) {
+					failed = true;
+					asio::error_code ec;
+					// An accept that is not multishot is refused as a whole
+					if (c.res == -EINVAL)
+						ec = asio::error::operation_not_supported;
+					else
+						ec.assign(-c.res, asio::error::get_system_category());
+					handler(ec, -1);
+				}
+			}
+			arm();
+		}
+
+		asio::strand<asio::io_context::executor_type> strand;
+		asio::posix::stream_descriptor notify; // the eventfd the ring signals completions on
+		AcceptFunc handler;
+		int listener = -1;
+		int ring = -1;
+		void* sq_map = nullptr;
+		void* cq_map = nullptr;
+		std::size_t sq_size = 0, cq_size = 0, sqes_size = 0;
+		io_uring_sqe* sqes = nullptr;
+		unsigned* sq_tail = nullptr;
+		unsigned* sq_array = nullptr;
+		unsigned sq_mask = 0;
+		unsigned* cq_head = nullptr;
+		unsigned* cq_tail = nullptr;
+		unsigned cq_mask = 0;
+		io_uring_cqe* cqes = nullptr;
+		bool armed = false, paused = false, closed = false, failed = false;
+	}; // class UringAcceptor
+} // namespace bb
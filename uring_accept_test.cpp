@@ -0,0 +1,177 @@
+// Checks accepting through io_uring: UringAcceptor by itself takes bursts of connections,
+// pauses and resumes, and lets go of the listening socket once closed, and a Server built
+// with BB_IO_URING answers on connections it accepted that way, stops taking them while it
+// is full, and refuses them once stopped.
+//   g++ -std=c++17 -O2 -DBB_IO_URING uring_accept_test.cpp -o uring_accept_test -lpthread
+//   uring_accept_test
+
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define ASIO_STANDALONE 1
+#define ASIO_NO_DEPRECATED 1
+#if !defined(BB_IO_URING)
+#define BB_IO_URING 1
+#endif // !defined(BB_IO_URING)
+
+#include "server.hpp"
+#include "test_support.hpp"
+
+using namespace bb;
+using namespace std::chrono_literals;
+
+// false where the kernel will not have io_uring or multishot accept, and the rest is skipped
+static bool acceptor() {
+	asio::io_context io;
+	asio::ip::tcp::acceptor listener(io, { asio::ip::address_v4::loopback(), 0 });
+	auto endpoint = listener.local_endpoint();
+	std::atomic<int> accepted{ 0 };
+	std::atomic<bool> unsupported{ false };
+	UringAcceptor ring(io);
+	bool started = ring.start(listener.native_handle(), [&](asio::error_code ec, int fd) {
+		if (ec) {
+			unsupported = ec == asio::error::operation_not_supported;
+			return;
+		}
+		++accepted;
+		::close(fd);
+	});
+	if (!started) {
+		std::cout << "no io_uring here, skipped\n";
+		return false;
+	}
+	auto work = asio::make_work_guard(io);
+	std::thread thread([&io]() { io.run(); });
+
+	asio::io_context client;
+	std::vector<std::unique_ptr<asio::ip::tcp::socket>> socks;
+	auto connect = [&](int n) {
+		for (int i = 0; i < n; ++i) {
+			socks.push_back(std::make_unique<asio::ip::tcp::socket>(client));
+			socks.back()->connect(endpoint);
+		}
+	};
+	connect(1);
+	bool ok = eventually([&]() { return accepted == 1 || unsupported; });
+	if (unsupported) {
+		std::cout << "no multishot accept here, skipped\n";
+		ring.close();
+		work.reset();
+		thread.join();
+		return false;
+	}
+	check(ok, "a connection is accepted");
+	// More than fit in the completion queue at once, so the accept is armed again
+	connect(300);
+	check(eventually([&]() { return accepted == 301; }), "a burst of connections is accepted, one submission for them all");
+
+	ring.pause();
+	std::this_thread::sleep_for(20ms);
+	connect(3);
+	std::this_thread::sleep_for(50ms);
+	check(accepted == 301, "nothing is accepted while paused");
+	ring.resume();
+	check(eventually([&]() { return accepted == 304; }), "those that waited are accepted on resume()");
+
+	ring.close();
+	std::this_thread::sleep_for(20ms);
+	listener.close();
+	asio::ip::tcp::socket late(client);
+	asio::error_code ec;
+	late.connect(endpoint, ec);
+	check(ec == asio::error::connection_refused, "the listening socket is let go of once closed");
+
+	work.reset();
+	thread.join();
+	return true;
+}
+
+// Sends a GET and reads the answer, within a second, or returns ""
+static std::string get(asio::ip::tcp::socket& sock, std::string const& path) {
+	std::string req = "GET " + path + " HTTP/1.1\r\nHost: x\r\n\r\n";
+	asio::write(sock, asio::buffer(req));
+	timeval tv{ 1, 0 };
+	::setsockopt(sock.native_handle(), SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	std::string in;
+	char buf[1024];
+	while (in.find("\r\n\r\n") == std::string::npos || in.size() - in.find("\r\n\r\n") - 4 < path.size()) {
+		asio::error_code ec;
+		auto n = sock.read_some(asio::buffer(buf), ec);
+		if (ec)
+			return {};
+		in.append(buf, n);
+	}
+	return in.substr(in.find("\r\n\r\n") + 4);
+}
+
+static void full(Server& s, asio::ip::tcp::endpoint const& endpoint) {
+	asio::io_context io;
+	asio::ip::tcp::socket a(io), b(io), c(io);
+	a.connect(endpoint);
+	b.connect(endpoint);
+	check(get(a, "/a") == "/a" && get(b, "/b") == "/b", "up to max_connections");
+	// Connected in the backlog, not accepted
+	c.connect(endpoint);
+	std::string req = "GET /c HTTP/1.1\r\nHost: x\r\n\r\n";
+	asio::write(c, asio::buffer(req));
+	std::this_thread::sleep_for(50ms);
+	check(c.available() == 0 && s.connection_count() == 2, "no more are accepted while the server is full");
+	a.close();
+	timeval tv{ 1, 0 };
+	::setsockopt(c.native_handle(), SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	char buf[256];
+	asio::error_code ec;
+	auto n = c.read_some(asio::buffer(buf), ec);
+	check(!ec && std::string(buf, n).find("/c") != std::string::npos, "accepting resumes once there is room");
+	b.close();
+	c.close();
+}
+
+static void server(ServerOptions options, unsigned int threads) {
+	Server s(0, options);
+	s.limits().max_connections = 2;
+	s.limits().accept_retry = 5ms;
+	s.add_route("/{x}", Methods::GET, [](Captures const& caps, Methods, Connection::ptr con) {
+		con->make_response(200, "", "/" + std::string(caps[1]));
+	});
+	std::thread thread([&s, threads]() { s.run(threads); });
+	std::this_thread::sleep_for(100ms);
+	asio::ip::tcp::endpoint endpoint(asio::ip::address_v4::loopback(), s.port());
+
+	asio::io_context io;
+	bool ok = true;
+	for (int i = 0; i < 50; ++i) {
+		asio::ip::tcp::socket sock(io);
+		sock.connect(endpoint);
+		ok = ok && get(sock, "/n" + std::to_string(i)) == "/n" + std::to_string(i);
+		sock.close();
+		eventually([&s]() { return s.connection_count() == 0; });
+	}
+	check(ok, "connections accepted through io_uring are answered");
+
+	// With a context per thread the others still accept, and close what they take past the
+	// limit, as Limits::max_connections allows
+	if (threads == 1)
+		full(s, endpoint);
+
+	s.stop(100ms);
+	thread.join();
+	asio::ip::tcp::socket late(io);
+	asio::error_code ec;
+	late.connect(endpoint, ec);
+	check(ec == asio::error::connection_refused, "a stopped server refuses connections");
+}
+
+int main() {
+	if (acceptor()) {
+		server(ServerOptions::None, 1);
+		server(ServerOptions::PerThreadContext, 2);
+	}
+	return finish();
+}